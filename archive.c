@@ -0,0 +1,574 @@
+/** 
+ *  \file archive.c
+ *  Telemetry archive.
+ *  Every completed poll of a UPS is kept in an append-only archive so that
+ *  months of readings are available for capacity planning, not just what 
+ *  scrolls across the charts. 
+ *
+ *  The client thread (or, with a shared collector, the GUI thread) only
+ *  ever copies the poll into a single producer, single consumer queue
+ *  (archiveSample()), all the file work is done by a writer thread which
+ *  empties the queue every ARCHIVE_FLUSH milliseconds. If the writer falls
+ *  behind the queue fills and polls are dropped rather than holding up the
+ *  client.
+ *
+ *  Each UPS gets a directory of segment files, one tier per file prefix:
+ *  raw-YYYYMMDD.gka holds every poll, min-YYYYMM.gka and hour-YYYY.gka hold
+ *  the count, min, max and average of every field over each minute and hour.
+ *  A segment starts with ARCHIVE_MAGIC, the version, the tier and the number
+ *  of values in each record. Records follow back to back: the time in 
+ *  milliseconds and each fixed point value, all stored as zigzag varints of 
+ *  the difference from the previous record of the segment. Polls a second 
+ *  apart with steady readings take around six bytes. A summary still in
+ *  progress when the archive stops is written with the polls it has, and
+ *  replaced by the whole period when the archive starts again within it, so
+ *  a summary segment never holds two records for the same start time.
+ *  Segments older than 
+ *  the retention of their tier are deleted as new ones are started, which 
+ *  keeps the disk use bounded. All times are UTC.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<stddef.h>
+#include<string.h>
+#include<time.h>
+#include<errno.h>
+#include<unistd.h>
+#include<dirent.h>
+#include<pthread.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include"archive.h"
+
+/*! Fields stored for each poll and the factor used to turn them into fixed point */
+static const struct
+{
+    gint   var;    /*!< VAR_* reading stored.              */
+    gfloat scale;  /*!< Multiplier applied before storing. */
+} archiveFields[ARCHIVE_FIELDS] =
+{
+    { VAR_IN_VOLTAGE, 10.0  },
+    { VAR_IN_FREQ,    100.0 },
+    { VAR_UPS_LOAD,   10.0  },
+    { VAR_BAT_LEVEL,  10.0  }
+};
+
+/*! File naming, summary period and retention of each tier */
+static const struct
+{
+    const gchar *prefix;   /*!< Segment file name prefix.                        */
+    const gchar *period;   /*!< strftime() format of the period a segment holds. */
+    gint64       bucket;   /*!< Summary period in milliseconds (0 for raw).      */
+    gint         keepDays; /*!< Days of segments kept.                           */
+    gint         count;    /*!< Values in each record.                           */
+} tiers[TIER_COUNT] =
+{
+    { "raw",  "%Y%m%d", 0,       ARCHIVE_KEEP_RAW,    ARCHIVE_FIELDS      },
+    { "min",  "%Y%m",   60000,   ARCHIVE_KEEP_MINUTE, ARCHIVE_TIER_VALUES },
+    { "hour", "%Y",     3600000, ARCHIVE_KEEP_HOUR,   ARCHIVE_TIER_VALUES }
+};
+
+static ArchiveEntry queue[ARCHIVE_QUEUE];   /*!< Polls waiting for the writer thread.              */
+static guint        queueHead = 0;          /*!< Next slot to fill, only changed by the producer.  */
+static guint        queueTail = 0;          /*!< Next slot to write, only changed by the writer.   */
+static guint        queueDropped = 0;       /*!< Polls lost because the queue was full.            */
+
+static gint         running = 0;            /*!< TRUE while the writer thread should keep going.   */
+static pthread_t    writer;                 /*!< The writer thread.                                */
+static pthread_mutex_t stopLock = PTHREAD_MUTEX_INITIALIZER; /*!< Protects running for stopCond.   */
+static pthread_cond_t  stopCond = PTHREAD_COND_INITIALIZER;  /*!< Signalled by stopArchive().      */
+
+static gchar       *archiveDir = NULL;      /*!< Directory holding a subdirectory for each UPS.   */
+static ArchiveUPS  *archived[MAX_UPS];      /*!< State of each UPS seen by the writer.             */
+static gint         archivedCount = 0;      /*!< Number of entries in archived in use.             */
+
+/** Map a signed value onto an unsigned one so small magnitudes stay small. */
+static guint64 zigzag(gint64 value)
+{
+    return ((guint64)value << 1) ^ (guint64)(value >> 63);
+}
+
+/** Reverse zigzag(). */
+static gint64 unzigzag(guint64 value)
+{
+    return (gint64)(value >> 1) ^ -(gint64)(value & 1);
+}
+
+/** Write a varint, seven bits to the byte with the top bit set on all but the last. */
+static void putVarint(FILE *file, guint64 value)
+{
+    while(value >= 0x80) {
+        putc((gint)(value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    putc((gint)value, file);
+}
+
+/** Number of bytes putVarint() takes for a value. */
+static gint varintLength(guint64 value)
+{
+    gint length = 1;
+
+    while(value >= 0x80) {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+/** Number of bytes a record takes, stored after the one given by prevTime and prev. */
+static glong recordLength(gint64 prevTime, const gint64 *prev, gint64 time, const gint64 *values, gint count)
+{
+    glong length = varintLength(zigzag(time - prevTime));
+    gint  index;
+
+    for(index = 0; index < count; index++) length += varintLength(zigzag(values[index] - prev[index]));
+    return length;
+}
+
+/** Read a varint from a buffer.
+ *  Returns FALSE if the buffer ends part way through it.
+ */
+static gboolean getVarint(const guchar **pos, const guchar *end, guint64 *value)
+{
+    gint shift = 0;
+
+    *value = 0;
+    while((*pos < end) && (shift < 64)) {
+        *value |= (guint64)(**pos & 0x7f) << shift;
+        if(!(*(*pos)++ & 0x80)) return TRUE;
+        shift += 7;
+    }
+    return FALSE;
+}
+
+/** Decode a segment file.
+ *  Calls func for every complete record in the file. Returns the length of
+ *  the file up to the end of the last complete record (a crash can leave a
+ *  partial record behind), or -1 if the file is missing or is not a segment.
+ *
+ *  \par Arguments:
+ *  \arg \c path - name of the segment file.
+ *  \arg \c func - called for each record, may be NULL.
+ *  \arg \c data - passed to func.
+ */
+glong readSegment(const gchar *path, ArchiveRecordFunc func, gpointer data)
+{
+    const guchar *pos;
+    const guchar *end;
+    const guchar *record;
+    guchar       *buffer;
+    guint64       raw;
+    gint64        time = 0;
+    gint64        values[ARCHIVE_TIER_VALUES];
+    glong         length;
+    gint          count;
+    gint          index;
+    FILE         *file;
+
+    if((file = fopen(path, "rb")) == NULL) return -1;
+
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    rewind(file);
+
+    buffer = g_malloc(MAX(length, 1));
+    if((length < 8) || (fread(buffer, 1, length, file) != length) || memcmp(buffer, ARCHIVE_MAGIC, 4) ||
+       (buffer[4] != ARCHIVE_VERSION) || (buffer[6] > ARCHIVE_TIER_VALUES)) {
+        fclose(file);
+        g_free(buffer);
+        return -1;
+    }
+    fclose(file);
+
+    count = buffer[6];
+    memset(values, 0, sizeof(values));
+    end = buffer + length;
+
+    for(record = pos = buffer + 8; pos < end; record = pos) {
+        if(!getVarint(&pos, end, &raw)) break;
+        time += unzigzag(raw);
+
+        for(index = 0; index < count; index++) {
+            if(!getVarint(&pos, end, &raw)) break;
+            values[index] += unzigzag(raw);
+        }
+        if(index < count) break;
+
+        if(func) func(time, values, count, data);
+    }
+
+    length = record - buffer;
+    g_free(buffer);
+    return length;
+}
+
+/** readSegment() callback used to pick up where an existing segment left off.
+ *  The record before the last is kept too, see takeBackRecord().
+ */
+static void recoverRecord(gint64 time, const gint64 *values, gint count, gpointer data)
+{
+    ArchiveSegment *segment = (ArchiveSegment *)data;
+
+    segment -> earlierTime = segment -> prevTime;
+    memcpy(segment -> earlier, segment -> prev, count * sizeof(gint64));
+    segment -> lastSize = recordLength(segment -> prevTime, segment -> prev, time, values, count);
+    segment -> prevTime = time;
+    memcpy(segment -> prev, values, count * sizeof(gint64));
+}
+
+/** Format the period of a tier which contains a given time. */
+static void periodName(gchar *buffer, gsize size, gint tier, gint64 msec)
+{
+    struct tm when;
+    time_t    secs = (time_t)(msec / 1000);
+
+    gmtime_r(&secs, &when);
+    strftime(buffer, size, tiers[tier].period, &when);
+}
+
+/** Delete the segments of a tier which are older than its retention.
+ *  The period names sort in time order, so anything which sorts before the
+ *  period of the cutoff time goes.
+ */
+static void pruneSegments(ArchiveUPS *ups, gint tier, gint64 now)
+{
+    struct dirent *entry;
+    DIR           *dir;
+    gchar          cutoff[16];
+    gchar         *path;
+    gint           prefixLen = strlen(tiers[tier].prefix);
+
+    periodName(cutoff, sizeof(cutoff), tier, now - (gint64)tiers[tier].keepDays * 86400 * 1000);
+
+    if((dir = opendir(ups -> dir)) == NULL) return;
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry -> d_name, tiers[tier].prefix, prefixLen) || (entry -> d_name[prefixLen] != '-')) continue;
+        if(strcmp(entry -> d_name + prefixLen + 1, cutoff) >= 0) continue;
+
+        path = g_strdup_printf("%s/%s", ups -> dir, entry -> d_name);
+        unlink(path);
+        g_free(path);
+    }
+    closedir(dir);
+}
+
+/** Make sure the segment covering a given time is open for a tier.
+ *  An existing segment is decoded to recover the last record, which the 
+ *  next one is stored relative to, and trimmed of any partial record. 
+ *  Moving on to another segment is also the moment to prune old ones.
+ *
+ *  \return the segment, or NULL if it could not be opened.
+ */
+static ArchiveSegment *openSegment(ArchiveUPS *ups, gint tier, gint64 msec)
+{
+    ArchiveSegment *segment = &ups -> segments[tier];
+    gchar           period[16];
+    gchar          *path;
+    glong           length;
+    guchar          header[8];
+
+    periodName(period, sizeof(period), tier, msec);
+    if(segment -> file && !strcmp(segment -> period, period)) return segment;
+
+    if(segment -> file) fclose(segment -> file);
+    memset(segment, 0, sizeof(ArchiveSegment));
+    strcpy(segment -> period, period);
+    segment -> count = tiers[tier].count;
+    pruneSegments(ups, tier, msec);
+
+    path   = g_strdup_printf("%s/%s-%s.gka", ups -> dir, tiers[tier].prefix, period);
+    length = readSegment(path, recoverRecord, segment);
+
+    if((length >= 0) && (truncate(path, length) == 0) && ((segment -> file = fopen(path, "ab")) != NULL)) {
+        g_free(path);
+        return segment;
+    }
+
+    /* New (or unreadable) segment, start it from scratch */
+    segment -> prevTime = 0;
+    memset(segment -> prev, 0, sizeof(segment -> prev));
+    if((segment -> file = fopen(path, "wb")) != NULL) {
+        memcpy(header, ARCHIVE_MAGIC, 4);
+        header[4] = ARCHIVE_VERSION;
+        header[5] = tier;
+        header[6] = segment -> count;
+        header[7] = 0;
+        fwrite(header, 1, sizeof(header), segment -> file);
+    }
+    g_free(path);
+    return segment -> file ? segment : NULL;
+}
+
+/** Append a record to the segment of a tier covering its time. */
+static void writeRecord(ArchiveUPS *ups, gint tier, gint64 msec, const gint64 *values)
+{
+    ArchiveSegment *segment;
+    gint            index;
+
+    if((segment = openSegment(ups, tier, msec)) == NULL) return;
+
+    segment -> earlierTime = segment -> prevTime;
+    memcpy(segment -> earlier, segment -> prev, segment -> count * sizeof(gint64));
+    segment -> lastSize = recordLength(segment -> prevTime, segment -> prev, msec, values, segment -> count);
+
+    putVarint(segment -> file, zigzag(msec - segment -> prevTime));
+    segment -> prevTime = msec;
+
+    for(index = 0; index < segment -> count; index++) {
+        putVarint(segment -> file, zigzag(values[index] - segment -> prev[index]));
+        segment -> prev[index] = values[index];
+    }
+}
+
+/** Remove the last record of a segment.
+ *  Its values are copied to last. Returns FALSE, leaving the segment alone,
+ *  if the file could not be cut short.
+ */
+static gboolean takeBackRecord(ArchiveSegment *segment, gint64 *last)
+{
+    struct stat info;
+
+    fflush(segment -> file);
+    if(fstat(fileno(segment -> file), &info) || ftruncate(fileno(segment -> file), info.st_size - segment -> lastSize)) {
+        return FALSE;
+    }
+
+    memcpy(last, segment -> prev, segment -> count * sizeof(gint64));
+    segment -> prevTime = segment -> earlierTime;
+    memcpy(segment -> prev, segment -> earlier, segment -> count * sizeof(gint64));
+    segment -> lastSize = 0;
+    return TRUE;
+}
+
+/** Write out a summary and empty it.
+ *  If the last record of the segment is a summary of the same period, cut
+ *  short when the archive was last stopped (see closeAll()), it is taken
+ *  back and its polls counted in this one instead.
+ */
+static void flushBucket(ArchiveUPS *ups, gint tier)
+{
+    ArchiveBucket  *bucket = &ups -> buckets[tier];
+    ArchiveSegment *segment;
+    gint64          values[ARCHIVE_TIER_VALUES];
+    gint64          last[ARCHIVE_TIER_VALUES];
+    gint            field;
+
+    if(bucket -> count == 0) return;
+
+    if(((segment = openSegment(ups, tier, bucket -> start)) != NULL) && segment -> lastSize &&
+       (segment -> prevTime == bucket -> start) && takeBackRecord(segment, last)) {
+        for(field = 0; field < ARCHIVE_FIELDS; field++) {
+            bucket -> min[field]  = MIN(bucket -> min[field], last[1 + field * 3]);
+            bucket -> max[field]  = MAX(bucket -> max[field], last[2 + field * 3]);
+            bucket -> sum[field] += last[3 + field * 3] * last[0];
+        }
+        bucket -> count += last[0];
+    }
+
+    values[0] = bucket -> count;
+    for(field = 0; field < ARCHIVE_FIELDS; field++) {
+        values[1 + field * 3] = bucket -> min[field];
+        values[2 + field * 3] = bucket -> max[field];
+        values[3 + field * 3] = (bucket -> sum[field] + bucket -> count / 2) / bucket -> count;
+    }
+    writeRecord(ups, tier, bucket -> start, values);
+
+    memset(bucket, 0, sizeof(ArchiveBucket));
+}
+
+/** Add a poll to the summary of a tier, writing out the previous summary
+ *  first if the poll belongs to a later period.
+ */
+static void addToBucket(ArchiveUPS *ups, gint tier, const ArchiveEntry *entry)
+{
+    ArchiveBucket *bucket = &ups -> buckets[tier];
+    gint64         start  = entry -> time - entry -> time % tiers[tier].bucket;
+    gint           field;
+
+    if(bucket -> count && (bucket -> start != start)) flushBucket(ups, tier);
+
+    bucket -> start = start;
+    for(field = 0; field < ARCHIVE_FIELDS; field++) {
+        if(!bucket -> count || (entry -> values[field] < bucket -> min[field])) bucket -> min[field] = entry -> values[field];
+        if(!bucket -> count || (entry -> values[field] > bucket -> max[field])) bucket -> max[field] = entry -> values[field];
+        bucket -> sum[field] += entry -> values[field];
+    }
+    bucket -> count++;
+}
+
+/** Find the archive state of a UPS, creating it the first time it is seen. */
+static ArchiveUPS *findUPS(const gchar *name)
+{
+    ArchiveUPS *ups;
+    gchar      *pos;
+    gint        index;
+
+    for(index = 0; index < archivedCount; index++) {
+        if(!strcmp(archived[index] -> name, name)) return archived[index];
+    }
+    if(archivedCount == MAX_UPS) return NULL;
+
+    ups = g_new0(ArchiveUPS, 1);
+    strcpy(ups -> name, name);
+    ups -> dir = g_strdup_printf("%s/%s", archiveDir, name);
+    for(pos = ups -> dir + strlen(archiveDir) + 1; *pos; pos++) {
+        if(*pos == '/') *pos = '_';
+    }
+    mkdir(ups -> dir, 0755);
+
+    archived[archivedCount++] = ups;
+    return ups;
+}
+
+/** Close every segment and throw away the UPS states.
+ *  Summaries still in progress are written with the polls they have, and
+ *  completed by flushBucket() if the archive is started again before their
+ *  period is over.
+ */
+static void closeAll(void)
+{
+    gint index;
+    gint tier;
+
+    for(index = 0; index < archivedCount; index++) {
+        for(tier = TIER_MINUTE; tier < TIER_COUNT; tier++) flushBucket(archived[index], tier);
+        for(tier = 0; tier < TIER_COUNT; tier++) {
+            if(archived[index] -> segments[tier].file) fclose(archived[index] -> segments[tier].file);
+        }
+        g_free(archived[index] -> dir);
+        g_free(archived[index]);
+    }
+    archivedCount = 0;
+}
+
+/** Write every queued poll to disk. */
+static void drainQueue(void)
+{
+    ArchiveEntry *entry;
+    ArchiveUPS   *ups;
+    gint64        values[ARCHIVE_FIELDS];
+    guint         head = __atomic_load_n(&queueHead, __ATOMIC_ACQUIRE);
+    guint         tail = queueTail;
+    gint          index;
+    gint          tier;
+
+    for(; tail != head; tail++) {
+        entry = &queue[tail % ARCHIVE_QUEUE];
+        if((ups = findUPS(entry -> name)) == NULL) continue;
+
+        for(index = 0; index < ARCHIVE_FIELDS; index++) values[index] = entry -> values[index];
+        writeRecord(ups, TIER_RAW, entry -> time, values);
+
+        for(tier = TIER_MINUTE; tier < TIER_COUNT; tier++) addToBucket(ups, tier, entry);
+    }
+    __atomic_store_n(&queueTail, tail, __ATOMIC_RELEASE);
+
+    for(index = 0; index < archivedCount; index++) {
+        for(tier = 0; tier < TIER_COUNT; tier++) {
+            if(archived[index] -> segments[tier].file) fflush(archived[index] -> segments[tier].file);
+        }
+    }
+}
+
+/** Archive writer thread.
+ *  Wakes every ARCHIVE_FLUSH milliseconds (or when stopArchive() asks it 
+ *  to finish) and writes out whatever the client has queued.
+ */
+static void *archiveWriter(void *arg)
+{
+    struct timespec deadline;
+    gboolean        stop;
+
+    do {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += ARCHIVE_FLUSH / 1000;
+        deadline.tv_nsec += (ARCHIVE_FLUSH % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&stopLock);
+        if(running) pthread_cond_timedwait(&stopCond, &stopLock, &deadline);
+        stop = !running;
+        pthread_mutex_unlock(&stopLock);
+
+        drainQueue();
+    } while(!stop);
+
+    closeAll();
+    return NULL;
+}
+
+/** Start the archive writer thread.
+ *  Polls passed to archiveSample() are archived under dir from now on.
+ *  Returns FALSE if the thread could not be started.
+ */
+gboolean startArchive(const gchar *dir)
+{
+    if(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return TRUE;
+
+    g_free(archiveDir);
+    archiveDir = g_strdup(dir);
+    mkdir(archiveDir, 0755);
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if(pthread_create(&writer, NULL, archiveWriter, NULL)) {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/** Stop the archive writer thread.
+ *  Anything still queued is written out before this returns.
+ */
+void stopArchive(void)
+{
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&stopLock);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&stopCond);
+    pthread_mutex_unlock(&stopLock);
+
+    pthread_join(writer, NULL);
+}
+
+/** Queue a poll for the archive.
+ *  Called by the client thread after each complete poll cycle, or by the
+ *  GUI thread for snapshots from the snapshot bus - never both at once, as
+ *  the client is stopped before the bus is used. This only
+ *  copies the values into the queue, so it never blocks, and does nothing
+ *  at all when the archive is not running. A poll missing any of the
+ *  archived readings (see ups_Fetched) is skipped, a record has no way to
+ *  leave one out.
+ */
+void archiveSample(const struct UPSData *status)
+{
+    ArchiveEntry   *entry;
+    struct timespec now;
+    guint           tail;
+    gint            field;
+
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+    if((status -> ups_Fetched & ARCHIVE_VARS) != ARCHIVE_VARS) return;
+
+    tail = __atomic_load_n(&queueTail, __ATOMIC_ACQUIRE);
+    if(queueHead - tail >= ARCHIVE_QUEUE) {
+        queueDropped++;
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    entry = &queue[queueHead % ARCHIVE_QUEUE];
+    entry -> time = (gint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    strcpy(entry -> name, status -> ups_Name);
+    for(field = 0; field < ARCHIVE_FIELDS; field++) {
+        entry -> values[field] = (gint32)(*(const gfloat *)((const gchar *)status + upsVars[archiveFields[field].var].offset) * 
+                                          archiveFields[field].scale + 0.5);
+    }
+    __atomic_store_n(&queueHead, queueHead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,102 @@
+/** 
+ *  \file archive.h
+ *  Telemetry archive header.
+ *  The client thread hands every completed poll to the archive, which a
+ *  writer thread of its own appends to compact segment files on disk. See
+ *  archive.c for the file format.
+ */
+
+#ifndef UPS_ARCHIVE
+#define UPS_ARCHIVE
+
+#include<stdio.h>
+#include<glib.h>
+#include"nut_connect.h"
+
+/*! Number of polls which can wait for the writer thread, further polls are dropped */
+#define ARCHIVE_QUEUE 1024
+
+/*! Values stored for each poll: input voltage, input frequency, load and battery level */
+#define ARCHIVE_FIELDS 4
+
+/*! The same as a mask of VAR_* bits, the readings the client must fetch while archiving */
+#define ARCHIVE_VARS ((1 << VAR_IN_VOLTAGE) | (1 << VAR_IN_FREQ) | (1 << VAR_UPS_LOAD) | (1 << VAR_BAT_LEVEL))
+
+/*! Values stored for each tier record: sample count, then min, max and average of each field */
+#define ARCHIVE_TIER_VALUES (1 + 3 * ARCHIVE_FIELDS)
+
+/*! How often the writer thread wakes up to write queued polls, in milliseconds */
+#define ARCHIVE_FLUSH 1000
+
+/*! \name Retention of each tier, in days */
+/*@{*/
+#define ARCHIVE_KEEP_RAW    14    /*!< Every poll.          */
+#define ARCHIVE_KEEP_MINUTE 366   /*!< 1 minute summaries.  */
+#define ARCHIVE_KEEP_HOUR   3650  /*!< 1 hour summaries.    */
+/*@}*/
+
+/*! Archive tiers */
+enum
+{
+    TIER_RAW,    /*!< Every poll, one segment per day.               */
+    TIER_MINUTE, /*!< 1 minute min/max/avg, one segment per month.   */
+    TIER_HOUR,   /*!< 1 hour min/max/avg, one segment per year.      */
+    TIER_COUNT
+};
+
+/*! Segment files start with "GKNA" */
+#define ARCHIVE_MAGIC "GKNA"
+
+/*! Bump whenever the record encoding changes */
+#define ARCHIVE_VERSION 1
+
+/*! A poll waiting in the queue for the writer thread. */
+typedef struct
+{
+    gint64 time;                   /*!< Wall clock time of the poll, milliseconds since the epoch. */
+    gchar  name[MAX_UPSNAME];      /*!< UPS specification, used to name its archive directory.    */
+    gint32 values[ARCHIVE_FIELDS]; /*!< Fixed point values, see archiveFields in archive.c.        */
+} ArchiveEntry;
+
+/*! An open segment file of one tier. */
+typedef struct
+{
+    FILE   *file;                        /*!< Open for appending, or NULL.                        */
+    gchar   period[16];                  /*!< Period covered by the open file, e.g. "20021231".   */
+    gint    count;                       /*!< Values in each record.                              */
+    gint64  prevTime;                    /*!< Time of the last record, records store deltas.      */
+    gint64  prev[ARCHIVE_TIER_VALUES];   /*!< Values of the last record.                          */
+    gint64  earlierTime;                 /*!< Time of the record before it.                       */
+    gint64  earlier[ARCHIVE_TIER_VALUES];/*!< Its values, for taking the last record back.        */
+    glong   lastSize;                    /*!< Bytes of the last record, 0 if there is none.       */
+} ArchiveSegment;
+
+/*! A summary being built up for one of the TIER_MINUTE and TIER_HOUR tiers. */
+typedef struct
+{
+    gint64 start;                        /*!< Start of the period covered, 0 if empty.            */
+    gint   count;                        /*!< Number of polls added.                              */
+    gint64 min[ARCHIVE_FIELDS];          /*!< Lowest value of each field.                         */
+    gint64 max[ARCHIVE_FIELDS];          /*!< Highest value of each field.                        */
+    gint64 sum[ARCHIVE_FIELDS];          /*!< Total of each field, for the average.               */
+} ArchiveBucket;
+
+/*! Archive state of one UPS, owned by the writer thread. */
+typedef struct
+{
+    gchar          name[MAX_UPSNAME];    /*!< UPS specification.                                  */
+    gchar         *dir;                  /*!< Directory holding its segments.                     */
+    ArchiveSegment segments[TIER_COUNT]; /*!< Open segment of each tier.                          */
+    ArchiveBucket  buckets[TIER_COUNT];  /*!< Summaries in progress (unused for TIER_RAW).        */
+} ArchiveUPS;
+
+/*! Called by readSegment() for each record, values holds count values. */
+typedef void (*ArchiveRecordFunc)(gint64 time, const gint64 *values, gint count, gpointer data);
+
+/* functions exported from archive.c */
+extern gboolean startArchive(const gchar *dir);                           /*!< Start the archive writer thread.        */
+extern void stopArchive(void);                                           /*!< Stop the writer thread.                 */
+extern void archiveSample(const struct UPSData *status);                 /*!< Queue a poll, never blocks.             */
+extern glong readSegment(const gchar *path, ArchiveRecordFunc func, gpointer data); /*!< Decode a segment file.    */
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ *  \file bench.c
+ *  Microbenchmarks for the per-poll and per-tick hot paths.
+ *  Times the reply parsing and status flag handling of the client and the
+ *  chart text and updatePlugin() path of the plugin, and reports the time
+ *  and the number of heap allocations each operation takes, so a change
+ *  which makes any of them slower or starts allocating shows up in numbers.
+ *
+ *  Each benchmark is run with a growing number of iterations until a run
+ *  takes at least the minimum time (-t, 200ms by default), that last run is
+ *  reported. Allocations are counted by wrapping malloc() and friends, which
+ *  needs glibc - elsewhere they are reported as "-".
+ *
+ *  Usage: gknutbench [-t ms] [-u upses] [name...]
+ *  Only benchmarks whose names contain one of the given names are run.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<time.h>
+#include"bench.h"
+
+#define BENCH_MIN_TIME   200       /*!< Default minimum run time of a benchmark, in milliseconds. */
+#define BENCH_MAX_ITER   100000000 /*!< Iterations at which to stop growing a run regardless.     */
+#define BENCH_UPSES      2         /*!< Default number of UPSes for the plugin benchmarks.        */
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static gulong allocations = 0; /*!< Heap allocations made so far. */
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+#define ALLOCATIONS() __atomic_load_n(&allocations, __ATOMIC_RELAXED)
+#define COUNTS_ALLOCATIONS TRUE
+#else
+#define ALLOCATIONS() 0
+#define COUNTS_ALLOCATIONS FALSE
+#endif
+
+/** Current value of the monotonic clock in nanoseconds. */
+static gint64 monotonicNsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (gint64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/** Check whether a benchmark was asked for on the command line. */
+static gboolean wanted(const Benchmark *bench, gchar **names, gint count)
+{
+    gint index;
+
+    if(count == 0) return TRUE;
+    for(index = 0; index < count; index++) {
+        if(strstr(bench -> name, names[index])) return TRUE;
+    }
+    return FALSE;
+}
+
+/** Run a benchmark and print its result.
+ *  The iteration count grows until a run lasts minTime, aiming a little past
+ *  it from the rate seen so far so that only a few runs are needed.
+ */
+static void runBenchmark(const Benchmark *bench, gint64 minTime)
+{
+    gint64 start;
+    gint64 elapsed;
+    gulong allocs;
+    glong  iterations = 1;
+    glong  next;
+
+    for(;;) {
+        allocs  = ALLOCATIONS();
+        start   = monotonicNsec();
+        bench -> run(iterations);
+        elapsed = monotonicNsec() - start;
+        allocs  = ALLOCATIONS() - allocs;
+
+        if((elapsed >= minTime) || (iterations >= BENCH_MAX_ITER)) break;
+
+        next = (elapsed > 0) ? (glong)((gdouble)iterations * minTime * 1.2 / elapsed) : iterations * 100;
+        iterations = CLAMP(next, iterations * 2, MIN(iterations * 100, BENCH_MAX_ITER));
+    }
+
+    if(COUNTS_ALLOCATIONS) {
+        printf("%-24s %10ld %12.1f ns/op %8.2f allocs/op\n", bench -> name, iterations,
+               (gdouble)elapsed / iterations, (gdouble)allocs / iterations);
+    } else {
+        printf("%-24s %10ld %12.1f ns/op %8s allocs/op\n", bench -> name, iterations,
+               (gdouble)elapsed / iterations, "-");
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    const Benchmark *bench;
+    UPSClient       *client;
+    gchar            home[] = "/tmp/gknutbench.XXXXXX";
+    gchar           *command;
+    gint64           minTime  = (gint64)BENCH_MIN_TIME * 1000000;
+    gint             upsCount = BENCH_UPSES;
+    int              opt;
+
+    while((opt = getopt(argc, argv, "t:u:")) != -1) {
+        switch(opt) {
+            case 't': minTime  = (gint64)atoi(optarg) * 1000000; break;
+            case 'u': upsCount = CLAMP(atoi(optarg), 1, MAX_UPS); break;
+            default:
+                fprintf(stderr, "Usage: gknutbench [-t ms] [-u upses] [name...]\n");
+                return 2;
+        }
+    }
+
+    /* The plugin keeps its history rings under the home directory */
+    if(mkdtemp(home) == NULL) {
+        perror("gknutbench");
+        return 1;
+    }
+    setenv("GKNUT_BENCH_HOME", home, 1);
+
+    setupClientBench();
+    for(bench = clientBenchmarks; bench -> name; bench++) {
+        if(wanted(bench, argv + optind, argc - optind)) runBenchmark(bench, minTime);
+    }
+    teardownClientBench();
+
+    client = benchClient(upsCount);
+    setupPluginBench(client);
+    for(bench = pluginBenchmarks; bench -> name; bench++) {
+        if(wanted(bench, argv + optind, argc - optind)) runBenchmark(bench, minTime);
+    }
+    teardownPluginBench();
+    freeBenchClient(client);
+
+    command = g_strdup_printf("rm -rf '%s'", home);
+    system(command);
+    g_free(command);
+    return 0;
+}
@@ -0,0 +1,37 @@
+/**
+ *  \file bench.h
+ *  Microbenchmark header.
+ *  The benchmarks build nut_connect.c and gknut.c into their own translation
+ *  units (bench_client.c and bench_plugin.c) so they can reach the static
+ *  functions on the hot paths, and bench.c times them. See bench.c.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include<glib.h>
+#include"../nut_connect.h"
+
+/*! Runs the operation being measured the given number of times. */
+typedef void (*BenchFunc)(glong iterations);
+
+/*! A single benchmark. */
+typedef struct
+{
+    const gchar *name; /*!< Name, as reported and matched on the command line. */
+    BenchFunc    run;  /*!< The benchmark loop.                                */
+} Benchmark;
+
+/* exported from bench_client.c */
+extern const Benchmark clientBenchmarks[];     /*!< Reply parsing and status flag benchmarks, NULL name terminated. */
+extern void setupClientBench(void);            /*!< Set up the clients the parsing benchmarks use.                  */
+extern void teardownClientBench(void);         /*!< Free them again.                                                */
+extern UPSClient *benchClient(gint upsCount);  /*!< A client with one poll of every UPS published, no thread.       */
+extern void freeBenchClient(UPSClient *client); /*!< Free a client returned by benchClient().                       */
+
+/* exported from bench_plugin.c */
+extern const Benchmark pluginBenchmarks[];     /*!< Chart text and update path benchmarks, NULL name terminated.   */
+extern void setupPluginBench(UPSClient *client); /*!< Create the plugin displays for the UPSes of a client.         */
+extern void teardownPluginBench(void);         /*!< Destroy the displays.                                          */
+
+#endif
@@ -0,0 +1,268 @@
+/**
+ *  \file bench_client.c
+ *  Client benchmarks: reply parsing and the status flag scan.
+ *  nut_connect.c is included rather than linked so that its static functions
+ *  can be called directly. The clients used here are set up as launchClient()
+ *  would, but without a thread: each connection is one end of a socketpair
+ *  and the benchmark plays upsd on the other end, so a poll cycle runs
+ *  through exactly the code it runs through in the client thread.
+ */
+
+#include"../nut_connect.c"
+#include"bench.h"
+
+/*! Variables in a LIST VAR reply, as sent by a typical usbhid-ups driver */
+static const gchar *listVarLines[] =
+{
+    "battery.charge \"100\"",
+    "battery.charge.low \"10\"",
+    "battery.runtime \"2430\"",
+    "battery.type \"PbAc\"",
+    "battery.voltage \"27.3\"",
+    "device.mfr \"American Power Conversion\"",
+    "device.model \"Back-UPS RS 900G\"",
+    "driver.name \"usbhid-ups\"",
+    "driver.parameter.pollfreq \"30\"",
+    "driver.version \"2.7.4\"",
+    "input.frequency \"50.0\"",
+    "input.sensitivity \"medium\"",
+    "input.transfer.high \"294\"",
+    "input.transfer.low \"176\"",
+    "input.voltage \"232.0\"",
+    "output.frequency \"50.0\"",
+    "output.voltage \"230.0\"",
+    "ups.beeper.status \"enabled\"",
+    "ups.load \"23\"",
+    "ups.mfr \"American Power Conversion\"",
+    "ups.status \"OL\"",
+    "ups.temperature \"31.5\"",
+    NULL
+};
+
+/*! A client with a single UPS and the other end of its connection. */
+typedef struct
+{
+    UPSClient *client; /*!< The client.                    */
+    int        peer;   /*!< Our end of the connection.     */
+    gchar     *reply;  /*!< Reply to one poll cycle.       */
+    gint       len;    /*!< Length of reply.               */
+} BenchConn;
+
+static BenchConn listConn;   /*!< Client speaking the LIST protocol.   */
+static BenchConn legacyConn; /*!< Client speaking the REQ protocol.    */
+static BenchConn getConn;    /*!< LIST protocol client wanting only two readings. */
+
+/** Build a client for a list of UPSes without starting its thread.
+ *  Every UPS must be on the same host, so they share one connection, which
+ *  is connected to a socketpair. Returns our end of the pair in peer.
+ */
+static UPSClient *makeClient(const gchar *upsList, gint protocol, int *peer)
+{
+    static const PollPolicy policy = { 2000, 500, 250 };
+    UPSConnection *conn;
+    UPSClient     *client;
+    gchar         *list;
+    gchar         *spec;
+    gint           index;
+    int            pair[2];
+
+    client = (UPSClient *)calloc(1, sizeof(UPSClient));
+    client -> wakeFds[0] = client -> wakeFds[1] = -1;
+    client -> pollPolicy = policy;
+
+    list = g_strdup(upsList);
+    for(spec = strtok(list, " "); spec; spec = strtok(NULL, " ")) addUPS(client, spec, 3493);
+    g_free(list);
+    for(index = 0; index < client -> upsCount; index++) client -> monitors[index].infoKnown = TRUE;
+
+    conn = client -> hosts[0];
+    conn -> protocol = protocol;
+    conn -> pendSize = conn -> upsCount * CYCLE_REQUESTS;
+    conn -> pending  = (PendingRequest *)calloc(conn -> pendSize, sizeof(PendingRequest));
+    conn -> outSize  = conn -> pendSize * MAX_REQUESTSIZE;
+    conn -> out      = (gchar *)malloc(conn -> outSize);
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    setNonBlocking(pair[0]);
+    conn -> socket = pair[0];
+    conn -> state  = CONN_CONNECTED;
+    *peer = pair[1];
+    return client;
+}
+
+/** Build the LIST VAR reply for a UPS. The result must be freed with g_free(). */
+static gchar *listReply(const gchar *name)
+{
+    gchar *reply = g_strdup_printf("BEGIN LIST VAR %s\n", name);
+    gchar *next;
+    gint   index;
+
+    for(index = 0; listVarLines[index]; index++) {
+        next = g_strdup_printf("%sVAR %s %s\n", reply, name, listVarLines[index]);
+        g_free(reply);
+        reply = next;
+    }
+    next = g_strdup_printf("%sEND LIST VAR %s\n", reply, name);
+    g_free(reply);
+    return next;
+}
+
+/** Run one poll cycle: queue the requests, answer them and parse the replies.
+ *  Every reading is made due first, so each cycle asks for the same ones.
+ *  The requests themselves are thrown away, upsd would only be told what the
+ *  benchmark already knows.
+ */
+static void pollCycle(UPSClient *client, int peer, const gchar *reply, gint len)
+{
+    UPSConnection *conn = client -> hosts[0];
+    gint           index;
+
+    for(index = 0; index < client -> upsCount; index++) {
+        memset(client -> monitors[index].due, 0, sizeof(client -> monitors[index].due));
+    }
+
+    queueCycle(conn, monotonicUsec());
+    conn -> outLen = 0;
+
+    write(peer, reply, len);
+    while(conn -> pendCount && (readReplies(conn) == 0));
+}
+
+/** A client with every UPS polled once, for the plugin benchmarks.
+ *  The UPSes are called ups1, ups2... on a single host.
+ */
+UPSClient *benchClient(gint upsCount)
+{
+    UPSClient *client;
+    gchar      list[MAX_UPS * 24];
+    gchar     *reply = g_strdup("");
+    gchar     *part;
+    gchar     *next;
+    gint       len   = 0;
+    gint       index;
+    int        peer;
+
+    list[0] = '\0';
+    for(index = 1; (index <= upsCount) && (index <= MAX_UPS); index++) {
+        len += g_snprintf(list + len, sizeof(list) - len, "%sups%d@localhost", (index > 1) ? " " : "", index);
+    }
+    client = makeClient(list, PROTOCOL_LIST, &peer);
+
+    for(index = 0; index < client -> upsCount; index++) {
+        part = listReply(client -> monitors[index].name);
+        next = g_strconcat(reply, part, NULL);
+        g_free(part);
+        g_free(reply);
+        reply = next;
+    }
+    pollCycle(client, peer, reply, strlen(reply));
+    close(peer);
+    g_free(reply);
+    return client;
+}
+
+/** Free a client returned by benchClient(). */
+void freeBenchClient(UPSClient *client)
+{
+    freeClient(client);
+}
+
+void setupClientBench(void)
+{
+    listConn.client = makeClient("bench@localhost", PROTOCOL_LIST, &listConn.peer);
+    listConn.reply  = listReply("bench");
+    listConn.len    = strlen(listConn.reply);
+
+    legacyConn.client = makeClient("bench@localhost", PROTOCOL_LEGACY, &legacyConn.peer);
+    legacyConn.reply  = g_strdup("ANS UTILITY@bench 232.0\nANS ACFREQ@bench 50.0\nANS OUTVOLT@bench 230.0\n"
+                                 "ANS BATTPCT@bench 100\nANS BATTVOLT@bench 27.3\nANS LOADPCT@bench 23\n"
+                                 "ANS UPSTEMP@bench 31.5\nANS STATUS@bench OL\n");
+    legacyConn.len    = strlen(legacyConn.reply);
+
+    getConn.client = makeClient("bench@localhost", PROTOCOL_LIST, &getConn.peer);
+    getConn.reply  = g_strdup("VAR bench input.voltage \"232.0\"\nVAR bench battery.charge \"100\"\n"
+                              "VAR bench ups.status \"OL\"\n");
+    getConn.len    = strlen(getConn.reply);
+    setWantedVars(getConn.client, 0, (1 << VAR_IN_VOLTAGE) | (1 << VAR_BAT_LEVEL));
+}
+
+void teardownClientBench(void)
+{
+    close(listConn.peer);
+    close(legacyConn.peer);
+    close(getConn.peer);
+    freeClient(listConn.client);
+    freeClient(legacyConn.client);
+    freeClient(getConn.client);
+    g_free(listConn.reply);
+    g_free(legacyConn.reply);
+    g_free(getConn.reply);
+}
+
+/** A LIST protocol poll cycle: one LIST VAR with 22 variables. */
+static void benchListCycle(glong iterations)
+{
+    while(iterations--) pollCycle(listConn.client, listConn.peer, listConn.reply, listConn.len);
+}
+
+/** A legacy poll cycle: eight REQ/ANS pairs. */
+static void benchLegacyCycle(glong iterations)
+{
+    while(iterations--) pollCycle(legacyConn.client, legacyConn.peer, legacyConn.reply, legacyConn.len);
+}
+
+/** A LIST protocol poll cycle wanting two readings: three GET VAR requests. */
+static void benchGetCycle(glong iterations)
+{
+    while(iterations--) pollCycle(getConn.client, getConn.peer, getConn.reply, getConn.len);
+}
+
+/** parseVar() of a single numeric VAR line. */
+static void benchParseVar(glong iterations)
+{
+    static gchar   line[] = "VAR bench input.voltage \"232.0\"\n";
+    struct UPSData status;
+
+    resetStatus(&status);
+    while(iterations--) parseVar(&listConn.client -> monitors[0], &status, line, sizeof(line) - 2);
+}
+
+/** parseStatus() of a healthy UPS. */
+static void benchStatusOnline(glong iterations)
+{
+    static gchar   value[] = "OL\"";
+    struct UPSData status;
+
+    resetStatus(&status);
+    while(iterations--) parseStatus(&status, value, sizeof(value) - 2);
+}
+
+/** parseStatus() of a UPS running out of battery. */
+static void benchStatusAlert(glong iterations)
+{
+    static gchar   value[] = "OB DISCHRG LB\"";
+    struct UPSData status;
+
+    resetStatus(&status);
+    while(iterations--) parseStatus(&status, value, sizeof(value) - 2);
+}
+
+/** statusText() in the brief form used on the charts. */
+static void benchStatusText(glong iterations)
+{
+    gchar buffer[128];
+
+    while(iterations--) statusText(buffer, sizeof(buffer), UPS_OB | UPS_LB | UPS_DISCHRG, TRUE);
+}
+
+const Benchmark clientBenchmarks[] =
+{
+    { "client/cycle-list",    benchListCycle    },
+    { "client/cycle-legacy",  benchLegacyCycle  },
+    { "client/cycle-get",     benchGetCycle     },
+    { "client/parse-var",     benchParseVar     },
+    { "client/status-online", benchStatusOnline },
+    { "client/status-alert",  benchStatusAlert  },
+    { "client/status-text",   benchStatusText   },
+    { NULL,                   NULL              }
+};
@@ -0,0 +1,180 @@
+/**
+ *  \file bench_plugin.c
+ *  Plugin benchmarks: chart text rendering, envelopes, rolling statistics and
+ *  the updatePlugin() path.
+ *  gknut.c is included rather than linked so that its static functions can
+ *  be called directly, and built against the stand-in GKrellM API in
+ *  gkrellm/gkrellm.h. The displays are created by the plugin's own code, for
+ *  the UPSes of a client from benchClient() which holds a complete poll of
+ *  each, so updatePlugin() runs just as it does under GKrellM.
+ */
+
+#include"../gknut.c"
+#include"bench.h"
+
+/*! Status the render benchmarks use, a UPS on battery so $s has something to say */
+static struct UPSData renderStatus;
+
+void setupPluginBench(UPSClient *client)
+{
+    gint len = 0;
+    gint index;
+
+    init_plugin();
+    config -> archive = FALSE;
+
+    /* Every BUS_CHECK_INTERVAL seconds updatePlugin() looks for a collector publishing this list */
+    config -> host[0] = '\0';
+    for(index = 0; index < clientUPSCount(client); index++) {
+        len += g_snprintf(config -> host + len, sizeof(config -> host) - len, "%s%s", index ? " " : "",
+                          readStatus(client, index) -> ups_Name);
+    }
+
+    /* The text overlays are off by default, but they are the expensive part */
+    bupsData -> voltType.showText = TRUE;
+    bupsData -> freqType.showText = TRUE;
+    bupsData -> tempType.showText = TRUE;
+
+    bupsData -> client = client;
+    createDisplays(TRUE);
+
+    memcpy(&renderStatus, readStatus(client, 0), sizeof(struct UPSData));
+    renderStatus.ups_Status = UPS_OB | UPS_DISCHRG;
+}
+
+void teardownPluginBench(void)
+{
+    destroyDisplays();
+    bupsData -> client = NULL;
+}
+
+/** Render the text overlay of a chart type against renderStatus. */
+static void renderLoop(BUPSChartType *type, glong iterations)
+{
+    gchar buffer[128];
+
+    while(iterations--) renderFormat(buffer, sizeof(buffer), &type -> compiled, &renderStatus, NULL);
+}
+
+/** Voltage chart text, default format. */
+static void benchRenderVolt(glong iterations)
+{
+    renderLoop(&bupsData -> voltType, iterations);
+}
+
+/** Frequency chart text, default format. */
+static void benchRenderFreq(glong iterations)
+{
+    renderLoop(&bupsData -> freqType, iterations);
+}
+
+/** Stats chart text, default format. */
+static void benchRenderTemp(glong iterations)
+{
+    renderLoop(&bupsData -> tempType, iterations);
+}
+
+/** updatePlugin() between seconds: only the log panels are redrawn. */
+static void benchUpdateTick(glong iterations)
+{
+    GK.second_tick = FALSE;
+    while(iterations--) updatePlugin();
+}
+
+/** updatePlugin() on a second tick: new chart values, overlays and history. */
+static void benchUpdateSecond(glong iterations)
+{
+    GK.second_tick = TRUE;
+    while(iterations--) updatePlugin();
+    GK.second_tick = FALSE;
+}
+
+/** storeColumn() of a voltage chart following mains wandering by a few volts.
+ *  Includes the chart being stored again whenever its range moves.
+ */
+static void benchStoreColumn(glong iterations)
+{
+    BUPSChart *chart = &bupsData -> ups[0].voltChart;
+    RingSample sample;
+    gint       step  = 0;
+    gint       index;
+
+    memset(&sample, 0, sizeof(sample));
+    while(iterations--) {
+        step = (step + 1) % 400;
+        for(index = 0; index < MAX_DATA; index++) {
+            sample.values[0][index] = 228.0 + ((step < 200) ? step : 400 - step) / 40.0;
+            sample.low[0][index]    = sample.values[0][index] - 0.5;
+            sample.high[0][index]   = sample.values[0][index] + 0.5;
+        }
+        storeColumn(chart, &sample, 0);
+    }
+}
+
+/** drawChart() of a voltage chart with an envelope in every column, the worst case. */
+static void benchDrawEnvelope(glong iterations)
+{
+    BUPSChart *chart = &bupsData -> ups[0].voltChart;
+    RingSample sample;
+    gint       index;
+
+    memset(&sample, 0, sizeof(sample));
+    for(index = 0; index < MAX_DATA; index++) {
+        sample.values[0][index] = 230.0;
+        sample.low[0][index]    = 225.0;
+        sample.high[0][index]   = 235.0;
+    }
+    for(index = 0; index < chart -> columnCount; index++) storeColumn(chart, &sample, 0);
+
+    while(iterations--) drawChart(chart);
+}
+
+/** addStatsSample() of one reading once its hour is full, every window losing a sample. */
+static void benchStatsSample(glong iterations)
+{
+    RollingStats *stats = newRollingStats();
+    gfloat        value;
+    gint          step  = 0;
+
+    while(iterations--) {
+        step  = (step + 7) % 400;
+        value = 228.0 + step / 40.0;
+        addStatsSample(stats, VAR_IN_VOLTAGE, value, value - 0.5, value + 0.5);
+    }
+    freeRollingStats(stats);
+}
+
+/** A chart text of every statistic of the input voltage over the hour. */
+static void benchRenderStats(glong iterations)
+{
+    BUPSFormat format;
+    gchar      buffer[128];
+    gint       index;
+
+    memset(&format, 0, sizeof(format));
+    compileFormat(&format, "$~hi $<hi $>hi $+hi", voltVars);
+    resetReadingStats(bupsData -> ups[0].stats, VAR_IN_VOLTAGE);
+    for(index = 0; index < STATS_SAMPLES; index++) {
+        addStatsSample(bupsData -> ups[0].stats, VAR_IN_VOLTAGE, 230.0 + index % 7, 225.0, 235.0);
+    }
+
+    while(iterations--) renderFormat(buffer, sizeof(buffer), &format, &renderStatus, bupsData -> ups[0].stats);
+
+    resetReadingStats(bupsData -> ups[0].stats, VAR_IN_VOLTAGE);
+    g_free(format.ops);
+    g_free(format.text);
+}
+
+const Benchmark pluginBenchmarks[] =
+{
+    { "plugin/render-volt",   benchRenderVolt   },
+    { "plugin/render-freq",   benchRenderFreq   },
+    { "plugin/render-temp",   benchRenderTemp   },
+    { "plugin/update-tick",   benchUpdateTick   },
+    { "plugin/update-second", benchUpdateSecond },
+    { "plugin/store-column",  benchStoreColumn  },
+    { "plugin/draw-envelope", benchDrawEnvelope },
+    { "plugin/stats-sample",  benchStatsSample  },
+    { "plugin/render-stats",  benchRenderStats  },
+    { NULL,                   NULL              }
+};
@@ -0,0 +1,256 @@
+/**
+ *  \file bench/gkrellm/gkrellm.h
+ *  Stand-in for the GKrellM and GTK API, for benchmarking the plugin.
+ *  gknut.c is built against this instead of the real <gkrellm/gkrellm.h> so
+ *  that its update path can be run without GKrellM, GTK or X. The calls the
+ *  update path makes (charts, decals, panels and string handling) are real
+ *  functions in gkrellm_stub.c which do about as much memory work as GKrellM
+ *  itself short of drawing. Everything else - building widgets and the
+ *  configuration tab - is empty inline functions.
+ */
+
+#ifndef BENCH_GKRELLM_H
+#define BENCH_GKRELLM_H
+
+#include<stdio.h>
+#include<glib.h>
+
+/* GTK and GDK types, only as much of them as gknut.c looks inside */
+typedef struct _GdkGC     GdkGC;
+typedef struct _GdkFont   GdkFont;
+typedef struct _GdkPixmap GdkPixmap;
+typedef struct _GdkWindow GdkWindow;
+typedef struct _GtkObject GtkObject;
+
+typedef struct
+{
+    GdkGC *fg_gc[5];
+} GtkStyle;
+
+typedef struct
+{
+    GdkWindow *window;
+    GtkStyle  *style;
+    gint       state;
+} GtkWidget;
+
+typedef struct
+{
+    GtkWidget *entry;
+} GtkCombo;
+
+typedef struct
+{
+    gint x, y, width, height;
+} GdkRectangle;
+
+typedef struct
+{
+    GdkRectangle area;
+} GdkEventExpose;
+
+typedef enum { GDK_BUTTON_PRESS, GDK_2BUTTON_PRESS } GdkEventType;
+
+typedef struct
+{
+    GdkEventType type;
+    guint        button;
+} GdkEventButton;
+
+typedef void (*GtkSignalFunc)();
+typedef enum { GTK_EXPAND = 1, GTK_SHRINK = 2, GTK_FILL = 4 } GtkAttachOptions;
+enum { GTK_POS_TOP, GTK_JUSTIFY_LEFT, GTK_POLICY_AUTOMATIC };
+
+#define GTK_WIDGET_STATE(w)    ((w) -> state)
+#define GTK_OBJECT(x)          (x)
+#define GTK_CONTAINER(x)       (x)
+#define GTK_BOX(x)             (x)
+#define GTK_TABLE(x)           (x)
+#define GTK_NOTEBOOK(x)        (x)
+#define GTK_ENTRY(x)           (x)
+#define GTK_COMBO(x)           ((GtkCombo *)(x))
+#define GTK_SPIN_BUTTON(x)     (x)
+#define GTK_ADJUSTMENT(x)      (x)
+#define GTK_LABEL(x)           (x)
+#define GTK_MISC(x)            (x)
+#define GTK_TEXT(x)            (x)
+#define GTK_SCROLLED_WINDOW(x) (x)
+#define GTK_TOGGLE_BUTTON(x)   (x)
+
+/* Widget building, none of which happens on the update path. These are
+ * functions rather than macros so the arguments are still used, and the
+ * compiler still sees the callbacks and texts gknut.c hands to GTK.
+ */
+#define GTK_SIGNAL_FUNC(f)     ((GtkSignalFunc)(f))
+
+static inline GtkWidget *gtk_vbox_new(gboolean homogeneous, gint spacing) { return NULL; }
+static inline GtkWidget *gtk_frame_new(const gchar *label) { return NULL; }
+static inline GtkWidget *gtk_label_new(const gchar *text) { return NULL; }
+static inline GtkWidget *gtk_table_new(gint rows, gint columns, gboolean homogeneous) { return NULL; }
+static inline GtkWidget *gtk_combo_new(void) { return NULL; }
+static inline GtkWidget *gtk_notebook_new(void) { return NULL; }
+static inline GtkWidget *gtk_text_new(gpointer hadj, gpointer vadj) { return NULL; }
+static inline GtkWidget *gtk_scrolled_window_new(gpointer hadj, gpointer vadj) { return NULL; }
+static inline GtkWidget *gtk_spin_button_new(gpointer adjustment, gfloat climb, gint digits) { return NULL; }
+static inline GtkWidget *gtk_check_button_new_with_label(const gchar *label) { return NULL; }
+static inline GtkWidget *gtk_entry_new_with_max_length(gint max) { return NULL; }
+static inline GtkObject *gtk_adjustment_new(gfloat value, gfloat lower, gfloat upper, gfloat step, gfloat page,
+                                            gfloat pageSize) { return NULL; }
+static inline gchar *gtk_entry_get_text(gpointer entry) { return (gchar *)""; }
+static inline gint gtk_spin_button_get_value_as_int(gpointer spin) { return 0; }
+static inline gboolean gtk_toggle_button_get_active(gpointer toggle) { return FALSE; }
+static inline void gtk_signal_connect(gpointer object, const gchar *name, GtkSignalFunc func, gpointer data) { }
+static inline void gtk_widget_destroyed(GtkWidget *widget, GtkWidget **pointer) { }
+static inline gint gdk_string_width(GdkFont *font, const gchar *text) { return 0; }
+static inline void gtk_widget_show(gpointer widget) { }
+static inline void gtk_widget_destroy(gpointer widget) { }
+static inline void gtk_container_add(gpointer container, gpointer widget) { }
+static inline void gtk_container_border_width(gpointer container, gint width) { }
+static inline void gtk_box_pack_start(gpointer box, gpointer child, gboolean expand, gboolean fill, gint padding) { }
+static inline void gtk_table_attach(gpointer table, gpointer child, gint left, gint right, gint top, gint bottom,
+                                    GtkAttachOptions xoptions, GtkAttachOptions yoptions, gint xpadding,
+                                    gint ypadding) { }
+static inline void gtk_table_set_row_spacings(gpointer table, gint spacing) { }
+static inline void gtk_table_set_col_spacings(gpointer table, gint spacing) { }
+static inline void gtk_notebook_append_page(gpointer notebook, gpointer child, gpointer label) { }
+static inline void gtk_notebook_set_tab_pos(gpointer notebook, gint pos) { }
+static inline void gtk_combo_set_popdown_strings(gpointer combo, GList *strings) { }
+static inline void gtk_entry_set_text(gpointer entry, const gchar *text) { }
+static inline void gtk_spin_button_set_numeric(gpointer spin, gboolean numeric) { }
+static inline void gtk_toggle_button_set_active(gpointer toggle, gboolean active) { }
+static inline void gtk_label_set_justify(gpointer label, gint justify) { }
+static inline void gtk_label_set_text(gpointer label, const gchar *text) { }
+static inline void gtk_misc_set_alignment(gpointer misc, gfloat xalign, gfloat yalign) { }
+static inline void gtk_text_set_editable(gpointer text, gboolean editable) { }
+static inline void gtk_scrolled_window_set_policy(gpointer window, gint hpolicy, gint vpolicy) { }
+static inline void gdk_draw_pixmap(GdkWindow *window, GdkGC *gc, GdkPixmap *pixmap, gint xsrc, gint ysrc, gint xdest,
+                                   gint ydest, gint width, gint height) { }
+static inline GdkGC *gkrellm_draw_GC(gint number) { return NULL; }
+
+/* GKrellM types */
+typedef struct
+{
+    gint     x_off;       /*!< Horizontal offset of the text.           */
+    gint     w;           /*!< Width of the decal.                      */
+    struct { GdkFont *font; } text_style;
+    gchar   *text;        /*!< Text last drawn, to skip redundant draws. */
+    gint     value;       /*!< Value last drawn with it.                */
+} Decal;
+
+typedef struct
+{
+    GtkWidget *drawing_area;
+    GdkPixmap *pixmap;
+    gint       layers;    /*!< Times the panel layers have been drawn.  */
+} Panel;
+
+typedef struct
+{
+    gboolean hide;
+} ChartData;
+
+typedef struct
+{
+    gint gridResolution;
+} ChartConfig;
+
+typedef struct
+{
+    GtkWidget *drawing_area;
+    GdkPixmap *pixmap;
+    Panel     *panel;
+    gint       w, h;
+    ChartData *data[3];   /*!< Chartdata added to the chart.            */
+    gint       dataCount; /*!< Number of entries in data.               */
+    gint      *values;    /*!< Stored values, dataCount for each column. */
+    gint       position;  /*!< Column the next values go in.            */
+    gint       scaleMax;  /*!< Largest value stored, for the scale.     */
+} Chart;
+
+typedef struct _Style     Style;
+typedef struct _TextStyle TextStyle;
+
+typedef struct
+{
+    gchar  *name;
+    gint    id;
+    void  (*create_monitor)(GtkWidget *, gint);
+    void  (*update_monitor)(void);
+    void  (*create_config)(GtkWidget *);
+    void  (*apply_config)(void);
+    void  (*save_user_config)(FILE *);
+    void  (*load_user_config)(gchar *);
+    gchar  *config_keyword;
+    void  (*undef2)(void);
+    void  (*undef1)(void);
+    gpointer privat;
+    gint    insert_before_id;
+    void   *handle;
+    gchar  *path;
+} Monitor;
+
+/*! Timer ticks, set by the benchmark before each updatePlugin() */
+typedef struct
+{
+    gint second_tick;
+    gint minute_tick;
+    gint timer_ticks;
+} GkrellmTicks;
+
+extern GkrellmTicks GK;
+
+#define MON_FS               5
+#define CHARTDATA_LINE       1
+#define CHARTDATA_ALLOW_HIDE 2
+
+#define GKRELLM_CHARTCONFIG_KEYWORD "chart_config"
+
+/* Configuration and chart setup, none of which happens on the update path */
+static inline void gkrellm_set_chart_height_default(Chart *chart, gint height) { }
+static inline void gkrellm_monotonic_chartdata(ChartData *data, gboolean monotonic) { }
+static inline void gkrellm_set_chartdata_draw_style_default(ChartData *data, gint style) { }
+static inline void gkrellm_set_chartdata_flags(ChartData *data, gint flags) { }
+static inline void gkrellm_set_draw_chart_function(Chart *chart, void (*func)(), gpointer data) { }
+static inline void gkrellm_chartconfig_grid_resolution_adjustment(ChartConfig *config, gboolean mapped, gfloat spin,
+                                                                  gfloat low, gfloat high, gfloat step0, gfloat step1,
+                                                                  gint digits, gint width) { }
+static inline void gkrellm_chartconfig_grid_resolution_label(ChartConfig *config, const gchar *label) { }
+static inline void gkrellm_chartconfig_window_create(Chart *chart) { }
+static inline void gkrellm_panel_configure(Panel *panel, const gchar *label, Style *style) { }
+static inline void gkrellm_panel_create(GtkWidget *vbox, Monitor *mon, Panel *panel) { }
+static inline void gkrellm_make_decal_visible(Panel *panel, Decal *decal) { }
+static inline void gkrellm_make_decal_invisible(Panel *panel, Decal *decal) { }
+static inline void gkrellm_config_modified(void) { }
+static inline void gkrellm_open_config_window(Monitor *mon) { }
+static inline void gkrellm_save_chartconfig(FILE *file, ChartConfig *config, const gchar *keyword, const gchar *name) { }
+static inline void gkrellm_load_chartconfig(ChartConfig **config, gchar *line, gint maxData) { }
+static inline void gkrellm_add_info_text(GtkWidget *text, gchar **lines, gint count) { }
+static inline Style *gkrellm_panel_style(gint id) { return NULL; }
+static inline Style *gkrellm_meter_style(gint id) { return NULL; }
+static inline TextStyle *gkrellm_meter_textstyle(gint id) { return NULL; }
+static inline TextStyle *gkrellm_meter_alt_textstyle(gint id) { return NULL; }
+static inline gint gkrellm_add_chart_style(Monitor *mon, const gchar *name) { return 0; }
+
+/* functions implemented in gkrellm_stub.c */
+extern Chart *gkrellm_chart_new0(void);
+extern Panel *gkrellm_panel_new0(void);
+extern void gkrellm_chart_create(GtkWidget *vbox, Monitor *mon, Chart *chart, ChartConfig **config);
+extern ChartData *gkrellm_add_default_chartdata(Chart *chart, gchar *name);
+extern void gkrellm_alloc_chartdata(Chart *chart);
+extern void gkrellm_reset_chart(Chart *chart);
+extern void gkrellm_store_chartdata(Chart *chart, gulong total, ...);
+extern void gkrellm_draw_chartdata(Chart *chart);
+extern void gkrellm_draw_chart_text(Chart *chart, gint style_id, gchar *text);
+extern void gkrellm_draw_chart_to_screen(Chart *chart);
+extern gint gkrellm_get_chart_scalemax(Chart *chart);
+extern void gdk_draw_line(GdkPixmap *pixmap, GdkGC *gc, gint x1, gint y1, gint x2, gint y2);
+extern void gkrellm_chart_destroy(Chart *chart);
+extern gint gkrellm_chart_width(void);
+extern Decal *gkrellm_create_decal_text(Panel *panel, gchar *text, TextStyle *ts, Style *style, gint x, gint y, gint w);
+extern void gkrellm_draw_decal_text(Panel *panel, Decal *decal, gchar *text, gint value);
+extern void gkrellm_draw_panel_layers(Panel *panel);
+extern void gkrellm_panel_destroy(Panel *panel);
+extern gboolean gkrellm_dup_string(gchar **dst, gchar *src);
+extern gchar *gkrellm_homedir(void);
+
+#endif
@@ -0,0 +1,172 @@
+/**
+ *  \file gkrellm_stub.c
+ *  GKrellM calls made on the plugin update path, for benchmarking.
+ *  Each one does the bookkeeping GKrellM would - storing chart columns,
+ *  remembering decal text, copying strings - but draws nothing, so the
+ *  benchmark measures the plugin rather than X. See gkrellm/gkrellm.h.
+ */
+
+#include<stdlib.h>
+#include<stdarg.h>
+#include<string.h>
+#include<gkrellm/gkrellm.h>
+
+#define CHART_WIDTH 60 /*!< Columns in each chart, a typical GKrellM width */
+
+GkrellmTicks GK;
+
+/*! Characters of chart text "drawn", so the scan can not be optimised away */
+static volatile gint textDrawn;
+
+/*! Lines "drawn", likewise */
+static volatile gint linesDrawn;
+
+Chart *gkrellm_chart_new0(void)
+{
+    Chart *chart = g_new0(Chart, 1);
+
+    chart -> w = CHART_WIDTH;
+    chart -> h = 40;
+    return chart;
+}
+
+Panel *gkrellm_panel_new0(void)
+{
+    return g_new0(Panel, 1);
+}
+
+void gkrellm_chart_create(GtkWidget *vbox, Monitor *mon, Chart *chart, ChartConfig **config)
+{
+    if(*config == NULL) *config = g_new0(ChartConfig, 1);
+    chart -> dataCount = 0;
+}
+
+ChartData *gkrellm_add_default_chartdata(Chart *chart, gchar *name)
+{
+    ChartData *data = g_new0(ChartData, 1);
+
+    if(chart -> dataCount < 3) chart -> data[chart -> dataCount++] = data;
+    return data;
+}
+
+void gkrellm_alloc_chartdata(Chart *chart)
+{
+    g_free(chart -> values);
+    chart -> values   = g_new0(gint, chart -> w * MAX(chart -> dataCount, 1));
+    chart -> position = 0;
+}
+
+/** Forget every stored value, as GKrellM does. */
+void gkrellm_reset_chart(Chart *chart)
+{
+    memset(chart -> values, 0, chart -> w * MAX(chart -> dataCount, 1) * sizeof(gint));
+    chart -> position = 0;
+    chart -> scaleMax = 0;
+}
+
+/** Store one column of chart values, one vararg for each chartdata. */
+void gkrellm_store_chartdata(Chart *chart, gulong total, ...)
+{
+    va_list args;
+    gint    index;
+
+    va_start(args, total);
+    for(index = 0; index < chart -> dataCount; index++) {
+        chart -> values[chart -> position * chart -> dataCount + index] = va_arg(args, gulong);
+        chart -> scaleMax = MAX(chart -> scaleMax, chart -> values[chart -> position * chart -> dataCount + index]);
+    }
+    va_end(args);
+    chart -> position = (chart -> position + 1) % chart -> w;
+}
+
+void gkrellm_draw_chartdata(Chart *chart)
+{
+}
+
+/** Walk the text as GKrellM does to lay it out, handling the \\f and \\n escapes. */
+void gkrellm_draw_chart_text(Chart *chart, gint style_id, gchar *text)
+{
+    gint count = 0;
+
+    for(; *text; text++) {
+        if((*text == '\\') && text[1]) text++;
+        count++;
+    }
+    textDrawn += count;
+}
+
+void gkrellm_draw_chart_to_screen(Chart *chart)
+{
+}
+
+/** GKrellM keeps the scale of a chart as it stores values, this only reads it. */
+gint gkrellm_get_chart_scalemax(Chart *chart)
+{
+    return MAX(chart -> scaleMax, 1);
+}
+
+void gdk_draw_line(GdkPixmap *pixmap, GdkGC *gc, gint x1, gint y1, gint x2, gint y2)
+{
+    linesDrawn++;
+}
+
+void gkrellm_chart_destroy(Chart *chart)
+{
+    gint index;
+
+    for(index = 0; index < chart -> dataCount; index++) g_free(chart -> data[index]);
+    g_free(chart -> values);
+    g_free(chart);
+}
+
+gint gkrellm_chart_width(void)
+{
+    return CHART_WIDTH;
+}
+
+Decal *gkrellm_create_decal_text(Panel *panel, gchar *text, TextStyle *ts, Style *style, gint x, gint y, gint w)
+{
+    Decal *decal = g_new0(Decal, 1);
+
+    decal -> w     = CHART_WIDTH;
+    decal -> value = -1;
+    return decal;
+}
+
+/** Like GKrellM, only (re)draw a decal whose text or value has changed. */
+void gkrellm_draw_decal_text(Panel *panel, Decal *decal, gchar *text, gint value)
+{
+    if(decal -> text && (decal -> value == value) && !strcmp(decal -> text, text)) return;
+
+    g_free(decal -> text);
+    decal -> text  = g_strdup(text);
+    decal -> value = value;
+}
+
+void gkrellm_draw_panel_layers(Panel *panel)
+{
+    panel -> layers++;
+}
+
+void gkrellm_panel_destroy(Panel *panel)
+{
+    g_free(panel);
+}
+
+/** Replace a string with a copy of another, returns TRUE if it changed. */
+gboolean gkrellm_dup_string(gchar **dst, gchar *src)
+{
+    if(*dst && !strcmp(*dst, src)) return FALSE;
+
+    g_free(*dst);
+    *dst = g_strdup(src);
+    return TRUE;
+}
+
+/** Home directory for the history rings, set by the benchmark. */
+gchar *gkrellm_homedir(void)
+{
+    gchar *home = getenv("GKNUT_BENCH_HOME");
+
+    return home ? home : "/tmp";
+}
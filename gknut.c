@@ -51,9 +51,19 @@
  *
  */
 
+#include<stdlib.h>
+#include<stddef.h>
+#include<time.h>
+#include<sys/stat.h>
+#include<sys/types.h>
 #include<gkrellm/gkrellm.h>
-#include"gknut.h"
 #include"nut_connect.h"
+#include"sample_ring.h"
+#include"archive.h"
+#include"snapshot_bus.h"
+#include"status_hook.h"
+#include"rolling_stats.h"
+#include"gknut.h"
 
 /*! Current plugin version number */
 #define GKNUT_VERSION  "0.0.2"
@@ -66,9 +76,13 @@ static gint         style_id; /*!< Plugin style alowing custom themes for this p
 static GtkWidget   *voltCombo;   /*!< voltage format string combo box.     */
 static GtkWidget   *freqCombo;   /*!< frequency format string combo box.   */
 static GtkWidget   *tempCombo;   /*!< temperature format string combo box. */
-static GtkWidget   *mainsWidget; /*!< Mains voltage compensation.          */ 
 static GtkWidget   *hostWidget;  /*!< Hostname string box.                 */
 static GtkWidget   *portWidget;  /*!< Service port spin button.            */ 
+static GtkWidget   *legacyWidget;/*!< Legacy protocol check button.        */
+static GtkWidget   *pollWidget[3];/*!< Poll interval spin buttons (line, battery, alert). */
+static GtkWidget   *archiveWidget;/*!< Telemetry archive check button.     */
+static GtkWidget   *hookWidget;  /*!< Status hook command string box.      */
+static GtkWidget   *diagLabel;   /*!< Diagnostics page text, NULL while the config window is closed. */
 
 /*! Descriptive text shown in the Help tab of the plugin configuration. */ 
 static gchar *helpText[] = 
@@ -79,28 +93,86 @@ static gchar *helpText[] =
     "<b>is not ",
     "supplied with this plugin!\n",
     "\n",
-    "<b>\"Mains\" setting\n",
-    "Mains voltages are too high to show on a reasonable size chart while retaining any \n",
-    "detail. This option allows you to set the value to subtract from the mains voltage \n",
-    "before showing it on the chart - this makes changes in voltage far more visible. It \n",
-    "should be set to approximately the voltage at which your UPS switches to battery \n",
-    "supply (around 187v on a UK UPS).\n",
-    "<b>Voltage chart:\n",
-    "Substitution variables for the format string for chart labels:\n",
-    "\t$i\tInput voltage level (in volts)\n", 
-    "\t$o\tOutput voltage level (in volts)\n", 
-    "\t$b\tBattery voltage level (in volts)\n", 
-    "\t$l\tBattery level\n", 
+    "<b>UPS list\n",
+    "The UPSes to monitor, seperated by spaces or commas. Each takes the usual NUT form\n",
+    "of [upsname@]hostname[:port], for example \"myups@localhost\". The default port is\n",
+    "used when none is given. Every UPS gets its own set of charts, all of them are\n",
+    "polled by a single connection to each upsd server.\n",
+    "\n",
+    "<b>Legacy REQ protocol\n",
+    "Current upsd releases (port 3493) answer a single LIST VAR request with every\n",
+    "variable of a UPS. upsd releases before 2.0 (port 3305) only understand the old REQ\n",
+    "protocol, which needs a request for each variable - tick this box for those.\n",
+    "\n",
+    "<b>Poll intervals\n",
+    "How often upsd is polled, in milliseconds. The \"on line\" interval is used while\n",
+    "every UPS on a server is healthy, the \"on battery\" one while any of them is on\n",
+    "battery and the \"alert\" one while any is low on battery, overloaded or shutting\n",
+    "down, so a power cut can be followed closely without loading upsd the rest of the time.\n",
+    "Intervals under a second sample the readings several times for each chart column:\n",
+    "the chart lines then follow the mean of each second, with a vertical bar from the\n",
+    "lowest to the highest value wherever they moved, so short sags and swells still show.\n",
+    "The default battery and alert intervals do this while the power is bad, lower the on\n",
+    "line interval too to watch a healthy line as closely (at the cost of more upsd load).\n",
+    "upsd only has values as fresh as its UPS driver (\"pollinterval\" in ups.conf).\n",
+    "Only the readings shown by visible chart lines and chart texts (and those the archive\n",
+    "keeps) are fetched, so hiding what you do not need also lightens each poll.\n",
+    "\n",
+    "<b>Shared collector\n",
+    "When \"gknutc -s\" is running on the same machine (as root, or as you) and publishing\n",
+    "every UPS in the list (with exactly the same specifications), the plugin reads its\n",
+    "snapshots from shared memory instead of polling upsd itself, so any number of GKrellMs\n",
+    "on one machine only cost upsd one session. The plugin switches over (and back, should the\n",
+    "collector stop) on its own. The server and poll settings are then the collector's,\n",
+    "and the telemetry archive below gets at most one of its snapshots a second.\n",
+    "\n",
+    "<b>Keep telemetry archive\n",
+    "Every poll of input voltage, frequency, load and battery level is kept under\n",
+    "~/" ARCHIVE_DIR ", one directory per UPS. Raw polls are kept for\n",
+    "two weeks, one minute summaries (count, min, max and average) for a year and one\n",
+    "hour summaries for ten years, so the disk space used stays bounded.\n",
     "\n",
-    "<b>Frequency chart:\n",
-    "Substitution variables for the format string for chart labels:\n",
-    "\t$i\tInput frequency (in hertz)\n", 
-    "\t$o\tOutput frequency (in hertz)\n", 
+    "<b>Status hook command\n",
+    "Run by /bin/sh every time the status of a UPS changes, as soon as the status reply\n",
+    "arrives rather than on the next chart update, so it can start a shutdown or send a\n",
+    "message when the power goes. Hooks run one at a time, in order. The command is told\n",
+    "about the change in GKNUT_UPS (the UPS as given in the list), GKNUT_STATUS and\n",
+    "GKNUT_PREVIOUS (the status flags now and before, e.g. \"OB DISCHRG\"), GKNUT_SET and\n",
+    "GKNUT_CLEARED (the flags which changed) and GKNUT_LATENCY_MS (how long after the\n",
+    "reply it was started). The Diagnostics page shows how quickly hooks are started.\n",
+    "With a shared collector the plugin does not see the replies, the collector passes\n",
+    "every change on and the command runs for each of them a GKrellM update later (which\n",
+    "GKNUT_LATENCY_MS includes). A command given to the collector as well\n",
+    "(\"gknutc -s -x command\") runs for every change too, without that delay.\n",
+    "\n",
+    "<b>Chart ranges\n",
+    "Every chart line ranges itself: the lowest value it has had across the width of the\n",
+    "chart sits at the bottom, and the lines are drawn in tenths of a volt, percent or\n",
+    "degree (hundredths of a hertz), so small changes show whatever the mains voltage of\n",
+    "your country. The chart texts show the actual readings.\n",
+    "\n",
+    "<b>Rolling statistics\n",
+    "The chart texts can also show statistics of any of the readings below over the last\n",
+    "minute, five minutes or hour: \"$\" followed by ~ for the mean, < for the lowest, > for\n",
+    "the highest or + for the standard deviation, then 1, 5 or h for the window and then\n",
+    "the reading. So \"$~hl\" is the average load over the last hour and \"$<5i\" the worst\n",
+    "input sag in the last five minutes. Statistics are sampled every second the UPS is\n",
+    "connected from when the format first asks for them, and show \"-\" until then.\n",
+};
+
+/*! Help text following the substitution variables of each chart type, see addFormatHelp(). */
+static gchar *helpTail[] = 
+{
+    "<b>Diagnostics\n",
+    "The Diagnostics page shows how polling each UPS is going: the number of upsd replies,\n",
+    "their median and 99th percentile round trip times, and the number of requests which\n",
+    "timed out, reconnections, replies which could not be parsed and stale data reports\n",
+    "(from a UPS driver which has stopped updating). Reply times are measured in buckets\n",
+    "which double in size, so they are accurate to within a factor of two. The counts are\n",
+    "kept from the start of monitoring.\n",
     "\n",
-    "<b>Stats chart:\n",
-    "Substitution variables for the format string for chart labels:\n",
-    "\t$t\tUPS Temperature (in centigrade)\n", 
-    "\t$l\tLoad level (as a percentage of maximum)\n", 
+    "The scrolling log shows every status flag the UPS reports, for example\n",
+    "\"UPS: on battery, battery is low\".\n",
     "\n",
     "Left click on charts to toggle the text overlay. Middle click on the UPS panel to\n",
     "toggle a scrolling display of log messages from the UPS."
@@ -115,140 +187,324 @@ static gchar aboutText[] =
 "http://<website here>/gknut/\n\n" \
 "Released under the GPL.\n";
 
-/*! chart condig names for the voltage chart data entries     */
-static gchar *voltNames[] = { "Input voltage", "Output voltage", "Battery voltage", NULL };
+/*! Readings shown by the voltage chart, also its chartdata names */
+static const gint voltData[] = { VAR_IN_VOLTAGE, VAR_OUT_VOLTAGE, VAR_BAT_VOLTAGE, -1 };
 
-/*! chart config names for the frequency chart data entries   */
-static gchar *freqNames[] = { "Input frequency", "Output frequency", NULL };
+/*! Readings shown by the frequency chart */
+static const gint freqData[] = { VAR_IN_FREQ, VAR_OUT_FREQ, -1 };
 
-/*! chart config names for the temperature chart data entries */
-static gchar *tempNames[] = { "Temperature", "Load", NULL };
+/*! Readings shown by the stats chart */
+static const gint tempData[] = { VAR_UPS_TEMP, VAR_UPS_LOAD, -1 };
+
+/*! Help for the $s substitution variable, available on every chart */
+static const gchar flagsHelp[] = "UPS status flags (such as OB LB)";
+
+/*! Characters choosing the statistic of a "$" statistics code, by STAT_* */
+static const gchar statCodes[] = "~<>+";
+
+/*! Characters choosing its window, by STATS_* */
+static const gchar windowCodes[] = "15h";
+
+/*! printf format of a standard deviation, which is usually too small for the format of its reading */
+static const gchar deviationPrint[] = "%.2f";
+
+/*! Substitution variables of the voltage chart */
+static const BUPSFormatVar voltVars[] =
+{
+    { 'i', FORMAT_READING, VAR_IN_VOLTAGE,  NULL, NULL      },
+    { 'o', FORMAT_READING, VAR_OUT_VOLTAGE, NULL, NULL      },
+    { 'b', FORMAT_READING, VAR_BAT_VOLTAGE, NULL, NULL      },
+    { 'l', FORMAT_READING, VAR_BAT_LEVEL,   NULL, NULL      },
+    { 'n', FORMAT_READING, VAR_IN_NOMINAL,  NULL, NULL      },
+    { 's', FORMAT_FLAGS, offsetof(struct UPSData, ups_Status), NULL, flagsHelp },
+    { 0,   0,              0,               NULL, NULL      }
+};
+
+/*! Substitution variables of the frequency chart */
+static const BUPSFormatVar freqVars[] =
+{
+    { 'i', FORMAT_READING, VAR_IN_FREQ,     NULL, NULL      },
+    { 'o', FORMAT_READING, VAR_OUT_FREQ,    NULL, NULL      },
+    { 's', FORMAT_FLAGS, offsetof(struct UPSData, ups_Status), NULL, flagsHelp },
+    { 0,   0,              0,               NULL, NULL      }
+};
 
-/** Voltage chart text formatter.
- *  This replaces special "$" codes in the specified format sttring with
- *  values taken from upsStatus. Please see the switch in the body of the
- *  function for details about which codes are recognised. All unrecognised
- *  codes or other characters are simply copied to the buffer.
+/*! Substitution variables of the stats chart */
+static const BUPSFormatVar tempVars[] =
+{
+    { 't', FORMAT_READING, VAR_UPS_TEMP,    NULL, NULL      },
+    { 'l', FORMAT_READING, VAR_UPS_LOAD,    NULL, NULL      },
+    { 'p', FORMAT_MSEC,  offsetof(struct UPSData, ups_PollTime), "%ld",
+      "Time taken by the last upsd poll (in milliseconds)" },
+    { 'm', FORMAT_RTT50, offsetof(struct UPSData, ups_Health),   "%.1f",
+      "Median upsd reply time (in milliseconds)" },
+    { 'n', FORMAT_RTT99, offsetof(struct UPSData, ups_Health),   "%.1f",
+      "99th percentile upsd reply time (in milliseconds)" },
+    { 'x', FORMAT_COUNT, offsetof(struct UPSData, ups_Health.timeouts),    "%u", "upsd requests which timed out" },
+    { 'r', FORMAT_COUNT, offsetof(struct UPSData, ups_Health.reconnects),  "%u", "Reconnections to upsd" },
+    { 'e', FORMAT_COUNT, offsetof(struct UPSData, ups_Health.parseErrors), "%u", "upsd replies which could not be parsed" },
+    { 's', FORMAT_FLAGS, offsetof(struct UPSData, ups_Status),   NULL, flagsHelp },
+    { 0,   0,            0,                                      NULL, NULL      }
+};
+
+/** Look up the reading of a "$" statistics code.
+ *  These take the form "$" statistic window reading, such as "$<5i" for the
+ *  lowest input voltage over the last five minutes (see statCodes and
+ *  windowCodes). Returns the substitution variable of the reading, or NULL
+ *  if the text at code is not a statistics code of one.
  *
  *  \par Arguments:
- *  \arg \c buffer - Destination buffer.
- *  \arg \c size - number of characters available in buffer (not including newline).
- *  \arg \c format - Format string to process into buffer.
- *
- *  \todo Find a way to unify formatVoltText(), formatFreqText() and 
- *  formatTempText() to reduce the amount of replication between them (maybe
- *  use varargs and pass the values to replace code with in that way?)
+ *  \arg \c code - the text following a "$".
+ *  \arg \c vars - Substitution variables available, terminated by a zero code.
+ *  \arg \c stat - destination for the STAT_* of the code.
+ *  \arg \c window - destination for the STATS_* window of the code.
  */
-static void formatVoltText(gchar *buffer, gint size, gchar *format)
+static const BUPSFormatVar *statVar(const gchar *code, const BUPSFormatVar *vars, gint *stat, gint *window)
 {
-    gchar *fpos;
-    gchar  opt;
-    gint   len;
+    const gchar *statCode;
+    const gchar *windowCode;
 
-    size--;
-    *buffer = '\0';
+    if((code[0] == '\0') || (code[1] == '\0') || (code[2] == '\0')) return NULL;
+    if(((statCode = strchr(statCodes, code[0])) == NULL) || ((windowCode = strchr(windowCodes, code[1])) == NULL)) {
+        return NULL;
+    }
 
-    for(fpos = format; (*fpos != '\0') && (size != 0); fpos ++) {
-        len = 1;
-        if((*fpos == '$') && (*(fpos + 1) != '\0')) {
-            opt = *(fpos + 1);
-            switch(opt) {
-                /* $i - input voltage (in volts) */
-                case 'i': len = snprintf(buffer, size, "%3.1f", upsStatus.in_Voltage ); fpos ++; break;
-                /* $o - output voltage (in volts) */
-                case 'o': len = snprintf(buffer, size, "%3.1f", upsStatus.out_Voltage); fpos ++; break;
-                /* $b - batteryvoltage (in volts) */
-                case 'b': len = snprintf(buffer, size, "%3.1f", upsStatus.bat_Voltage); fpos ++; break;
-                /* $l - battery level as a percentage. */
-                case 'l': len = snprintf(buffer, size, "%3.1f", upsStatus.bat_Level  ); fpos ++; break;
-                default: *buffer = *fpos; break;
-            }
-        } else {
-            *buffer = *fpos;
+    for(; vars -> code; vars++) {
+        if((vars -> code == code[2]) && (vars -> kind == FORMAT_READING)) {
+            *stat   = statCode - statCodes;
+            *window = windowCode - windowCodes;
+            return vars;
         }
-
-        size -= len;
-        buffer += len;
     }
-    *buffer = '\0';
+    return NULL;
 }
 
-/** Frequency chart text formatter.
- *  This does much the same thing as formatVoltText() except for the frequency chart.
+/** Compile a chart text format.
+ *  Splits the format into runs of literal text and "$" codes, looking each
+ *  code up in vars once here so that renderFormat() never has to scan the
+ *  format again. Statistics codes (see statVar()) are tried before the plain
+ *  codes. Unrecognised codes are kept as literal text. Any previous
+ *  contents of compiled are freed.
  *
  *  \par Arguments:
- *  \arg \c buffer - Destination buffer.
- *  \arg \c size - number of characters available in buffer (not including newline).
- *  \arg \c format - Format string to process into buffer.
+ *  \arg \c compiled - Destination for the compiled format.
+ *  \arg \c format - Format string to compile.
+ *  \arg \c vars - Substitution variables available, terminated by a zero code.
  */
-static void formatFreqText(gchar *buffer, gint size, gchar *format)
+static void compileFormat(BUPSFormat *compiled, const gchar *format, const BUPSFormatVar *vars)
 {
-    gchar *fpos;
-    gchar  opt;
-    gint   len;
-
-    size--;
-    *buffer = '\0';
-
-    for(fpos = format; (*fpos != '\0') && (size != 0); fpos ++) {
-        len = 1;
+    const BUPSFormatVar *var;
+    BUPSFormatOp        *op;
+    const gchar         *fpos;
+    gint                 textLen = 0;
+    gint                 stat;
+    gint                 window;
+
+    g_free(compiled -> ops);
+    g_free(compiled -> text);
+
+    /* There can't be more ops than characters, nor more literal text */
+    compiled -> ops     = g_new0(BUPSFormatOp, strlen(format) + 1);
+    compiled -> text    = g_malloc(strlen(format) + 1);
+    compiled -> opCount  = 0;
+    compiled -> readings = 0;
+    compiled -> stats    = 0;
+    op = NULL;
+
+    for(fpos = format; *fpos != '\0'; fpos++) {
+        var = NULL;
+        if((*fpos == '$') && ((var = statVar(fpos + 1, vars, &stat, &window)) != NULL)) {
+            op = &compiled -> ops[compiled -> opCount++];
+            op -> kind   = FORMAT_STAT;
+            op -> offset = var -> offset;
+            op -> print  = (stat == STAT_DEVIATION) ? deviationPrint : upsVars[var -> offset].print;
+            op -> stat   = stat;
+            op -> window = window;
+            compiled -> readings |= 1 << var -> offset;
+            compiled -> stats    |= 1 << var -> offset;
+            op = NULL;
+            fpos += 3;
+            continue;
+        }
         if((*fpos == '$') && (*(fpos + 1) != '\0')) {
-            opt = *(fpos + 1);
-            switch(opt) {
-                case 'i': len = snprintf(buffer, size, "%2.1f", upsStatus.in_Freq ); fpos ++; break;
-                case 'o': len = snprintf(buffer, size, "%2.1f", upsStatus.out_Freq); fpos ++; break;
-                default: *buffer = *fpos; break;
-            }
-        } else {
-            *buffer = *fpos;
+            for(var = vars; var -> code && (var -> code != *(fpos + 1)); var++);
+            if(var -> code == 0) var = NULL;
         }
 
-        size -= len;
-        buffer += len;
+        if(var && (var -> kind == FORMAT_READING)) {
+            op = &compiled -> ops[compiled -> opCount++];
+            op -> kind   = FORMAT_FLOAT;
+            op -> offset = var -> offset;
+            op -> print  = upsVars[var -> offset].print;
+            compiled -> readings |= 1 << var -> offset;
+            op = NULL;
+            fpos++;
+        } else if(var) {
+            op = &compiled -> ops[compiled -> opCount++];
+            op -> kind   = var -> kind;
+            op -> offset = var -> offset;
+            op -> print  = var -> print;
+            op = NULL;
+            fpos++;
+        } else {
+            if(op == NULL) {
+                op = &compiled -> ops[compiled -> opCount++];
+                op -> kind   = FORMAT_LITERAL;
+                op -> offset = textLen;
+                op -> len    = 0;
+            }
+            compiled -> text[textLen++] = *fpos;
+            op -> len++;
+        }
     }
-    *buffer = '\0';
 }
 
-/** Frequency chart text formatter.
- *  This does much the same thing as formatVoltText() except for the 
- *  temperature chart.
+/** Render a compiled chart text format.
+ *  Runs the operations of a format compiled by compileFormat() against the
+ *  status of a UPS. A reading which was not fetched (see ups_Fetched) or a
+ *  statistic with no samples yet shows as "-". The result is always null
+ *  terminated.
  *
  *  \par Arguments:
  *  \arg \c buffer - Destination buffer.
- *  \arg \c size - number of characters available in buffer (not including newline).
- *  \arg \c format - Format string to process into buffer.
+ *  \arg \c size - size of buffer (including the terminator).
+ *  \arg \c compiled - Format to render.
+ *  \arg \c status - Status of the UPS the chart belongs to.
+ *  \arg \c stats - Rolling statistics of the UPS, or NULL if there are none.
+ */
+static void renderFormat(gchar *buffer, gint size, BUPSFormat *compiled, struct UPSData *status,
+                         const RollingStats *stats)
+{
+    BUPSFormatOp *op;
+    gchar        *value;
+    gfloat        stat;
+    gint          len = 0;
+    gint          index;
+
+    buffer[0] = '\0';
+    for(index = 0; (index < compiled -> opCount) && (len < size - 1); index++) {
+        op    = &compiled -> ops[index];
+        value = (gchar *)status + op -> offset;
+
+        switch(op -> kind) {
+            case FORMAT_LITERAL:
+                len += g_snprintf(buffer + len, size - len, "%.*s", op -> len, compiled -> text + op -> offset);
+                break;
+            case FORMAT_FLOAT:
+                if(status -> ups_Fetched & (1 << op -> offset)) {
+                    len += g_snprintf(buffer + len, size - len, op -> print,
+                                      *(gfloat *)((gchar *)status + upsVars[op -> offset].offset));
+                } else {
+                    len += g_snprintf(buffer + len, size - len, "-");
+                }
+                break;
+            case FORMAT_MSEC:
+                len += g_snprintf(buffer + len, size - len, op -> print, *(glong *)value / 1000);
+                break;
+            case FORMAT_FLAGS:
+                len += statusText(buffer + len, size - len, *(guint *)value, TRUE);
+                break;
+            case FORMAT_COUNT:
+                len += g_snprintf(buffer + len, size - len, op -> print, (guint)*(guint32 *)value);
+                break;
+            case FORMAT_RTT50:
+            case FORMAT_RTT99:
+                len += g_snprintf(buffer + len, size - len, op -> print,
+                                  rttPercentile((PollHealth *)value, (op -> kind == FORMAT_RTT50) ? 50 : 99) / 1000.0);
+                break;
+            case FORMAT_STAT:
+                if(stats && readingStat(stats, op -> offset, op -> window, op -> stat, &stat)) {
+                    len += g_snprintf(buffer + len, size - len, op -> print, stat);
+                } else {
+                    len += g_snprintf(buffer + len, size - len, "-");
+                }
+                break;
+        }
+        len = MIN(len, size - 1);
+    }
+}
+
+/** Set the text format of a chart type.
+ *  The format is compiled straight away, drawing a chart only has to run 
+ *  the compiled version. Returns TRUE if the format changed.
  */
-static void formatTempText(gchar *buffer, gint size, gchar *format)
+static gboolean setChartFormat(BUPSChartType *type, gchar *format)
 {
-    gchar *fpos;
-    gchar  opt;
-    gint   len;
+    if(!gkrellm_dup_string(&type -> textFormat, format)) return FALSE;
 
-    size--;
-    *buffer = '\0';
+    compileFormat(&type -> compiled, type -> textFormat, type -> vars);
+    return TRUE;
+}
 
-    for(fpos = format; (*fpos != '\0') && (size != 0); fpos ++) {
-        len = 1;
-        if((*fpos == '$') && (*(fpos + 1) != '\0')) {
-            opt = *(fpos + 1);
-            switch(opt) {
-                case 't': len = snprintf(buffer, size, "%2.1f", upsStatus.ups_Temp); fpos ++; break;
-                case 'l': len = snprintf(buffer, size, "%3.1f", upsStatus.ups_Load); fpos ++; break;
-                default: *buffer = *fpos; break;
-            }
-        } else {
-            *buffer = *fpos;
-        }
+/** Return the latest status of a UPS.
+ *  Comes from the snapshot bus when a local collector is being used, or 
+ *  otherwise from our own client. The result stays valid until the next 
+ *  call for the same UPS.
+ */
+static struct UPSData *currentStatus(gint ups)
+{
+    if(bupsData -> bus) return busStatus(bupsData -> bus, ups);
+    return readStatus(bupsData -> client, ups);
+}
+
+/** Convert a reading to fixed point, rounding to the nearest chart unit. */
+static gint fixedUnits(gfloat value, gint fixed)
+{
+    value *= fixed;
+    return (gint)((value < 0) ? value - 0.5 : value + 0.5);
+}
 
-        size -= len;
-        buffer += len;
+/** Value stored for a reading of one chartdata: fixed point above its base, never below 0. */
+static gint chartUnits(const BUPSChart *chart, gint index, gfloat value)
+{
+    gint units = fixedUnits(value, chart -> type -> fixed) - chart -> range[index].base * chart -> type -> fixed;
+
+    return LIM_FLOOR(units, 0);
+}
+
+/** Draw the envelope of every column of a chart.
+ *  Each visible chartdata whose values spread over a column gets a vertical
+ *  line from its lowest to its highest value, across the line GKrellM draws
+ *  through the means. A chart without any spread in its columns (polled
+ *  once a second or less, or nothing moving) costs nothing.
+ */
+static void drawEnvelope(BUPSChart *chart)
+{
+    BUPSColumn *column;
+    GdkGC      *gc     = gkrellm_draw_GC(1);
+    gint        height = chart -> chart -> h - 1;
+    gint        scale  = gkrellm_get_chart_scalemax(chart -> chart);
+    gint        count  = MIN(MIN(chart -> columnCount, chart -> columnSeq), chart -> chart -> w);
+    gint        low;
+    gint        high;
+    gint        age;
+    gint        index;
+    gint        x;
+
+    if((chart -> spread == 0) || (scale <= 0)) return;
+
+    for(age = 0; age < count; age++) {
+        column = &chart -> columns[(chart -> columnSeq - 1 - age) % chart -> columnCount];
+        x      = chart -> chart -> w - 1 - age;
+
+        for(index = 0; (index < MAX_DATA) && (chart -> type -> dataVars[index] >= 0); index++) {
+            if(chart -> data[index] -> hide) continue;
+
+            low  = chartUnits(chart, index, column -> low[index]);
+            high = chartUnits(chart, index, column -> high[index]);
+            if(high <= low) continue;
+
+            gdk_draw_line(chart -> chart -> pixmap, gc,
+                          x, height - MIN(low, scale) * height / scale,
+                          x, height - MIN(high, scale) * height / scale);
+        }
     }
-    *buffer = '\0';
 }
 
 /** Draw the chart data and, optionally, text overlay. 
  *  As the user can opt to have a text over on the charts, this function
- *  is required to handle the drawing. 
+ *  is required to handle the drawing. The envelope of each column goes
+ *  over the chart data, see drawEnvelope().
  */  
 static void drawChart(BUPSChart *chart)
 {
@@ -256,41 +512,89 @@ static void drawChart(BUPSChart *chart)
     buf[0] = '\0';
 
 	gkrellm_draw_chartdata(chart -> chart);
-    if(chart -> showText) {
-        chart -> format(buf, sizeof(buf), chart -> textFormat);
+    drawEnvelope(chart);
+    if(chart -> type -> showText) {
+        renderFormat(buf, sizeof(buf), &chart -> type -> compiled, currentStatus(chart -> ups),
+                     bupsData -> ups[chart -> ups].stats);
         gkrellm_draw_chart_text(chart -> chart, style_id, buf);
     }
 	gkrellm_draw_chart_to_screen(chart -> chart);
 }
 
-/** Draw the log panel, either drawing a static label or a scrolling log.
+/** Redraw every chart of the specified type.
+ *  Used when one of the settings shared by the charts changes.
+ */
+static void drawChartType(BUPSChartType *type)
+{
+    BUPSDisplay *display;
+    gint         index;
+
+    for(index = 0; index < bupsData -> upsCount; index++) {
+        display = &bupsData -> ups[index];
+        if(display -> voltChart.type == type) drawChart(&display -> voltChart);
+        if(display -> freqChart.type == type) drawChart(&display -> freqChart);
+        if(display -> tempChart.type == type) drawChart(&display -> tempChart);
+    }
+}
+
+/** Draw a log panel, either drawing a static label or a scrolling log.
  *  This function handles the drawing of the ups "log message" panel, either
- *  showing a static "UPS" label or scrolling the last log message from
- *  the UPS service.
+ *  showing a static label or scrolling the last log message from the UPS 
+ *  service. While the server is not connected the label is replaced by the
+ *  state of the connection.
  */
-static void drawLog(void)
+static void drawLog(BUPSDisplay *display)
 {
-    gint width;
+    struct UPSData *status = currentStatus(display -> ups);
+    gchar           text[64];
+    gint            width;
 
     if(config -> showLog) {
         /* This next bit is taken from gkrellweather - I much prefer this scrolling 
          * setup to the more jumpy version used in some of the other panels
          */
         width = gkrellm_chart_width();
-        bupsData -> logScr = (bupsData -> logScr + 1) % (2 * width);
-        bupsData -> logDecal -> x_off = width - bupsData -> logScr;
-        if(bupsData -> logText) {
-            gkrellm_draw_decal_text(bupsData -> logDisplay, bupsData -> logDecal, bupsData -> logText, width - bupsData -> logScr);
+        display -> logScr = (display -> logScr + 1) % (2 * width);
+        display -> logDecal -> x_off = width - display -> logScr;
+        if(display -> logText) {
+            gkrellm_draw_decal_text(display -> logDisplay, display -> logDecal, display -> logText, width - display -> logScr);
         } else {
-            if(upsStatus.ups_Present) {
-                gkrellm_draw_decal_text(bupsData -> logDisplay, bupsData -> logDecal, "No log messsage waiting.", width - bupsData -> logScr);
+            if(status -> ups_Present) {
+                gkrellm_draw_decal_text(display -> logDisplay, display -> logDecal, "No log messsage waiting.", width - display -> logScr);
             } else {
-                gkrellm_draw_decal_text(bupsData -> logDisplay, bupsData -> logDecal, "No UPS detected!", width - bupsData -> logScr);
+                gkrellm_draw_decal_text(display -> logDisplay, display -> logDecal, "No UPS detected!", width - display -> logScr);
             }
         }
+    } else if(status -> ups_ConnState != CONN_CONNECTED) {
+        /* Say what the connection is up to rather than leave the label up over stale charts */
+        g_snprintf(text, sizeof(text), "%s: %s", display -> logLabel, connStateText(status -> ups_ConnState));
+        display -> labelDecal -> x_off = 0;
+        gkrellm_draw_decal_text(display -> logDisplay, display -> labelDecal, text, status -> ups_ConnState);
     } else {
-        bupsData -> labelDecal -> x_off = bupsData -> labelX;
-        gkrellm_draw_decal_text(bupsData -> logDisplay, bupsData -> labelDecal, bupsData -> logLabel, -1);
+        display -> labelDecal -> x_off = display -> labelX;
+        gkrellm_draw_decal_text(display -> logDisplay, display -> labelDecal, display -> logLabel, -1);
+    }
+}
+
+/** Show either the scrolling log or the label on every log panel.
+ *  Which one is shown depends on config -> showLog.
+ */
+static void showLogDecals(void)
+{
+    BUPSDisplay *display;
+    gint         index;
+
+    for(index = 0; index < bupsData -> upsCount; index++) {
+        display = &bupsData -> ups[index];
+        if(config -> showLog) {
+            gkrellm_make_decal_invisible(display -> logDisplay, display -> labelDecal);
+            drawLog(display);
+            gkrellm_make_decal_visible(display -> logDisplay, display -> logDecal);
+        } else {
+            gkrellm_make_decal_invisible(display -> logDisplay, display -> logDecal);
+            drawLog(display);
+            gkrellm_make_decal_visible(display -> logDisplay, display -> labelDecal);
+        }
     }
 }
 
@@ -324,14 +628,16 @@ static gint chartExposeEvent(GtkWidget *widget, GdkEventExpose *event, gpointer
 	return FALSE;
 }
 
-/** Callback for handling ExposeEvent events sent to the log panel.
+/** Callback for handling ExposeEvent events sent to a log panel.
  *  Couldn't get much easier than this - just a simple pixmap copy! :)
  */
-static gint exposeLogEvent(GtkWidget *widget, GdkEventExpose *event)
+static gint exposeLogEvent(GtkWidget *widget, GdkEventExpose *event, gpointer data)
 {
+     BUPSDisplay *display = (BUPSDisplay *)data;
+
      gdk_draw_pixmap(widget -> window,
                      widget -> style -> fg_gc[GTK_WIDGET_STATE(widget)],
-                     bupsData -> logDisplay -> pixmap, 
+                     display -> logDisplay -> pixmap, 
                      event -> area.x, event -> area.y, 
                      event -> area.x, event -> area.y,
                      event -> area.width, event -> area.height);
@@ -341,7 +647,7 @@ static gint exposeLogEvent(GtkWidget *widget, GdkEventExpose *event)
 /** Callback for handling button events sent to the charts.
  *  Pressing the right mouse button, or double-left-clicking will open the 
  *  chartcofig window for the chart the user has selected. Single-left 
- *  clicking toggles the chart text overlay function.
+ *  clicking toggles the text overlay on every chart of the same type.
  */
 static void cbChartClick(GtkWidget *widget, GdkEventButton *event, gpointer data)
 {
@@ -350,75 +656,325 @@ static void cbChartClick(GtkWidget *widget, GdkEventButton *event, gpointer data
 	if((event -> button == 3) || (event -> button == 1 && event -> type == GDK_2BUTTON_PRESS)) {
 		gkrellm_chartconfig_window_create(target -> chart);
 	} else if((event -> button == 1) && (event -> type == GDK_BUTTON_PRESS)) {
-        target -> showText = !target -> showText;
+        target -> type -> showText = !target -> type -> showText;
         gkrellm_config_modified();
-        drawChart(target);
+        drawChartType(target -> type);
     }
 }
 
-/** Callback for handling button events sent to the log panel.
- *  A single right click will open the plugin configuration while lief-clicking
- *  toggles between the label and scrolling log displays.
+/** Callback for handling button events sent to the log panels.
+ *  A single right click will open the plugin configuration while middle-clicking
+ *  toggles between the label and scrolling log displays on every panel.
  */
-static void cbLogClick(GtkWidget *widget, GdkEventButton *event)
+static void cbLogClick(GtkWidget *widget, GdkEventButton *event, gpointer data)
 {
 	if(event -> button == 3) {
 		gkrellm_open_config_window(mon);
 	} else if(event -> button == 2) {
-        if(config -> showLog) {
-            gkrellm_make_decal_invisible(bupsData -> logDisplay, bupsData -> logDecal);
-            config -> showLog = FALSE;
-            drawLog();
-            gkrellm_make_decal_visible(bupsData -> logDisplay, bupsData -> labelDecal);
-        } else {
-            gkrellm_make_decal_invisible(bupsData -> logDisplay, bupsData -> labelDecal);
-            config -> showLog = TRUE;
-            drawLog();
-            gkrellm_make_decal_visible(bupsData -> logDisplay, bupsData -> logDecal);
-        }
+        config -> showLog = !config -> showLog;
+        showLogDecals();
 		gkrellm_config_modified();
     }    
 }
 
-/** Add latest chart values and check for log updates.
- *  Called fairly regularly, but this only does anythignn really interesting once
- *  a second - it locks the mutex on upsStatus and updates all three charts to
- *  the latest values from the client thread. Once done the log string is 
- *  checked and possibly duplicated. 
- */ 
-static void updatePlugin(void)
+/** TRUE if any chartdata of a column has an envelope to draw. */
+static gboolean columnSpread(const BUPSChart *chart, const BUPSColumn *column)
 {
-    gint vala, valb, valc;
+    gint index;
 
-    if(GK.second_tick) {
-        pthread_mutex_lock(&upsStatus_lock); /* best to do this even though we aren't writing */
-        vala = LIM_FLOOR((gint)upsStatus.in_Voltage - config -> mains, 0);
-        valb = LIM_FLOOR((gint)upsStatus.out_Voltage - config -> mains, 0);
-        valc = LIM_FLOOR((gint)upsStatus.bat_Voltage, 0);
-        gkrellm_store_chartdata(bupsData -> voltChart.chart, 0, vala, valb, valc);
-        drawChart(&bupsData -> voltChart);
-
-        vala = LIM_FLOOR((gint)upsStatus.in_Freq, 0);
-        valb = LIM_FLOOR((gint)upsStatus.out_Freq, 0);
-        gkrellm_store_chartdata(bupsData -> freqChart.chart, 0, vala, valb);
-        drawChart(&bupsData -> freqChart);
-
-        vala = LIM_FLOOR((gint)upsStatus.ups_Temp, 0);
-        valb = LIM_FLOOR((gint)upsStatus.ups_Load, 0);
-        gkrellm_store_chartdata(bupsData -> tempChart.chart, 0, vala, valb);
-        drawChart(&bupsData -> tempChart);
-
-        /* this bit MUST be inside a mutex on upsStatus or heaven knows what will happen when the 
-         * thread updates ups_LastLog half way through the strdup ... 
-         */
-        vala = strlen(upsStatus.ups_LastLog);
-        if(vala) {
-            gkrellm_dup_string(&bupsData -> logText, upsStatus.ups_LastLog);
+    for(index = 0; (index < MAX_DATA) && (chart -> type -> dataVars[index] >= 0); index++) {
+        if(fixedUnits(column -> high[index], chart -> type -> fixed) >
+           fixedUnits(column -> low[index], chart -> type -> fixed)) return TRUE;
+    }
+    return FALSE;
+}
+
+/** Store the means of a column as the next chartdata values. */
+static void storeValues(BUPSChart *chart, const BUPSColumn *column)
+{
+    gkrellm_store_chartdata(chart -> chart, 0, chartUnits(chart, 0, column -> mean[0]),
+                            chartUnits(chart, 1, column -> mean[1]), chartUnits(chart, 2, column -> mean[2]));
+}
+
+/** Store every column of a chart again, oldest first, after its range moved. */
+static void restoreColumns(BUPSChart *chart)
+{
+    guint seq = (chart -> columnSeq > chart -> columnCount) ? chart -> columnSeq - chart -> columnCount : 0;
+
+    gkrellm_reset_chart(chart -> chart);
+    for(; seq < chart -> columnSeq; seq++) storeValues(chart, &chart -> columns[seq % chart -> columnCount]);
+}
+
+/** Add the newest column to the range of one chartdata, see BUPSRange.
+ *  Returns the lowest value of the chartdata over the chart width.
+ */
+static gfloat rangeLow(BUPSChart *chart, gint index)
+{
+    BUPSRange *range = &chart -> range[index];
+    guint      count = chart -> columnCount;
+    guint      seq   = chart -> columnSeq - 1;
+    gfloat     low   = chart -> columns[seq % count].low[index];
+
+    while((range -> head != range -> tail) && (range -> queue[range -> head % count] + count <= seq)) range -> head++;
+    while((range -> head != range -> tail) &&
+          (chart -> columns[range -> queue[(range -> tail - 1) % count] % count].low[index] >= low)) range -> tail--;
+    range -> queue[range -> tail++ % count] = seq;
+
+    return chart -> columns[range -> queue[range -> head % count] % count].low[index];
+}
+
+/** Add one column to a chart.
+ *  The column is kept with its readings, then the range of each chartdata
+ *  is updated: a line whose lowest value over the chart width has dropped
+ *  below its base, or risen more than RANGE_SLACK above it, is rebased on
+ *  it, and the whole chart is stored again. Otherwise only the new means
+ *  are stored.
+ *
+ *  \par Arguments:
+ *  \arg \c chart - the chart to add to.
+ *  \arg \c sample - the sample holding the values.
+ *  \arg \c row - which of the sample's charts this one is.
+ */
+static void storeColumn(BUPSChart *chart, const RingSample *sample, gint row)
+{
+    BUPSColumn *column = &chart -> columns[chart -> columnSeq % chart -> columnCount];
+    BUPSRange  *range;
+    gboolean    moved  = FALSE;
+    gfloat      low;
+    gint        base;
+    gint        index;
+
+    chart -> spread -= columnSpread(chart, column);
+    memcpy(column -> mean, sample -> values[row], sizeof(column -> mean));
+    memcpy(column -> low,  sample -> low[row],    sizeof(column -> low));
+    memcpy(column -> high, sample -> high[row],   sizeof(column -> high));
+    chart -> spread += columnSpread(chart, column);
+    chart -> columnSeq++;
+
+    for(index = 0; (index < MAX_DATA) && (chart -> type -> dataVars[index] >= 0); index++) {
+        range = &chart -> range[index];
+        low   = rangeLow(chart, index);
+        base  = (gint)low - ((gint)low > low);
+        if((chart -> columnSeq == 1) || (base < range -> base) || (base > range -> base + RANGE_SLACK)) {
+            range -> base = base;
+            moved         = TRUE;
+        }
+    }
+
+    if(moved) {
+        restoreColumns(chart);
+    } else {
+        storeValues(chart, column);
+    }
+}
+
+/** Add one sample to the charts of a UPS.
+ *  Samples hold the raw values, each chart ranges them itself so that
+ *  history refilled from the ring comes out the same as it was first drawn.
+ */
+static void storeSample(BUPSDisplay *display, const RingSample *sample)
+{
+    storeColumn(&display -> voltChart, sample, 0);
+    storeColumn(&display -> freqChart, sample, 1);
+    storeColumn(&display -> tempChart, sample, 2);
+}
+
+/** Refill freshly allocated charts from the history ring of their UPS.
+ *  Only as many samples as the charts are wide are replayed, oldest first.
+ */
+static void refillCharts(BUPSDisplay *display)
+{
+    const RingSample *sample;
+    gint              age;
+
+    if(display -> history == NULL) return;
+
+    for(age = gkrellm_chart_width() - 1; age >= 0; age--) {
+        if((sample = ringSample(display -> history, age)) != NULL) storeSample(display, sample);
+    }
+}
+
+/** Build the name of the history ring file of a UPS.
+ *  Files are named after the UPS specification so that they follow the UPS
+ *  if the list is reordered. The result must be freed with g_free().
+ */
+static gchar *historyPath(const gchar *upsName)
+{
+    gchar *dir;
+    gchar *path;
+    gchar *pos;
+
+    dir = g_strdup_printf("%s/%s", gkrellm_homedir(), HISTORY_DIR);
+    mkdir(dir, 0755);
+
+    path = g_strdup_printf("%s/%s.ring", dir, upsName);
+    for(pos = path + strlen(dir) + 1; *pos; pos++) {
+        if(*pos == '/') *pos = '_';
+    }
+    g_free(dir);
+    return path;
+}
+
+/** Start the telemetry archive in its directory under the home directory. */
+static void openArchive(void)
+{
+    gchar *dir;
+
+    dir = g_strdup_printf("%s/%s", gkrellm_homedir(), HISTORY_DIR);
+    mkdir(dir, 0755);
+    g_free(dir);
+
+    dir = g_strdup_printf("%s/%s", gkrellm_homedir(), ARCHIVE_DIR);
+    startArchive(dir);
+    g_free(dir);
+}
+
+/** Snapshot callback of the client.
+ *  Runs on the client thread, it only hands completed polls to the archive
+ *  (which never blocks) and leaves the charts to updatePlugin().
+ */
+static void clientNotify(gint ups, const struct UPSData *status, gboolean polled, gpointer data)
+{
+    if(polled && status -> ups_Present) archiveSample(status);
+}
+
+/** Hand a snapshot from the snapshot bus to the archive.
+ *  With a collector there is no client of our own to call clientNotify(),
+ *  so the archive is fed once a second from the latest snapshot instead -
+ *  the collector may poll faster, so this keeps at most one poll a second.
+ *  A snapshot whose sequence number has already been seen is skipped.
+ */
+static void archiveBusStatus(BUPSDisplay *display, const struct UPSData *status)
+{
+    if(status -> ups_Sequence == display -> archived) return;
+
+    display -> archived = status -> ups_Sequence;
+    if(status -> ups_Present) archiveSample(status);
+}
+
+/** Hand the status changes a collector has seen to the hooks.
+ *  With a collector there is no client of our own to call clientTransition(),
+ *  instead the collector adds every change its client reports to the bus,
+ *  and those since the last GKrellM update are replayed here in order - a
+ *  flap shorter than an update still runs the hooks twice. The latency of
+ *  a hook counts from the collector's reply, as the monotonic clock is the
+ *  same for every process.
+ */
+static void busTransitions(BUPSDisplay *display, const struct UPSData *status)
+{
+    BusTransition transition;
+
+    while(busNextTransition(bupsData -> bus, display -> ups, &transition)) {
+        hookTransition(status -> ups_Name, transition.previous, transition.status, transition.detected);
+    }
+}
+
+/** Transition callback of the client.
+ *  Runs on the client thread as soon as the status of a UPS changes, and
+ *  hands the change to the hook worker (which never blocks).
+ */
+static void clientTransition(gint ups, const gchar *name, guint previous, guint status, gint64 detected, gpointer data)
+{
+    hookTransition(name, previous, status, detected);
+}
+
+/** Reduce the readings shown by a chart type to their mean, lowest and highest value.
+ *  These come from the window of the UPS for the second just gone, or
+ *  straight from the status when no poll finished in it (polling less
+ *  often than once a second). A reading which was not fetched is left at 0.
+ *
+ *  \par Arguments:
+ *  \arg \c sample - the sample to fill in.
+ *  \arg \c row - which of the sample's charts the chart type is.
+ *  \arg \c type - the chart type.
+ *  \arg \c status - latest status of the UPS.
+ *  \arg \c window - its window for the last second, or NULL.
+ */
+static void sampleReadings(RingSample *sample, gint row, const BUPSChartType *type, const struct UPSData *status,
+                           const UPSWindow *window)
+{
+    gint var;
+    gint index;
+
+    for(index = 0; (index < MAX_DATA) && (type -> dataVars[index] >= 0); index++) {
+        var = type -> dataVars[index];
+        if(!(status -> ups_Fetched & (1 << var))) continue;
+
+        if(window) {
+            sample -> values[row][index] = window -> sum[var] / window -> samples;
+            sample -> low[row][index]    = window -> low[var];
+            sample -> high[row][index]   = window -> high[var];
+        } else {
+            sample -> values[row][index] = *(gfloat *)((gchar *)status + upsVars[var].offset);
+            sample -> low[row][index]    = sample -> values[row][index];
+            sample -> high[row][index]   = sample -> values[row][index];
+        }
+    }
+}
+
+/** Add the last second to the rolling statistics of a UPS.
+ *  Only the readings the chart text formats show statistics of are kept,
+ *  whether or not the text is switched on, so the statistics are there as
+ *  soon as it is; the others are forgotten. Nothing is added while the UPS
+ *  is not connected, nor for a reading which was not fetched.
+ *
+ *  \par Arguments:
+ *  \arg \c display - display of the UPS.
+ *  \arg \c status - latest status of the UPS.
+ *  \arg \c window - its window for the last second, or NULL.
+ */
+static void sampleStats(BUPSDisplay *display, const struct UPSData *status, const UPSWindow *window)
+{
+    guint32 wanted = bupsData -> voltType.compiled.stats | bupsData -> freqType.compiled.stats |
+                     bupsData -> tempType.compiled.stats;
+    gfloat  value;
+    gint    var;
+
+    for(var = 0; var < VAR_COUNT; var++) {
+        if(!(wanted & (1 << var))) {
+            resetReadingStats(display -> stats, var);
+        } else if(!(status -> ups_Fetched & (1 << var))) {
+            continue;
+        } else if(window) {
+            addStatsSample(display -> stats, var, window -> sum[var] / window -> samples,
+                           window -> low[var], window -> high[var]);
+        } else if(status -> ups_Present) {
+            value = *(gfloat *)((gchar *)status + upsVars[var].offset);
+            addStatsSample(display -> stats, var, value, value, value);
         }
-        pthread_mutex_unlock(&upsStatus_lock);
     }
-    drawLog();
-    gkrellm_draw_panel_layers(bupsData -> logDisplay);
+}
+
+/** Add the last second of values for one UPS to its charts.
+ *  status is the snapshot returned by readStatus(), which the client thread 
+ *  leaves alone until the next readStatus() call, so no locking is needed.
+ *  However many polls the second held, it makes one column and one redraw.
+ *  The values are also added to the history ring and the rolling
+ *  statistics of the UPS.
+ */
+static void updateDisplay(BUPSDisplay *display, struct UPSData *status)
+{
+    const UPSWindow *window;
+    RingSample       sample;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.time = time(NULL);
+    window      = statusWindow(status, sample.time - 1);
+    sampleReadings(&sample, 0, &bupsData -> voltType, status, window);
+    sampleReadings(&sample, 1, &bupsData -> freqType, status, window);
+    sampleReadings(&sample, 2, &bupsData -> tempType, status, window);
+
+    storeSample(display, &sample);
+    if(display -> history) appendSample(display -> history, &sample);
+    sampleStats(display, status, window);
+
+    drawChart(&display -> voltChart);
+    drawChart(&display -> freqChart);
+    drawChart(&display -> tempChart);
+
+    if(strlen(status -> ups_LastLog)) {
+        gkrellm_dup_string(&display -> logText, status -> ups_LastLog);
+    }
 }
 
 /** Create a new BUPSData chart.
@@ -429,11 +985,10 @@ static void updatePlugin(void)
  *  \arg \c vbox - the box into which a vbox containing a chart and panel should be added.
  *  \arg \c data - the BUPSData structure to fill in.
  *  \arg \c firstCreate - TRUE when this is the first tiem this has been called.
- *  \arg \c dataNames - array of names, one for each chartdata element (last element should be NULL).
- *  \arg \c name - Text to display as a label in the panel below the chart.
- *  \arg \c format - pointer to the function which formats this charts text overlay.
+ *  \arg \c type - the type of chart, this supplies the chartdata names, label and formatting.
+ *  \arg \c ups - index of the UPS the chart shows.
  */
-static void createChart(GtkWidget *vbox, BUPSChart *data, gint firstCreate, gchar *dataNames[], gchar *name, void (*format)(gchar *, gint, gchar*))
+static void createChart(GtkWidget *vbox, BUPSChart *data, gint firstCreate, BUPSChartType *type, gint ups)
 {
     int count = 0;
 
@@ -446,14 +1001,15 @@ static void createChart(GtkWidget *vbox, BUPSChart *data, gint firstCreate, gcha
         /* Chart and panel creation... */
 		data -> chart = gkrellm_chart_new0();
         data -> panel = data -> chart -> panel = gkrellm_panel_new0();
-        data -> format = format;
+        data -> type  = type;
+        data -> ups   = ups;
     }
 
     gkrellm_set_chart_height_default(data -> chart, DEFAULT_CHARTHEIGHT);
     gkrellm_chart_create(data -> vbox, mon, data -> chart, &data -> config);
 
-    while((count < MAX_DATA) && dataNames[count]) {
-        data -> data[count] = gkrellm_add_default_chartdata(data -> chart, dataNames[count]);
+    while((count < MAX_DATA) && (type -> dataVars[count] >= 0)) {
+        data -> data[count] = gkrellm_add_default_chartdata(data -> chart, (gchar *)upsVars[type -> dataVars[count]].label);
         gkrellm_monotonic_chartdata(data -> data[count], FALSE);
         gkrellm_set_chartdata_draw_style_default(data -> data[count], CHARTDATA_LINE);
         gkrellm_set_chartdata_flags(data -> data[count], CHARTDATA_ALLOW_HIDE);
@@ -472,13 +1028,28 @@ static void createChart(GtkWidget *vbox, BUPSChart *data, gint firstCreate, gcha
                                                    (gfloat) MIN_GRID_RES, 
                                                    (gfloat) MAX_GRID_RES, 
                                                    0, 0, 0, 70);
-	gkrellm_chartconfig_grid_resolution_label(data -> config, "Units drawn on the chart");
+	gkrellm_chartconfig_grid_resolution_label(data -> config, (type -> fixed == 100) ? "Hundredths drawn on the chart" :
+                                                                                     "Tenths drawn on the chart");
 
-    gkrellm_panel_configure(data -> panel, name, gkrellm_panel_style(style_id));
+    gkrellm_panel_configure(data -> panel, type -> label, gkrellm_panel_style(style_id));
     gkrellm_panel_create(data -> vbox, mon, data -> panel);
 
 	gkrellm_alloc_chartdata(data -> chart);
 
+    /* The columns and ranges start again empty along with the chartdata */
+    g_free(data -> columns);
+    data -> columnCount = gkrellm_chart_width();
+    data -> columns     = g_new0(BUPSColumn, data -> columnCount);
+    data -> columnSeq   = 0;
+    data -> spread      = 0;
+    for(count = 0; count < MAX_DATA; count++) {
+        g_free(data -> range[count].queue);
+        data -> range[count].queue = g_new(guint, data -> columnCount);
+        data -> range[count].head  = 0;
+        data -> range[count].tail  = 0;
+        data -> range[count].base  = 0;
+    }
+
     if(firstCreate) {
         /* callbacks to redraw the widgets. As far as I can tell, most gkrellm plugins
          * (and certainly the built-in meters) ignore the user data for these: here we
@@ -500,140 +1071,477 @@ static void createChart(GtkWidget *vbox, BUPSChart *data, gint firstCreate, gcha
 	}
 }
 
-/** Create the plugin charts and panels. 
+/** Label of the log panel of a UPS, when more than one is monitored.
+ *  Usually just the UPS name (the specification up to any "@" or ":"), but
+ *  when another UPS has the same name on a different host the whole
+ *  specification is used, so the two can be told apart.
+ *
+ *  \par Arguments:
+ *  \arg \c ups - index of the UPS, as passed to readStatus().
+ *  \arg \c count - number of UPSes monitored.
+ */
+static gchar *upsLabel(gint ups, gint count)
+{
+    const gchar *name = currentStatus(ups) -> ups_Name;
+    const gchar *otherName;
+    gint         len  = strcspn(name, "@:");
+    gint         other;
+
+    for(other = 0; other < count; other++) {
+        if(other == ups) continue;
+
+        otherName = currentStatus(other) -> ups_Name;
+        if((strcspn(otherName, "@:") == len) && !strncmp(otherName, name, len)) return g_strdup(name);
+    }
+    return g_strndup(name, len);
+}
+
+/** Create the charts and log panel for one UPS. 
  *  Much of the actual work for this is done by the createChart() function, only 
  *  the log display panel is actually created in teh body of this function - 
  *  createchart is called three times; once for the voltage display, once for 
  *  the frequency and once for the temperature. With a bit of fiddling it may
  *  be possible to make charts optional, but that's one for a future version..
+ *
+ *  \par Arguments:
+ *  \arg \c display - the display to create.
+ *  \arg \c ups - index of the UPS, as passed to readStatus().
+ *  \arg \c firstCreate - TRUE when the display is being created rather than rebuilt.
  */
-static void createPlugin(GtkWidget *vbox, gint firstCreate)
+static void createDisplay(BUPSDisplay *display, gint ups, gint firstCreate)
 {
-    gint labelWidth;
+    gchar *path;
+    gint   labelWidth;
 
     if(firstCreate) {
-        bupsData -> vbox = gtk_vbox_new(FALSE, 0);
-        gtk_container_add(GTK_CONTAINER(vbox), bupsData -> vbox);
-        gtk_widget_show(bupsData -> vbox);
+        display -> vbox = gtk_vbox_new(FALSE, 0);
+        gtk_container_add(GTK_CONTAINER(bupsData -> vbox), display -> vbox);
+        gtk_widget_show(display -> vbox);
+
+        display -> ups        = ups;
+        display -> logDisplay = gkrellm_panel_new0();
+
+        /* With more than one UPS the label has to say which one this is */
+        if(MAX(busUPSCount(bupsData -> bus), clientUPSCount(bupsData -> client)) > 1) {
+            display -> logLabel = upsLabel(ups, MAX(busUPSCount(bupsData -> bus), clientUPSCount(bupsData -> client)));
+        } else {
+            display -> logLabel = g_strdup("UPS");
+        }
 
-        bupsData -> logDisplay = gkrellm_panel_new0();
-        bupsData -> logLabel   = "UPS";
-        bupsData -> client     = launchClient(config -> host, config -> port);
+        path = historyPath(currentStatus(ups) -> ups_Name);
+        display -> history = openSampleRing(path);
+        g_free(path);
+        display -> stats = newRollingStats();
+        display -> archived = 0;
     }
     
-    createChart(bupsData -> vbox, &bupsData -> voltChart, firstCreate, voltNames, "Voltages", formatVoltText);
-    createChart(bupsData -> vbox, &bupsData -> freqChart, firstCreate, freqNames, "Freq"    , formatFreqText);
-    createChart(bupsData -> vbox, &bupsData -> tempChart, firstCreate, tempNames, "Stats"   , formatTempText);
-
-	bupsData -> logStyle = gkrellm_meter_style(style_id);
-    bupsData -> logDecal = gkrellm_create_decal_text(bupsData -> logDisplay, "Afp0",
-                                                     gkrellm_meter_alt_textstyle(style_id), 
-                                                     bupsData -> logStyle, -1, -1, -1);
+    createChart(display -> vbox, &display -> voltChart, firstCreate, &bupsData -> voltType, ups);
+    createChart(display -> vbox, &display -> freqChart, firstCreate, &bupsData -> freqType, ups);
+    createChart(display -> vbox, &display -> tempChart, firstCreate, &bupsData -> tempType, ups);
+
+    /* The chartdata has just been (re)allocated empty, put the recent history back */
+    refillCharts(display);
+    if(!firstCreate) {
+        drawChart(&display -> voltChart);
+        drawChart(&display -> freqChart);
+        drawChart(&display -> tempChart);
+    }
+
+	display -> logStyle = gkrellm_meter_style(style_id);
+    display -> logDecal = gkrellm_create_decal_text(display -> logDisplay, "Afp0",
+                                                    gkrellm_meter_alt_textstyle(style_id), 
+                                                    display -> logStyle, -1, -1, -1);
     
-    bupsData -> labelDecal = gkrellm_create_decal_text(bupsData -> logDisplay, bupsData -> logLabel,
-                                                     gkrellm_meter_textstyle(style_id), 
-                                                     bupsData -> logStyle, -1, -1, -1);
+    display -> labelDecal = gkrellm_create_decal_text(display -> logDisplay, display -> logLabel,
+                                                      gkrellm_meter_textstyle(style_id), 
+                                                      display -> logStyle, -1, -1, -1);
 
-    labelWidth = gdk_string_width(bupsData -> labelDecal -> text_style.font, bupsData -> logLabel);
-    if(labelWidth < bupsData -> labelDecal -> w) {
-        bupsData -> labelX = (bupsData -> labelDecal -> w - labelWidth) / 2;
+    labelWidth = gdk_string_width(display -> labelDecal -> text_style.font, display -> logLabel);
+    if(labelWidth < display -> labelDecal -> w) {
+        display -> labelX = (display -> labelDecal -> w - labelWidth) / 2;
     } else {
-        bupsData -> labelX = 0;
+        display -> labelX = 0;
     }
 
-    bupsData -> logScr = 0;
+    display -> logScr = 0;
 
-	gkrellm_panel_configure(bupsData -> logDisplay, NULL, bupsData -> logStyle);
-	gkrellm_panel_create(vbox, mon, bupsData -> logDisplay);
+	gkrellm_panel_configure(display -> logDisplay, NULL, display -> logStyle);
+	gkrellm_panel_create(display -> vbox, mon, display -> logDisplay);
      
     config -> showLog = !config -> showLog;
-    drawLog();
+    drawLog(display);
     config -> showLog = !config -> showLog;
-    drawLog();
+    drawLog(display);
 
     if(config -> showLog) {
-        gkrellm_make_decal_visible(bupsData -> logDisplay, bupsData -> logDecal);
-        gkrellm_make_decal_invisible(bupsData -> logDisplay, bupsData -> labelDecal);
+        gkrellm_make_decal_visible(display -> logDisplay, display -> logDecal);
+        gkrellm_make_decal_invisible(display -> logDisplay, display -> labelDecal);
     } else {
-        gkrellm_make_decal_invisible(bupsData -> logDisplay, bupsData -> logDecal);
-        gkrellm_make_decal_visible(bupsData -> logDisplay, bupsData -> labelDecal);
+        gkrellm_make_decal_invisible(display -> logDisplay, display -> logDecal);
+        gkrellm_make_decal_visible(display -> logDisplay, display -> labelDecal);
     }
 
     if(firstCreate) {
- 		gtk_signal_connect(GTK_OBJECT(bupsData -> logDisplay -> drawing_area), 
+ 		gtk_signal_connect(GTK_OBJECT(display -> logDisplay -> drawing_area), 
                            "expose_event",
-                           (GtkSignalFunc)exposeLogEvent, NULL);
-		gtk_signal_connect(GTK_OBJECT(bupsData -> logDisplay -> drawing_area),
+                           (GtkSignalFunc)exposeLogEvent, display);
+		gtk_signal_connect(GTK_OBJECT(display -> logDisplay -> drawing_area),
                            "button_press_event", 
-                           (GtkSignalFunc)cbLogClick, NULL);
+                           (GtkSignalFunc)cbLogClick, display);
+    }
+}
+
+/** Create or rebuild the displays for every UPS being monitored.
+ *  Must be called after startMonitoring() so that the number of UPSes is known.
+ */
+static void createDisplays(gint firstCreate)
+{
+    gint index;
+
+    if(firstCreate) bupsData -> upsCount = MAX(busUPSCount(bupsData -> bus), clientUPSCount(bupsData -> client));
+
+    for(index = 0; index < bupsData -> upsCount; index++) {
+        createDisplay(&bupsData -> ups[index], index, firstCreate);
+    }
+}
+
+/** Destroy a single chart, keeping its configuration for reuse. */
+static void destroyChart(BUPSChart *chart)
+{
+    gint index;
+
+    gkrellm_chart_destroy(chart -> chart);
+    g_free(chart -> columns);
+    for(index = 0; index < MAX_DATA; index++) {
+        g_free(chart -> range[index].queue);
+        chart -> range[index].queue = NULL;
+    }
+    chart -> chart   = NULL;
+    chart -> panel   = NULL;
+    chart -> columns = NULL;
+}
+
+/** Destroy the displays of every UPS.
+ *  Used when the list of UPSes changes. The chart configurations are kept
+ *  so that a UPS in the same position in the list keeps its chart settings.
+ */
+static void destroyDisplays(void)
+{
+    BUPSDisplay *display;
+    gint         index;
+
+    for(index = 0; index < bupsData -> upsCount; index++) {
+        display = &bupsData -> ups[index];
+
+        destroyChart(&display -> voltChart);
+        destroyChart(&display -> freqChart);
+        destroyChart(&display -> tempChart);
+        gkrellm_panel_destroy(display -> logDisplay);
+        gtk_widget_destroy(display -> vbox);
+
+        closeSampleRing(display -> history);
+        freeRollingStats(display -> stats);
+        g_free(display -> logLabel);
+        g_free(display -> logText);
+        display -> logDisplay = NULL;
+        display -> logLabel   = NULL;
+        display -> logText    = NULL;
+        display -> history    = NULL;
+        display -> stats      = NULL;
+        display -> vbox       = NULL;
+    }
+    bupsData -> upsCount = 0;
+}
+
+/** Start monitoring the UPSes in the configuration.
+ *  If a local collector is publishing every one of them on the snapshot bus
+ *  its snapshots are used, otherwise a client of our own is started - either
+ *  way the UPSes are numbered in the order of the configured list.
+ */
+static void startMonitoring(void)
+{
+    bupsData -> busCheck = 0;
+    if((bupsData -> bus = attachBus(config -> host)) == NULL) {
+        bupsData -> client = launchClient(config -> host, config -> port, config -> protocol, &config -> poll,
+                                          clientNotify, clientTransition, NULL);
+    }
+}
+
+/** Stop monitoring, whether through the snapshot bus or our own client. */
+static void stopMonitoring(void)
+{
+    closeBus(bupsData -> bus);
+    haltClient(bupsData -> client);
+    bupsData -> bus    = NULL;
+    bupsData -> client = NULL;
+}
+
+/** Restart monitoring and rebuild the displays to match. */
+static void restartMonitoring(void)
+{
+    stopMonitoring();
+    destroyDisplays();
+    startMonitoring();
+    createDisplays(TRUE);
+}
+
+/** Create the plugin charts and panels. 
+ *  This starts monitoring and then creates a display for every UPS being
+ *  monitored, see createDisplay() for the details.
+ */
+static void createPlugin(GtkWidget *vbox, gint firstCreate)
+{
+    if(firstCreate) {
+        bupsData -> vbox = gtk_vbox_new(FALSE, 0);
+        gtk_container_add(GTK_CONTAINER(vbox), bupsData -> vbox);
+        gtk_widget_show(bupsData -> vbox);
+
+        if(config -> archive) openArchive();
+        if(config -> hook[0]) startHooks(config -> hook);
+        startMonitoring();
+    }
+
+    createDisplays(firstCreate);
+}
+
+/** Readings a chart needs: those of its visible chartdata, those its text
+ *  overlay shows while that is switched on, and those it shows statistics
+ *  of all the time (see sampleStats()).
+ */
+static guint32 chartReadings(const BUPSChart *chart)
+{
+    const BUPSChartType *type   = chart -> type;
+    guint32              wanted = type -> showText ? type -> compiled.readings : type -> compiled.stats;
+    gint                 index;
+
+    for(index = 0; (index < MAX_DATA) && (type -> dataVars[index] >= 0); index++) {
+        if(chart -> data[index] && !chart -> data[index] -> hide) wanted |= 1 << type -> dataVars[index];
+    }
+    return wanted;
+}
+
+/** Tell our client which readings each UPS needs.
+ *  Called every second, so hiding chartdata, switching a text overlay or
+ *  editing a format changes what is fetched from the next poll. The archive
+ *  needs its readings whatever the charts show, and the status (all the log
+ *  panel shows) is always fetched. A collector on the snapshot bus fetches
+ *  everything regardless, it has other readers.
+ */
+static void updateWantedVars(void)
+{
+    BUPSDisplay *display;
+    guint32      wanted;
+    gint         index;
+
+    for(index = 0; index < bupsData -> upsCount; index++) {
+        display = &bupsData -> ups[index];
+        wanted  = chartReadings(&display -> voltChart) | chartReadings(&display -> freqChart) |
+                  chartReadings(&display -> tempChart);
+        if(config -> archive) wanted |= ARCHIVE_VARS;
+        setWantedVars(bupsData -> client, index, wanted);
+    }
+}
+
+/** Refresh the Diagnostics page of the configuration tab.
+ *  Lists the poll health of every UPS, as published with its status by the
+ *  client (or the collector) polling it, along with its model and firmware
+ *  when upsd reports them, followed by how the status hooks are doing when
+ *  there are any.
+ */
+static void updateDiagnostics(void)
+{
+    struct UPSData *status;
+    HookStats hooks;
+    gchar  text[MAX_UPS * (160 + 2 * MAX_INFO) + 160];
+    gint   len = 0;
+    gint   index;
+
+    text[0] = '\0';
+    for(index = 0; (index < bupsData -> upsCount) && (len < (gint)sizeof(text) - 1); index++) {
+        status = currentStatus(index);
+        len += g_snprintf(text + len, sizeof(text) - len, "%s\n", status -> ups_Name);
+        if(status -> ups_Model[0]) {
+            len += g_snprintf(text + len, sizeof(text) - len, "  %s%s%s\n", status -> ups_Model,
+                              status -> ups_Firmware[0] ? ", firmware " : "", status -> ups_Firmware);
+        }
+        len += g_snprintf(text + len, sizeof(text) - len,
+                          "  %u replies, median %.1f ms, 99th percentile %.1f ms\n"
+                          "  %u timeouts, %u reconnects, %u parse errors, %u stale\n\n",
+                          status -> ups_Health.replies,
+                          rttPercentile(&status -> ups_Health, 50) / 1000.0,
+                          rttPercentile(&status -> ups_Health, 99) / 1000.0,
+                          status -> ups_Health.timeouts, status -> ups_Health.reconnects,
+                          status -> ups_Health.parseErrors, status -> ups_Health.staleData);
+        len = MIN(len, (gint)sizeof(text) - 1);
+    }
+    if(config -> hook[0] && (len > 0)) {
+        hookStats(&hooks);
+        g_snprintf(text + len, sizeof(text) - len,
+                   "Status hooks\n  %u run, dispatch median %.1f ms, 99th percentile %.1f ms\n"
+                   "  %u failed, %u dropped\n",
+                   hooks.run, latencyPercentile(hooks.latency, hooks.run, 50) / 1000.0,
+                   latencyPercentile(hooks.latency, hooks.run, 99) / 1000.0, hooks.failed, hooks.dropped);
+    }
+    gtk_label_set_text(GTK_LABEL(diagLabel), (len > 0) ? text : "No UPS is being monitored.");
+}
+
+/** Add latest chart values and check for log updates.
+ *  Called fairly regularly, but this only does anythignn really interesting once
+ *  a second - it picks up the latest snapshot published by the client thread
+ *  (or the collector) for every UPS and adds its values to the charts. Every
+ *  BUS_CHECK_INTERVAL seconds it also checks whether to switch between the
+ *  snapshot bus and a client of our own, as a collector comes and goes. The
+ *  Diagnostics page is refreshed along with the charts while it exists, and
+ *  the readings our client fetches are brought into line with the charts.
+ *  Snapshots from a collector also go to the archive from here, and the
+ *  status changes it has seen are handed to the hooks on every call.
+ */ 
+static void updatePlugin(void)
+{
+    struct UPSData *status;
+    SnapshotBus    *bus;
+    gint            index;
+
+    if(GK.second_tick && (++bupsData -> busCheck >= BUS_CHECK_INTERVAL)) {
+        bupsData -> busCheck = 0;
+        if(bupsData -> bus) {
+            if(!busAlive(bupsData -> bus)) restartMonitoring();
+        } else if((bus = attachBus(config -> host)) != NULL) {
+            closeBus(bus);
+            restartMonitoring();
+        }
+    }
+
+    if(GK.second_tick) {
+        for(index = 0; index < bupsData -> upsCount; index++) {
+            status = currentStatus(index);
+            updateDisplay(&bupsData -> ups[index], status);
+            if(bupsData -> bus) archiveBusStatus(&bupsData -> ups[index], status);
+        }
+        if(diagLabel) updateDiagnostics();
+        updateWantedVars();
+    }
+
+    for(index = 0; index < bupsData -> upsCount; index++) {
+        if(bupsData -> bus) busTransitions(&bupsData -> ups[index], currentStatus(index));
+        drawLog(&bupsData -> ups[index]);
+        gkrellm_draw_panel_layers(bupsData -> ups[index].logDisplay);
+    }
+}
+
+/** Name used for a chart configuration line.
+ *  The first UPS uses the plain chart type name (as older versions of the
+ *  plugin did), the others have their index appended.
+ */
+static void chartConfigName(gchar *buffer, gint size, BUPSChartType *type, gint ups)
+{
+    if(ups) {
+        snprintf(buffer, size, "%s%d", type -> name, ups);
+    } else {
+        snprintf(buffer, size, "%s", type -> name);
     }
 }
 
 /** Save the user settings.
  *  Write the configuration data to the specified file. Note that some of the 
- *  values come from the config structure, but the show chart texts, which are
- *  only proxied in the config structure, are taken from the chart data structs. 
+ *  values come from the config structure, but the chart texts and formats
+ *  come from the chart types shared by the displays. 
  */
 static void saveConfig(FILE *file)
 {
+    BUPSDisplay *display;
+    gchar        name[32];
+    gint         index;
+
     fprintf(file, "%s host %s\n"       , MONITOR_CONFIG_KEYWORD, config -> host);
     fprintf(file, "%s port %d\n"       , MONITOR_CONFIG_KEYWORD, config -> port);
-    fprintf(file, "%s mains %d\n"      , MONITOR_CONFIG_KEYWORD, config -> mains);
+    fprintf(file, "%s protocol %d\n"   , MONITOR_CONFIG_KEYWORD, config -> protocol);
+    fprintf(file, "%s poll_line %d\n"  , MONITOR_CONFIG_KEYWORD, config -> poll.lineInterval);
+    fprintf(file, "%s poll_battery %d\n", MONITOR_CONFIG_KEYWORD, config -> poll.batteryInterval);
+    fprintf(file, "%s poll_alert %d\n" , MONITOR_CONFIG_KEYWORD, config -> poll.alertInterval);
     fprintf(file, "%s showlog %d\n"    , MONITOR_CONFIG_KEYWORD, config -> showLog);
-    fprintf(file, "%s volt_format %s\n", MONITOR_CONFIG_KEYWORD, bupsData -> voltChart.textFormat);
-    fprintf(file, "%s freq_format %s\n", MONITOR_CONFIG_KEYWORD, bupsData -> freqChart.textFormat);
-    fprintf(file, "%s temp_format %s\n", MONITOR_CONFIG_KEYWORD, bupsData -> tempChart.textFormat);
-    fprintf(file, "%s show_volt %d\n"  , MONITOR_CONFIG_KEYWORD, bupsData -> voltChart.showText);
-    fprintf(file, "%s show_freq %d\n"  , MONITOR_CONFIG_KEYWORD, bupsData -> freqChart.showText);
-    fprintf(file, "%s show_temp %d\n"  , MONITOR_CONFIG_KEYWORD, bupsData -> tempChart.showText);
-	gkrellm_save_chartconfig(file, bupsData -> voltChart.config, MONITOR_CONFIG_KEYWORD, "volt");
-	gkrellm_save_chartconfig(file, bupsData -> freqChart.config, MONITOR_CONFIG_KEYWORD, "freq");
-	gkrellm_save_chartconfig(file, bupsData -> tempChart.config, MONITOR_CONFIG_KEYWORD, "temp");
+    fprintf(file, "%s archive %d\n"    , MONITOR_CONFIG_KEYWORD, config -> archive);
+    fprintf(file, "%s hook %s\n"       , MONITOR_CONFIG_KEYWORD, config -> hook);
+    fprintf(file, "%s volt_format %s\n", MONITOR_CONFIG_KEYWORD, bupsData -> voltType.textFormat);
+    fprintf(file, "%s freq_format %s\n", MONITOR_CONFIG_KEYWORD, bupsData -> freqType.textFormat);
+    fprintf(file, "%s temp_format %s\n", MONITOR_CONFIG_KEYWORD, bupsData -> tempType.textFormat);
+    fprintf(file, "%s show_volt %d\n"  , MONITOR_CONFIG_KEYWORD, bupsData -> voltType.showText);
+    fprintf(file, "%s show_freq %d\n"  , MONITOR_CONFIG_KEYWORD, bupsData -> freqType.showText);
+    fprintf(file, "%s show_temp %d\n"  , MONITOR_CONFIG_KEYWORD, bupsData -> tempType.showText);
+
+    for(index = 0; index < bupsData -> upsCount; index++) {
+        display = &bupsData -> ups[index];
+
+        chartConfigName(name, sizeof(name), &bupsData -> voltType, index);
+        gkrellm_save_chartconfig(file, display -> voltChart.config, MONITOR_CONFIG_KEYWORD, name);
+        chartConfigName(name, sizeof(name), &bupsData -> freqType, index);
+        gkrellm_save_chartconfig(file, display -> freqChart.config, MONITOR_CONFIG_KEYWORD, name);
+        chartConfigName(name, sizeof(name), &bupsData -> tempType, index);
+        gkrellm_save_chartconfig(file, display -> tempChart.config, MONITOR_CONFIG_KEYWORD, name);
+    }
 }
 
 /** Load the user settings.
  *  Attepts to extract Useful Information(tm) from a string presented to the
  *  function buy GKrellM. Things are slightly more complicated than the average
  *  case by the fact that we need to distinguish between three chartconfig lines
- *  rather than the single chart mst plugins deal with.
+ *  for each UPS rather than the single chart mst plugins deal with.
  */
 static void loadConfig(gchar *line)
 {
     gchar keyword[31], name[31];
     gchar data[CONFIG_BUFSIZE], conf[CONFIG_BUFSIZE];
+    gint  ups;
 
     if(2 == sscanf(line, "%31s %[^\n]", keyword, data)) {
         if(!strcmp(keyword, "host")) {
-            strcpy(config -> host, data);
+            g_snprintf(config -> host, sizeof(config -> host), "%s", data);
         } else if(!strcmp(keyword, "port")) {
-            config -> port = strtol(data, NULL, 10);
-        } else if(!strcmp(keyword, "mains")) {
-            config -> mains = strtol(data, NULL, 10);
+            /* Configs saved before the protocol option existed were talking 
+             * to an old upsd, the protocol line (if any) follows this one.
+             */
+            config -> port     = strtol(data, NULL, 10);
+            config -> protocol = PROTOCOL_LEGACY;
+        } else if(!strcmp(keyword, "protocol")) {
+            config -> protocol = strtol(data, NULL, 10);
+        } else if(!strcmp(keyword, "poll_line")) {
+            config -> poll.lineInterval = strtol(data, NULL, 10);
+        } else if(!strcmp(keyword, "poll_battery")) {
+            config -> poll.batteryInterval = strtol(data, NULL, 10);
+        } else if(!strcmp(keyword, "poll_alert")) {
+            config -> poll.alertInterval = strtol(data, NULL, 10);
         } else if(!strcmp(keyword, "showlog")) {
             config -> showLog = strtol(data, NULL, 10);
+        } else if(!strcmp(keyword, "archive")) {
+            config -> archive = strtol(data, NULL, 10);
+        } else if(!strcmp(keyword, "hook")) {
+            g_snprintf(config -> hook, sizeof(config -> hook), "%s", data);
         } else if(!strcmp(keyword, "volt_format")) {
-            gkrellm_dup_string(&bupsData -> voltChart.textFormat, data);
+            setChartFormat(&bupsData -> voltType, data);
         } else if(!strcmp(keyword, "freq_format")) {
-            gkrellm_dup_string(&bupsData -> freqChart.textFormat, data);
+            setChartFormat(&bupsData -> freqType, data);
         } else if(!strcmp(keyword, "temp_format")) {
-            gkrellm_dup_string(&bupsData -> tempChart.textFormat, data);
+            setChartFormat(&bupsData -> tempType, data);
         } else if(!strcmp(keyword, "show_volt")) {
-            bupsData -> voltChart.showText = strtol(data, NULL, 10);
+            bupsData -> voltType.showText = strtol(data, NULL, 10);
         } else if(!strcmp(keyword, "show_freq")) {
-            bupsData -> freqChart.showText = strtol(data, NULL, 10);
+            bupsData -> freqType.showText = strtol(data, NULL, 10);
         } else if(!strcmp(keyword, "show_temp")) {
-            bupsData -> tempChart.showText = strtol(data, NULL, 10);
+            bupsData -> tempType.showText = strtol(data, NULL, 10);
         } else if(!strcmp(keyword, GKRELLM_CHARTCONFIG_KEYWORD)) {
             /* line is a chartconfig, need to do a bit more parsing to work out 
-             * which chart this is the config for..
+             * which chart of which UPS this is the config for..
              */
             if(2 == sscanf(data, "%31s %[^\n]", name, conf)) {
-                if(!strcmp(name, "volt")) {
-                    gkrellm_load_chartconfig(&bupsData -> voltChart.config, conf, 3);
-                } else if(!strcmp(name, "freq")) {
-                    gkrellm_load_chartconfig(&bupsData -> freqChart.config, conf, 2);
-                } else if(!strcmp(name, "temp")) {
-                    gkrellm_load_chartconfig(&bupsData -> tempChart.config, conf, 2);
+                ups = strtol(name + 4, NULL, 10);
+                if((ups < 0) || (ups >= MAX_UPS)) return;
+
+                if(!strncmp(name, "volt", 4)) {
+                    gkrellm_load_chartconfig(&bupsData -> ups[ups].voltChart.config, conf, 3);
+                } else if(!strncmp(name, "freq", 4)) {
+                    gkrellm_load_chartconfig(&bupsData -> ups[ups].freqChart.config, conf, 2);
+                } else if(!strncmp(name, "temp", 4)) {
+                    gkrellm_load_chartconfig(&bupsData -> ups[ups].tempChart.config, conf, 2);
                 }
             }
         }
@@ -643,42 +1551,92 @@ static void loadConfig(gchar *line)
 /** Update the plugin configuration based on values in the user interface.
  *  This copies the values from the gadgets in the tab created by createTab()
  *  into the config structure. Note that this will only restart the client
- *  when the host or port have changed!
+ *  (and rebuild the displays) when the UPS list, port, protocol or poll 
+ *  intervals have changed!
  */
 static void applyConfig(void)
 {
-    gchar *contents;
-    gint   portset;
+    PollPolicy pollset;
+    gchar     *contents;
+    gint       portset;
+    gint       protoset;
 
     contents = gtk_entry_get_text(GTK_ENTRY(GTK_COMBO(voltCombo)->entry));
-    if(gkrellm_dup_string(&bupsData -> voltChart.textFormat, contents)) {
-        drawChart(&bupsData -> voltChart);
+    if(setChartFormat(&bupsData -> voltType, contents)) {
+        drawChartType(&bupsData -> voltType);
     }
 
     contents = gtk_entry_get_text(GTK_ENTRY(GTK_COMBO(freqCombo)->entry));
-    if(gkrellm_dup_string(&bupsData -> freqChart.textFormat, contents)) {
-        drawChart(&bupsData -> freqChart);
+    if(setChartFormat(&bupsData -> freqType, contents)) {
+        drawChartType(&bupsData -> freqType);
     }
 
     contents = gtk_entry_get_text(GTK_ENTRY(GTK_COMBO(tempCombo)->entry));
-    if(gkrellm_dup_string(&bupsData -> tempChart.textFormat, contents)) {
-        drawChart(&bupsData -> tempChart);
+    if(setChartFormat(&bupsData -> tempType, contents)) {
+        drawChartType(&bupsData -> tempType);
+    }
+
+    /* The archive can be switched on and off without disturbing the client */
+    if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(archiveWidget)) != config -> archive) {
+        config -> archive = !config -> archive;
+        if(config -> archive) {
+            openArchive();
+        } else {
+            stopArchive();
+        }
+    }
+
+    /* So can the hooks, the worker takes the new command without waiting for a hook still running */
+    contents = gtk_entry_get_text(GTK_ENTRY(hookWidget));
+    if(strcmp(contents, config -> hook)) {
+        strncpy(config -> hook, contents, MAX_HOOKCMD - 1);
+        setHookCommand(config -> hook);
     }
-    
-    config -> mains = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(mainsWidget));
 
     contents = gtk_entry_get_text(GTK_ENTRY(hostWidget));
     portset  = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(portWidget));
+    protoset = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(legacyWidget)) ? PROTOCOL_LEGACY : PROTOCOL_LIST;
+    pollset.lineInterval    = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(pollWidget[0]));
+    pollset.batteryInterval = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(pollWidget[1]));
+    pollset.alertInterval   = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(pollWidget[2]));
 
     /* Only restart the client if we really have to as this can have a visible
      * effect on updates of the main window.
      */
-    if(strcmp(contents, config -> host) || (portset != config -> port)) {
-        haltClient(bupsData -> client);
-        strcpy(config -> host, contents);
-        config -> port = portset;
-        bupsData -> client = launchClient(config -> host, config -> port);
+    if(strcmp(contents, config -> host) || (portset != config -> port) || (protoset != config -> protocol) ||
+       memcmp(&pollset, &config -> poll, sizeof(PollPolicy))) {
+        strncpy(config -> host, contents, MAX_UPSLIST - 1);
+        config -> port     = portset;
+        config -> protocol = protoset;
+        config -> poll     = pollset;
+        restartMonitoring();
+    }
+}
+
+/** Add the substitution variables of a chart type to the help text.
+ *  Readings are described by their entries in upsVars, so the help always
+ *  matches what the formats accept.
+ */
+static void addFormatHelp(GtkWidget *text, const gchar *title, const BUPSFormatVar *vars)
+{
+    gchar **lines;
+    gint    count;
+    gint    index;
+
+    for(count = 0; vars[count].code; count++);
+    lines = g_new(gchar *, count + 3);
+
+    lines[0] = g_strdup_printf("<b>%s:\n", title);
+    lines[1] = g_strdup("Substitution variables for the format string for chart labels:\n");
+    for(index = 0; index < count; index++) {
+        lines[index + 2] = g_strdup_printf("\t$%c\t%s\n", vars[index].code, (vars[index].kind == FORMAT_READING) ?
+                                           upsVars[vars[index].offset].help : vars[index].help);
     }
+    lines[count + 2] = g_strdup("\n");
+
+    gkrellm_add_info_text(text, lines, count + 3);
+    for(index = 0; index < count + 3; index++) g_free(lines[index]);
+    g_free(lines);
 }
 
 /** Create the configuration tab.
@@ -698,19 +1656,27 @@ static void createTab(GtkWidget *tab)
     GtkWidget *tempLabel;
     GtkWidget *voltLabel;
     GtkWidget *freqLabel;
-    GtkObject *mainsWidget_adj;
-    GtkWidget *mainsLabel;
     GtkWidget *server;
     GtkWidget *table2;
     GtkWidget *hostLabel;
+    GtkWidget *hookLabel;
     GtkObject *portWidget_adj;
     GtkWidget *portLabel;
+    GtkObject *pollWidget_adj;
+    GtkWidget *pollLabel;
+    gchar     *pollLabels[3] = { "Poll interval on line (ms)", "Poll interval on battery (ms)", "Poll interval on alert (ms)" };
+    gint       pollValues[3];
+    gint       index;
     GtkWidget *label;
     GtkWidget *frame;
     GtkWidget *text;
     GtkWidget *infoWindow;
     GtkWidget *aboutLabel;
     
+    pollValues[0] = config -> poll.lineInterval;
+    pollValues[1] = config -> poll.batteryInterval;
+    pollValues[2] = config -> poll.alertInterval;
+
     note = gtk_notebook_new();
     gtk_notebook_set_tab_pos(GTK_NOTEBOOK(note), GTK_POS_TOP);
     gtk_box_pack_start(GTK_BOX(tab), note, TRUE, TRUE, 0);
@@ -725,7 +1691,7 @@ static void createTab(GtkWidget *tab)
     gtk_widget_show(formats);
     gtk_box_pack_start(GTK_BOX(vbox1), formats, TRUE, TRUE, 0);
 
-    table1 = gtk_table_new(4, 2, FALSE);
+    table1 = gtk_table_new(3, 2, FALSE);
     gtk_container_border_width(GTK_CONTAINER(table1), 3);
     gtk_widget_show(table1);
     gtk_container_add(GTK_CONTAINER(formats), table1);
@@ -743,7 +1709,7 @@ static void createTab(GtkWidget *tab)
     voltCombo_items = g_list_append(voltCombo_items, (gpointer)"i:\\f$i,\\.o:\\f$o");
     voltCombo_items = g_list_append(voltCombo_items, (gpointer)"i:\\f$i,\\no:\\f$o");
     gtk_combo_set_popdown_strings(GTK_COMBO(voltCombo), voltCombo_items);
-    gtk_entry_set_text(GTK_ENTRY(GTK_COMBO(voltCombo)->entry), bupsData -> voltChart.textFormat);
+    gtk_entry_set_text(GTK_ENTRY(GTK_COMBO(voltCombo)->entry), bupsData -> voltType.textFormat);
     g_list_free(voltCombo_items);
 
     freqCombo = gtk_combo_new();
@@ -755,7 +1721,7 @@ static void createTab(GtkWidget *tab)
     freqCombo_items = g_list_append(freqCombo_items, (gpointer)"i:\\f$i\\no:\\f$o");
     freqCombo_items = g_list_append(freqCombo_items, (gpointer)"i:\\f$i,\\.o:\\f$o");
     gtk_combo_set_popdown_strings(GTK_COMBO(freqCombo), freqCombo_items);
-    gtk_entry_set_text(GTK_ENTRY(GTK_COMBO(freqCombo)->entry), bupsData -> freqChart.textFormat);
+    gtk_entry_set_text(GTK_ENTRY(GTK_COMBO(freqCombo)->entry), bupsData -> freqType.textFormat);
     g_list_free(freqCombo_items);
 
     tempCombo = gtk_combo_new();
@@ -767,17 +1733,9 @@ static void createTab(GtkWidget *tab)
     tempCombo_items = g_list_append(tempCombo_items, (gpointer)"t:\\f$tC\\nl:\\f$l%");
     tempCombo_items = g_list_append(tempCombo_items, (gpointer)"t:\\f$tC,\\.l:\\f$l%");
     gtk_combo_set_popdown_strings(GTK_COMBO(tempCombo), tempCombo_items);
-    gtk_entry_set_text(GTK_ENTRY(GTK_COMBO(tempCombo)->entry), bupsData -> tempChart.textFormat);
+    gtk_entry_set_text(GTK_ENTRY(GTK_COMBO(tempCombo)->entry), bupsData -> tempType.textFormat);
     g_list_free(tempCombo_items);
 
-    mainsWidget_adj = gtk_adjustment_new(config -> mains, 0, 250, 1, 10, 20);
-    mainsWidget = gtk_spin_button_new(GTK_ADJUSTMENT(mainsWidget_adj), 1, 0);
-    gtk_widget_show(mainsWidget);
-    gtk_table_attach(GTK_TABLE(table1), mainsWidget, 0, 1, 3, 4,
-                    (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
-                    (GtkAttachOptions)(0), 0, 0);
-    gtk_spin_button_set_numeric(GTK_SPIN_BUTTON(mainsWidget), TRUE);
-
     voltLabel = gtk_label_new("Voltage chart format");
     gtk_widget_show(voltLabel);
     gtk_table_attach(GTK_TABLE(table1), voltLabel, 1, 2, 0, 1,
@@ -802,33 +1760,25 @@ static void createTab(GtkWidget *tab)
     gtk_label_set_justify(GTK_LABEL(tempLabel), GTK_JUSTIFY_LEFT);
     gtk_misc_set_alignment(GTK_MISC(tempLabel), 0, 0.5);
 
-    mainsLabel = gtk_label_new("Mains (see info page)");
-    gtk_widget_show(mainsLabel);
-    gtk_table_attach(GTK_TABLE(table1), mainsLabel, 1, 2, 3, 4,
-                    (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
-                    (GtkAttachOptions)(0), 0, 0);
-    gtk_label_set_justify(GTK_LABEL(mainsLabel), GTK_JUSTIFY_LEFT);
-    gtk_misc_set_alignment(GTK_MISC(mainsLabel), 0, 0.5);
-
     server = gtk_frame_new("UPS Server");
     gtk_widget_show(server);
     gtk_box_pack_start(GTK_BOX(vbox1), server, TRUE, TRUE, 0);
 
-    table2 = gtk_table_new(2, 2, FALSE);
+    table2 = gtk_table_new(8, 2, FALSE);
     gtk_container_border_width(GTK_CONTAINER(table2), 3);
     gtk_widget_show (table2);
     gtk_container_add(GTK_CONTAINER(server), table2);
     gtk_table_set_row_spacings(GTK_TABLE(table2), 2);
     gtk_table_set_col_spacings(GTK_TABLE(table2), 2);
 
-    hostWidget = gtk_entry_new_with_max_length(256);
+    hostWidget = gtk_entry_new_with_max_length(MAX_UPSLIST - 1);
     gtk_widget_show(hostWidget);
     gtk_table_attach(GTK_TABLE(table2), hostWidget, 0, 1, 0, 1,
                     (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
                     (GtkAttachOptions)(0), 0, 0);
     gtk_entry_set_text(GTK_ENTRY(hostWidget), config -> host);
 
-    hostLabel = gtk_label_new("Hostname");
+    hostLabel = gtk_label_new("UPS list (see info page)");
     gtk_widget_show(hostLabel);
     gtk_table_attach(GTK_TABLE(table2), hostLabel, 1, 2, 0, 1,
                     (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
@@ -844,7 +1794,7 @@ static void createTab(GtkWidget *tab)
                     (GtkAttachOptions)(0), 0, 0);
     gtk_spin_button_set_numeric(GTK_SPIN_BUTTON(portWidget), TRUE);
 
-    portLabel = gtk_label_new("Port");
+    portLabel = gtk_label_new("Default port");
     gtk_widget_show(portLabel);
     gtk_table_attach(GTK_TABLE(table2), portLabel, 1, 2, 1, 2,
                     (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
@@ -852,6 +1802,67 @@ static void createTab(GtkWidget *tab)
     gtk_label_set_justify(GTK_LABEL(portLabel), GTK_JUSTIFY_LEFT);
     gtk_misc_set_alignment(GTK_MISC(portLabel), 0, 0.5);
 
+    legacyWidget = gtk_check_button_new_with_label("Legacy REQ protocol (upsd before 2.0)");
+    gtk_widget_show(legacyWidget);
+    gtk_table_attach(GTK_TABLE(table2), legacyWidget, 0, 2, 2, 3,
+                    (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
+                    (GtkAttachOptions)(0), 0, 0);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(legacyWidget), config -> protocol == PROTOCOL_LEGACY);
+
+    for(index = 0; index < 3; index++) {
+        pollWidget_adj = gtk_adjustment_new(pollValues[index], MIN_POLL_INTERVAL, 60000, 50, 500, 1000);
+        pollWidget[index] = gtk_spin_button_new(GTK_ADJUSTMENT(pollWidget_adj), 1, 0);
+        gtk_widget_show(pollWidget[index]);
+        gtk_table_attach(GTK_TABLE(table2), pollWidget[index], 0, 1, 3 + index, 4 + index,
+                        (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
+                        (GtkAttachOptions)(0), 0, 0);
+        gtk_spin_button_set_numeric(GTK_SPIN_BUTTON(pollWidget[index]), TRUE);
+
+        pollLabel = gtk_label_new(pollLabels[index]);
+        gtk_widget_show(pollLabel);
+        gtk_table_attach(GTK_TABLE(table2), pollLabel, 1, 2, 3 + index, 4 + index,
+                        (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
+                        (GtkAttachOptions)(0), 0, 0);
+        gtk_label_set_justify(GTK_LABEL(pollLabel), GTK_JUSTIFY_LEFT);
+        gtk_misc_set_alignment(GTK_MISC(pollLabel), 0, 0.5);
+    }
+
+    archiveWidget = gtk_check_button_new_with_label("Keep telemetry archive");
+    gtk_widget_show(archiveWidget);
+    gtk_table_attach(GTK_TABLE(table2), archiveWidget, 0, 2, 6, 7,
+                    (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
+                    (GtkAttachOptions)(0), 0, 0);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(archiveWidget), config -> archive);
+
+    hookWidget = gtk_entry_new_with_max_length(MAX_HOOKCMD - 1);
+    gtk_widget_show(hookWidget);
+    gtk_table_attach(GTK_TABLE(table2), hookWidget, 0, 1, 7, 8,
+                    (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
+                    (GtkAttachOptions)(0), 0, 0);
+    gtk_entry_set_text(GTK_ENTRY(hookWidget), config -> hook);
+
+    hookLabel = gtk_label_new("Status hook command (see info page)");
+    gtk_widget_show(hookLabel);
+    gtk_table_attach(GTK_TABLE(table2), hookLabel, 1, 2, 7, 8,
+                    (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
+                    (GtkAttachOptions)(0), 0, 0);
+    gtk_label_set_justify(GTK_LABEL(hookLabel), GTK_JUSTIFY_LEFT);
+    gtk_misc_set_alignment(GTK_MISC(hookLabel), 0, 0.5);
+
+    /* Diagnostics tab, refreshed by updatePlugin() until the window closes */
+    frame = gtk_frame_new(NULL);
+    gtk_container_border_width(GTK_CONTAINER(frame), 3);
+    gtk_widget_show(frame);
+    diagLabel = gtk_label_new("");
+    gtk_label_set_justify(GTK_LABEL(diagLabel), GTK_JUSTIFY_LEFT);
+    gtk_misc_set_alignment(GTK_MISC(diagLabel), 0, 0);
+    gtk_signal_connect(GTK_OBJECT(diagLabel), "destroy", GTK_SIGNAL_FUNC(gtk_widget_destroyed), &diagLabel);
+    gtk_widget_show(diagLabel);
+    gtk_container_add(GTK_CONTAINER(frame), diagLabel);
+    label = gtk_label_new("Diagnostics");
+    gtk_notebook_append_page(GTK_NOTEBOOK(note), frame, label);
+    updateDiagnostics();
+
     /* Help Tab */
     frame = gtk_frame_new(NULL);
     gtk_container_border_width(GTK_CONTAINER(frame), 3);
@@ -864,6 +1875,10 @@ static void createTab(GtkWidget *tab)
     text = gtk_text_new(NULL, NULL);
 
     gkrellm_add_info_text(text, helpText, sizeof(helpText)/sizeof(gchar*));
+    addFormatHelp(text, "Voltage chart", voltVars);
+    addFormatHelp(text, "Frequency chart", freqVars);
+    addFormatHelp(text, "Stats chart", tempVars);
+    gkrellm_add_info_text(text, helpTail, sizeof(helpTail)/sizeof(gchar*));
     gtk_text_set_editable(GTK_TEXT(text), FALSE);
     gtk_container_add(GTK_CONTAINER(infoWindow), text);
 
@@ -877,6 +1892,18 @@ static void createTab(GtkWidget *tab)
 
 }
 
+/** Set up one of the chart types shared by the UPS displays. */
+static void initChartType(BUPSChartType *type, gchar *name, gchar *label, const gint *dataVars, gchar *format,
+                          const BUPSFormatVar *vars, gint fixed)
+{
+    type -> name       = name;
+    type -> fixed      = fixed;
+    type -> label      = label;
+    type -> dataVars   = dataVars;
+    type -> vars       = vars;
+    setChartFormat(type, format);
+}
+
 /** Create and initialise the config structure to default values.
  *  <insert Interesting And Informtive Comment here>
  */
@@ -887,9 +1914,13 @@ static void createDefaultConfig(void)
 
     /* set default configuration */
     strcpy(config -> host, DEFAULT_HOST);
-    config -> port    = DEFAULT_PORT;
-    config -> showLog = FALSE;
-    config -> mains   = MAINS_MIN;
+    config -> port     = DEFAULT_PORT;
+    config -> protocol = PROTOCOL_LIST;
+    config -> poll.lineInterval    = DEFAULT_POLL_LINE;
+    config -> poll.batteryInterval = DEFAULT_POLL_BATTERY;
+    config -> poll.alertInterval   = DEFAULT_POLL_ALERT;
+    config -> showLog  = FALSE;
+    config -> archive  = TRUE;
 }
 
 /** GKrellM Monitor structure for this plugin. 
@@ -918,11 +1949,17 @@ static Monitor bups_mon =
 };
 
 /** Plugin initialisation function. 
+ *  GKrellM has no call for plugins on the way out, so the archive is
+ *  stopped from atexit() to get its summaries in progress onto disk.
  */
 Monitor *init_plugin(void)
 {
     bupsData = g_new0(GKrellMBUPS, 1);
+    initChartType(&bupsData -> voltType, "volt", "Voltages", voltData, DEFAULT_VFORMAT, voltVars, VOLT_FIXED);
+    initChartType(&bupsData -> freqType, "freq", "Freq"    , freqData, DEFAULT_FFORMAT, freqVars, FREQ_FIXED);
+    initChartType(&bupsData -> tempType, "temp", "Stats"   , tempData, DEFAULT_TFORMAT, tempVars, STATS_FIXED);
     createDefaultConfig();
+    atexit(stopArchive);
 
 	style_id = gkrellm_add_chart_style(&bups_mon, STYLE_NAME);
 	mon = &bups_mon;
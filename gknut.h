@@ -58,51 +58,152 @@
 #define INSERT_BEFORE           MON_FS         /*!< Insert plugin before this monitor. */
 
 #define	MIN_GRID_RES            1              /*!< Constrain grid resolution, lower end. */ 
-#define	MAX_GRID_RES            40             /*!< Constrain grid resolution, upper end. */              
+#define	MAX_GRID_RES            400            /*!< Constrain grid resolution, upper end (charts are in fixed point). */
 
 #define MAX_DATA                3              /*!< Maximum number of chartdata entries per chart */
 
-/*! Value to subtract from input and output mains voltages.
- *  Mains voltages are typically 220 to 240 in the UK, this presented some problems with
- *  fitting any sort of meaningful data on the chart - either the chart is prohibitively
- *  large or any difference between the signals is swamped by the scale. Subtracting 
- *  MAINS_MIN from the values before display ensures that both signals will fit on the 
- *  display without significant loss of detail on a 40/50 pixel high monitor.
- *  \note MAINS_MIN should be approximately the same as the UPS low voltage transfer
- *  value (187 on a UK Belkin UPS)
+/*! \name Fixed point scale of each chart type
+ *  Chart units per unit of the readings, so that tenths of a volt (and
+ *  hundredths of a hertz) still move the chart lines.
  */
-#ifndef MAINS_MIN
-#define MAINS_MIN               190           
-#endif
+/*@{*/
+#define VOLT_FIXED              10
+#define FREQ_FIXED              100
+#define STATS_FIXED             10
+/*@}*/
+
+/*! Whole units the lowest value of a chart line may rise above its base before the line is rebased.
+ *  Stops the chart being stored again every time the lowest value scrolls off it.
+ */
+#define RANGE_SLACK             2
 
 #define DEFAULT_HOST            "localhost"   /*!< address of the computer on which upsd is running */
-#define DEFAULT_PORT            3305          /*!< port upsd is accepting connections on            */
+#define DEFAULT_PORT            3493          /*!< port upsd is accepting connections on (IANA nut) */
+#define DEFAULT_POLL_LINE       2000          /*!< ms between polls while every UPS is online       */
+#define DEFAULT_POLL_BATTERY    500           /*!< ms between polls while a UPS is on battery       */
+#define DEFAULT_POLL_ALERT      250           /*!< ms between polls while a UPS is low on battery   */
+
+#define HISTORY_DIR             ".gkrellm/gknut" /*!< Home relative directory of the chart history ring files */
+#define ARCHIVE_DIR             ".gkrellm/gknut/archive" /*!< Home relative directory of the telemetry archive */
+
+#define BUS_CHECK_INTERVAL      10            /*!< seconds between checks for a collector on the snapshot bus coming or going */
 
 #define DEFAULT_CHARTHEIGHT     40            /*!< 40 is probably a good trade between detail and screen use */  
 
+/*! Kinds of chart text format operation. */
+enum
+{
+    FORMAT_LITERAL, /*!< Copy text from the format.                  */
+    FORMAT_FLOAT,   /*!< Print a gfloat field of the UPS status.     */
+    FORMAT_MSEC,    /*!< Print a microsecond field in milliseconds.  */
+    FORMAT_FLAGS,   /*!< Print the UPS status flags.                 */
+    FORMAT_COUNT,   /*!< Print a guint32 counter of the UPS status.  */
+    FORMAT_RTT50,   /*!< Print the median upsd round trip (ms).      */
+    FORMAT_RTT99,   /*!< Print the 99th percentile round trip (ms).  */
+    FORMAT_READING, /*!< A reading from upsVars, compiled to FORMAT_FLOAT. */
+    FORMAT_STAT     /*!< A rolling statistic of a reading, see compileFormat(). */
+};
+
+/*! A "$" substitution variable available in the text format of a chart type. */
+typedef struct
+{
+    gchar        code;   /*!< Character following the "$".                      */
+    gint         kind;   /*!< Any of the FORMAT_* kinds except FORMAT_LITERAL.  */
+    gint         offset; /*!< Offset of the value in struct UPSData, or the VAR_* of a FORMAT_READING. */
+    const gchar *print;  /*!< printf format used for the value (from upsVars for a FORMAT_READING). */
+    const gchar *help;   /*!< Description for the help text (likewise).        */
+} BUPSFormatVar;
+
+/*! A single operation of a compiled text format. */
+typedef struct
+{
+    gint         kind;   /*!< One of the FORMAT_* kinds.                        */
+    gint         offset; /*!< Literal: offset in BUPSFormat.text, reading: its VAR_*, else as var. */
+    gint         len;    /*!< Literal: number of characters to copy.            */
+    const gchar *print;  /*!< printf format used for the value.                 */
+    gint         window; /*!< Statistic: STATS_* window, offset is the VAR_*.   */
+    gint         stat;   /*!< Statistic: which STAT_* to print.                 */
+} BUPSFormatOp;
+
+/*! A chart text format compiled by compileFormat(), ready for renderFormat(). */
+typedef struct
+{
+    BUPSFormatOp *ops;     /*!< Operations, executed in order.                   */
+    gint          opCount; /*!< Number of entries in ops.                        */
+    gchar        *text;    /*!< Literal text, referred to by FORMAT_LITERAL ops. */
+    guint32       readings;/*!< VAR_* bits of the readings the format shows.     */
+    guint32       stats;   /*!< VAR_* bits of the readings it shows statistics of. */
+} BUPSFormat;
+
+/*! Settings shared by every chart of one type.
+ *  Each UPS has a voltage, frequency and stats chart, the text overlay 
+ *  settings and formatting of each type of chart are the same for all UPSes
+ *  so they live here rather than in the individual BUPSChart structures.
+ */
+typedef struct
+{
+    gchar       *name;           /*!< Name used for the chart configuration lines.               */
+    gchar       *label;          /*!< Text to display in the panel below the chart.              */
+    const gint  *dataVars;       /*!< VAR_* reading shown by each chartdata, terminated by -1.   */
+    gboolean     showText;       /*!< True if the chart text overlay should be drawn.            */
+    char        *textFormat;     /*!< Text overlay format for this type of chart.                */
+    const BUPSFormatVar *vars;   /*!< Substitution variables, terminated by a zero code.         */
+    gint         fixed;          /*!< Chart units per unit of the readings, see VOLT_FIXED.      */
+    BUPSFormat   compiled;       /*!< textFormat compiled against vars.                          */
+} BUPSChartType;
+
+/*! One chart column: the mean, lowest and highest reading of each chartdata
+ *  over the second. The readings are kept as they are, so the column can
+ *  be stored again whenever the range of the chart moves.
+ */
+typedef struct
+{
+    gfloat mean[MAX_DATA]; /*!< Mean of each chartdata, the line itself. */
+    gfloat low[MAX_DATA];  /*!< Lowest value of each chartdata.          */
+    gfloat high[MAX_DATA]; /*!< Highest value of each chartdata.         */
+} BUPSColumn;
+
+/*! Range of one chart line.
+ *  The lowest value over the chart width comes from a monotonic deque of
+ *  column numbers whose lows increase from head to tail: a new column first
+ *  pushes out the entries at the tail with lows no lower than its own, and
+ *  the head leaves once its column scrolls off the chart, so each column
+ *  costs O(1) amortised. Values are stored in fixed point above base, the
+ *  top of the chart is left to the GKrellM grid scaling.
+ */
+typedef struct
+{
+    guint *queue; /*!< Column numbers, a ring of BUPSChart.columnCount entries. */
+    guint  head;  /*!< Oldest entry, counting up (index modulo the ring size).  */
+    guint  tail;  /*!< One past the newest entry.                               */
+    gint   base;  /*!< Whole units subtracted from the line, see RANGE_SLACK.   */
+} BUPSRange;
+
 /*! Structure containing data related to a single chart object.
  *  This structure contains pointers to the various elements which together form
  *  a single chart in the GKrellM window (chart, config, panel etc).
  */
 typedef struct
 {
-    GtkWidget   *vbox;           /*!< Box into which the Chart and then Panel are added. */
-    Chart       *chart;          /*!< The chart contained in vbox. */
-    ChartData   *data[MAX_DATA]; /*!< The data shown in the chart. */
-    ChartConfig *config;         /*!< Settings structure for the chart. */
-    Style       *style;          /*!< chart and panel style. */
-    Panel       *panel;          /*!< The panel shown beneath the chart, this is just a label really. */
-    gboolean     showText;       /*!< True if the chart text overlay should be drawn. */
-    char        *textFormat;     /*!< Text overlay format for this chart. */
-    void       (*format)(gchar *, gint, gchar *); /*!< Text formatting function */
+    GtkWidget     *vbox;           /*!< Box into which the Chart and then Panel are added. */
+    Chart         *chart;          /*!< The chart contained in vbox. */
+    ChartData     *data[MAX_DATA]; /*!< The data shown in the chart. */
+    ChartConfig   *config;         /*!< Settings structure for the chart. */
+    Style         *style;          /*!< chart and panel style. */
+    Panel         *panel;          /*!< The panel shown beneath the chart, this is just a label really. */
+    BUPSChartType *type;           /*!< Settings shared with the other charts of the same type. */
+    gint           ups;            /*!< Index of the UPS whose status is shown (for readStatus()). */
+    BUPSColumn    *columns;        /*!< Readings of each column, a ring in step with the chartdata. */
+    guint          columnCount;    /*!< Number of entries in columns, the chart width.             */
+    guint          columnSeq;      /*!< Columns stored so far, the next goes in columnSeq % columnCount. */
+    gint           spread;         /*!< Number of columns with an envelope to draw.                 */
+    BUPSRange      range[MAX_DATA];/*!< Range of each chartdata.                                     */
 } BUPSChart;
 
-/*! Central data store structure.
- *  This contains pointers to all the UPSChart structures and various gkrellm 
- *  objects used by the plugin.
- */
+/*! The charts and log panel for a single UPS. */
 typedef struct
 {
+    GtkWidget *vbox;        /*!< Box holding everything for this UPS.                        */
     BUPSChart  voltChart;   /*!< Input and output and battery voltage display.               */
     BUPSChart  freqChart;   /*!< Input and output frequency chart.                           */
     BUPSChart  tempChart;   /*!< Temperature and load chart (fixed max is 100).              */
@@ -114,12 +215,31 @@ typedef struct
     gint       logScr;      /*!< Horizontal scroll                                           */
     Decal     *labelDecal;  /*!< Decal used on logDisplay.                                   */
     gint       labelX;      /*!< Horizontal position of the label                            */
-    GtkWidget *vbox;
-    pthread_t  client;      
+    gint       ups;         /*!< Index of the UPS, for readStatus().                         */
+    SampleRing *history;    /*!< Recent chart samples, kept across restarts (may be NULL).   */
+    RollingStats *stats;    /*!< Rolling statistics of the readings the chart texts ask for. */
+    guint      archived;    /*!< ups_Sequence of the last bus snapshot archived, see archiveBusStatus(). */
+} BUPSDisplay;
+
+/*! Central data store structure.
+ *  This contains the displays for every UPS along with the settings shared
+ *  between them and various gkrellm objects used by the plugin.
+ */
+typedef struct
+{
+    BUPSDisplay   ups[MAX_UPS]; /*!< Charts and panels for each UPS.                     */
+    gint          upsCount;     /*!< Number of entries in ups which have been created.   */
+    BUPSChartType voltType;     /*!< Settings for the voltage charts.                    */
+    BUPSChartType freqType;     /*!< Settings for the frequency charts.                  */
+    BUPSChartType tempType;     /*!< Settings for the stats charts.                      */
+    GtkWidget    *vbox;
+    UPSClient    *client;       /*!< Our own client polling every UPS, or NULL.          */
+    SnapshotBus  *bus;          /*!< Snapshot bus of a local collector in use, or NULL.  */
+    gint          busCheck;     /*!< Seconds since the snapshot bus was last checked.    */
 } GKrellMBUPS;
 
-/*! Maximum length of the hostname string the user can specify (plus one for the terminator) */
-#define MAX_HOSTNAME 257
+/*! Maximum length of the UPS list the user can specify (plus one for the terminator) */
+#define MAX_UPSLIST 1025
 
 #define DEFAULT_VFORMAT "i:\\f$i,\\.o:\\f$o,\\nb:\\f$l%" 
 #define DEFAULT_FFORMAT "i:\\f$i\\no:\\f$o" 
@@ -130,12 +250,15 @@ typedef struct
  */
 typedef struct
 {
-    gchar        host[MAX_HOSTNAME]; /*!< Hostname on which the upsd service is running (default is localhost).     */
-    gint         port;               /*!< Port on which the upsd server is accepting connections (2710 is default). */
+    gchar        host[MAX_UPSLIST];  /*!< UPSes to monitor, [upsname@]hostname[:port] each (default is localhost). */
+    gint         port;               /*!< Port used for UPSes which do not specify one (3493 is default).          */
+    gint         protocol;           /*!< PROTOCOL_LIST, or PROTOCOL_LEGACY for upsd before 2.0.                    */
+    PollPolicy   poll;               /*!< Poll intervals for each UPS state.                                        */
     gboolean     showLog;            /*!< FALSE to show label, TRUE to show log.                                    */
-    gint         mains;              /*!< Utility low battery transfer voltage or similar.                          */ 
+    gboolean     archive;            /*!< TRUE to keep every poll in the telemetry archive.                         */
+    gchar        hook[MAX_HOOKCMD];  /*!< Command run on every status change of a UPS, empty for none.             */
 } BUPSConfig;
 
-#define CONFIG_BUFSIZE 256          /*!< Size of the buffers used for storing configuration data in loadConfig().  */
+#define CONFIG_BUFSIZE (MAX_UPSLIST + 64) /*!< Size of the buffers used for storing configuration data in loadConfig(). */
 
 #endif /* _GKRELLMBUPS_H */
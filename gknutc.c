@@ -0,0 +1,337 @@
+/**
+ *  \file gknutc.c
+ *  Command line collector.
+ *  Runs the same client as the plugin, without GKrellM or GTK, and prints
+ *  the status of each UPS on standard output, one line per snapshot. By
+ *  default every UPS is polled once and the collector exits, -f keeps it
+ *  running and streams every poll (and connection state change) as it
+ *  happens, which makes it handy on servers without X and for timing the
+ *  polling engine on its own. With -s it also publishes every status on the
+ *  shared memory snapshot bus (see snapshot_bus.c) until it is interrupted,
+ *  so all the plugins on the machine can share its upsd session. With -m it
+ *  serves every status as OpenMetrics over HTTP (see metrics_export.c) until
+ *  it is interrupted, for Prometheus style scrapers. With -x it runs a
+ *  command for every change in the status of a UPS (see status_hook.c),
+ *  whichever way it is running. -r limits the readings fetched (and printed)
+ *  to the NUT variables given, which is all some links and servers can bear.
+ *
+ *  Usage: gknutc [-l] [-f] [-s] [-m [address:]port] [-x command] [-r var,...] [-p port] [-c count] [-t seconds] [-i ms] [-b ms] [-a ms] ups...
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<time.h>
+#include<signal.h>
+#include<pthread.h>
+#include"nut_connect.h"
+#include"snapshot_bus.h"
+#include"metrics_export.h"
+#include"status_hook.h"
+
+#define DEFAULT_PORT     3493  /*!< port upsd is accepting connections on (IANA nut)  */
+#define DEFAULT_TIMEOUT  10    /*!< seconds to wait for a single poll of every UPS   */
+
+static const gchar usage[] =
+    "Usage: gknutc [options] [upsname@]hostname[:port] ...\n"
+    "  -l          use the legacy REQ protocol (upsd before 2.0)\n"
+    "  -f          keep polling and print every snapshot\n"
+    "  -s          publish on the snapshot bus until interrupted\n"
+    "  -m [address:]port\n"
+    "              serve OpenMetrics over HTTP until interrupted (default address " METRICS_DEFAULT_ADDRESS ")\n"
+    "  -x command  run command for each status change of a UPS\n"
+    "  -r var,...  only fetch these readings, e.g. input.voltage,battery.charge\n"
+    "  -c count    with -f, stop after count polls of every UPS\n"
+    "  -t seconds  give up after this long (default 10 without -f)\n"
+    "  -p port     port for UPSes which do not give one (default 3493)\n"
+    "  -i ms       poll interval while online (default 2000)\n"
+    "  -b ms       poll interval while on battery (default 500)\n"
+    "  -a ms       poll interval while low on battery (default 250)\n";
+
+static pthread_mutex_t doneLock = PTHREAD_MUTEX_INITIALIZER; /*!< Protects the fields below.          */
+static pthread_cond_t  doneCond = PTHREAD_COND_INITIALIZER;  /*!< Signalled as each UPS finishes.     */
+static gint            polls[MAX_UPS];                       /*!< Polls printed for each UPS.         */
+static gint            present[MAX_UPS];                     /*!< TRUE if the last poll found the UPS. */
+static gint            finished = 0;                         /*!< Number of UPSes which are done.     */
+static gint            follow   = FALSE;                     /*!< TRUE to stream snapshots (-f).      */
+static gint            maxPolls = 0;                         /*!< Polls wanted per UPS, 0 for no limit. */
+static gint            serve    = FALSE;                     /*!< TRUE to run until interrupted (-s or -m). */
+static SnapshotBus    *bus      = NULL;                      /*!< Snapshot bus, set once created (-s). */
+static MetricsExporter *metrics = NULL;                      /*!< Metrics exporter, set once started (-m). */
+
+/** Format one reading of a snapshot for printStatus(), "-" if it was not fetched.
+ *
+ *  \par Arguments:
+ *  \arg \c text - buffer for the reading.
+ *  \arg \c status - the snapshot.
+ *  \arg \c var - VAR_* of the reading.
+ *  \arg \c format - printf format of the value, with its unit.
+ */
+static const gchar *readingText(gchar *text, const struct UPSData *status, gint var, const gchar *format)
+{
+    if(!(status -> ups_Fetched & (1 << var))) return "-";
+
+    g_snprintf(text, 16, format, *(const gfloat *)((const gchar *)status + upsVars[var].offset));
+    return text;
+}
+
+/** Print a single snapshot.
+ *  Times are local wall clock times, to the millisecond.
+ */
+static void printStatus(const struct UPSData *status, gboolean polled)
+{
+    struct timespec now;
+    struct tm       when;
+    gchar           stamp[32];
+    gchar           flags[128];
+    gchar           text[8][16];
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &when);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &when);
+
+    if(polled && status -> ups_Present) {
+        statusText(flags, sizeof(flags), status -> ups_Status, TRUE);
+        printf("%s.%03ld %s %s in=%s/%s out=%s/%s batt=%s/%s load=%s temp=%s poll=%.2fms status=\"%s\"\n",
+               stamp, now.tv_nsec / 1000000, status -> ups_Name, connStateText(status -> ups_ConnState),
+               readingText(text[0], status, VAR_IN_VOLTAGE, "%.1fV"), readingText(text[1], status, VAR_IN_FREQ, "%.2fHz"),
+               readingText(text[2], status, VAR_OUT_VOLTAGE, "%.1fV"), readingText(text[3], status, VAR_OUT_FREQ, "%.2fHz"),
+               readingText(text[4], status, VAR_BAT_LEVEL, "%.1f%%"), readingText(text[5], status, VAR_BAT_VOLTAGE, "%.2fV"),
+               readingText(text[6], status, VAR_UPS_LOAD, "%.1f%%"), readingText(text[7], status, VAR_UPS_TEMP, "%.1fC"),
+               status -> ups_PollTime / 1000.0, flags);
+    } else {
+        printf("%s.%03ld %s %s \"%s\"\n", stamp, now.tv_nsec / 1000000, status -> ups_Name,
+               connStateText(status -> ups_ConnState), status -> ups_LastLog);
+    }
+    fflush(stdout);
+}
+
+/** Snapshot callback, runs on the client thread.
+ *  Without -f only the first outcome for each UPS is printed: a complete
+ *  poll, or a failed connection. With -f everything is printed and only
+ *  polls count towards -c. With -s everything is published on the bus, and
+ *  with -m handed to the metrics exporter.
+ */
+static void snapshotNotify(gint ups, const struct UPSData *status, gboolean polled, gpointer data)
+{
+    SnapshotBus     *target   = __atomic_load_n(&bus, __ATOMIC_ACQUIRE);
+    MetricsExporter *exporter = __atomic_load_n(&metrics, __ATOMIC_ACQUIRE);
+    gboolean         failed   = (status -> ups_ConnState == CONN_BACKOFF) || (status -> ups_ConnState == CONN_FAILED);
+    gboolean         done;
+
+    if(target) busPublish(target, ups, status);
+    if(exporter) exporterPublish(exporter, ups, status);
+    if(serve && !follow) return;
+
+    pthread_mutex_lock(&doneLock);
+    if(!follow && (polls[ups] || !(polled || failed))) {
+        pthread_mutex_unlock(&doneLock);
+        return;
+    }
+
+    printStatus(status, polled);
+    if(polled || !follow) {
+        polls[ups]++;
+        present[ups] = polled && status -> ups_Present;
+    }
+
+    done = follow ? (maxPolls && (polls[ups] == maxPolls) && polled) : TRUE;
+    if(done) {
+        finished++;
+        pthread_cond_signal(&doneCond);
+    }
+    pthread_mutex_unlock(&doneLock);
+}
+
+/** Transition callback, runs on the client thread.
+ *  Hands the status change to the hook worker (-x), which never blocks,
+ *  and with -s adds it to the bus for the plugins to run their own hooks.
+ */
+static void transitionNotify(gint ups, const gchar *name, guint previous, guint status, gint64 detected, gpointer data)
+{
+    SnapshotBus *target = __atomic_load_n(&bus, __ATOMIC_ACQUIRE);
+
+    if(target) busPublishTransition(target, ups, previous, status, detected);
+    hookTransition(name, previous, status, detected);
+}
+
+/** Parse a numeric option, exiting with the usage text if it is not a positive number. */
+static gint numberArg(const gchar *arg)
+{
+    gchar *end;
+    glong  value = strtol(arg, &end, 10);
+
+    if((*end != '\0') || (value <= 0)) {
+        fputs(usage, stderr);
+        exit(2);
+    }
+    return (gint)value;
+}
+
+/** Turn the -r argument, a comma separated list of NUT variable names, into a mask of VAR_* bits. */
+static guint32 readingsArg(const gchar *arg)
+{
+    gchar  **names = g_strsplit(arg, ",", 0);
+    guint32  vars  = 0;
+    gint     index;
+    gint     var;
+
+    for(index = 0; names[index]; index++) {
+        for(var = 0; (var < VAR_COUNT) && strcmp(names[index], upsVars[var].name); var++);
+        if(var == VAR_COUNT) {
+            fprintf(stderr, "gknutc: unknown reading %s\n", names[index]);
+            exit(2);
+        }
+        vars |= 1 << var;
+    }
+    g_strfreev(names);
+    return vars;
+}
+
+/** Split the -m argument into an address (NULL if none was given) and a port.
+ *  An IPv6 address must be given in square brackets, as in [::1]:9199.
+ */
+static gchar *listenArg(const gchar *arg, gint *port)
+{
+    const gchar *colon = strrchr(arg, ':');
+    gchar       *address;
+
+    if(colon == NULL) {
+        *port = numberArg(arg);
+        return NULL;
+    }
+    *port = numberArg(colon + 1);
+
+    if((arg[0] == '[') && (colon > arg + 1) && (colon[-1] == ']')) return g_strndup(arg + 1, colon - arg - 2);
+    address = g_strndup(arg, colon - arg);
+    if((address[0] == '\0') || strchr(address, ':')) {
+        fputs(usage, stderr);
+        exit(2);
+    }
+    return address;
+}
+
+int main(int argc, char *argv[])
+{
+    struct timespec deadline;
+    sigset_t        signals;
+    PollPolicy      policy   = { 2000, 500, 250 };
+    const gchar    *names[MAX_UPS];
+    SnapshotBus    *created  = NULL;
+    MetricsExporter *started = NULL;
+    UPSClient      *client;
+    gchar          *list;
+    gchar          *metricsAddress = NULL;
+    gchar          *hook     = NULL;
+    gint            metricsPort    = 0;
+    gint            protocol = PROTOCOL_LIST;
+    gint            port     = DEFAULT_PORT;
+    gint            timeout  = 0;
+    gint            publish  = FALSE;
+    guint32         readings = VAR_ALL;
+    gint            count;
+    gint            result   = 0;
+    gint            index;
+    int             opt;
+
+    while((opt = getopt(argc, argv, "lfsm:x:r:c:t:p:i:b:a:")) != -1) {
+        switch(opt) {
+            case 'l': protocol = PROTOCOL_LEGACY;                  break;
+            case 'f': follow   = TRUE;                             break;
+            case 's': publish  = serve = TRUE;                     break;
+            case 'm': metricsAddress = listenArg(optarg, &metricsPort); serve = TRUE; break;
+            case 'x': hook     = optarg;                           break;
+            case 'r': readings = readingsArg(optarg);              break;
+            case 'c': maxPolls = numberArg(optarg);                break;
+            case 't': timeout  = numberArg(optarg);                break;
+            case 'p': port     = numberArg(optarg);                break;
+            case 'i': policy.lineInterval    = numberArg(optarg); break;
+            case 'b': policy.batteryInterval = numberArg(optarg); break;
+            case 'a': policy.alertInterval   = numberArg(optarg); break;
+            default:
+                fputs(usage, stderr);
+                return 2;
+        }
+    }
+    if(optind == argc) {
+        fputs(usage, stderr);
+        return 2;
+    }
+    if(!follow && !timeout) timeout = DEFAULT_TIMEOUT;
+
+    /* The serving client is stopped by a signal, which must go to sigwait() below */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    if(serve) pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if(hook && (hook[0] != '\0') && !startHooks(hook)) {
+        fprintf(stderr, "gknutc: unable to start the hook worker\n");
+        return 1;
+    }
+
+    list   = g_strjoinv(" ", argv + optind);
+    client = launchClient(list, port, protocol, &policy, snapshotNotify, transitionNotify, NULL);
+    g_free(list);
+
+    if(client == NULL) {
+        fprintf(stderr, "gknutc: unable to start the client\n");
+        stopHooks();
+        return 1;
+    }
+
+    if((count = clientUPSCount(client)) == 0) {
+        fprintf(stderr, "gknutc: no usable UPS specification given\n");
+        haltClient(client);
+        stopHooks();
+        return 2;
+    }
+    for(index = 0; index < count; index++) setWantedVars(client, index, readings);
+
+    if(serve) {
+        for(index = 0; index < count; index++) names[index] = readStatus(client, index) -> ups_Name;
+        if(publish && ((created = createBus(names, count)) == NULL)) {
+            fprintf(stderr, "gknutc: unable to create the snapshot bus (is another collector running?)\n");
+            result = 1;
+        } else if(metricsPort && ((started = startExporter(metricsAddress, metricsPort, names, count)) == NULL)) {
+            fprintf(stderr, "gknutc: unable to serve metrics on port %d\n", metricsPort);
+            result = 1;
+        } else {
+            __atomic_store_n(&bus, created, __ATOMIC_RELEASE);
+            __atomic_store_n(&metrics, started, __ATOMIC_RELEASE);
+            sigwait(&signals, &opt);
+        }
+
+        haltClient(client);
+        stopHooks();
+        stopExporter(started);
+        closeBus(created);
+        g_free(metricsAddress);
+        return result;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    /* Wait for every UPS to finish, for the timeout or (with -f and no -c) forever */
+    pthread_mutex_lock(&doneLock);
+    while((finished < count) && (!follow || maxPolls || timeout)) {
+        if(!timeout) {
+            pthread_cond_wait(&doneCond, &doneLock);
+        } else if(pthread_cond_timedwait(&doneCond, &doneLock, &deadline)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&doneLock);
+    while(follow && !maxPolls && !timeout) pause();
+
+    haltClient(client);
+    stopHooks();
+
+    for(index = 0; index < count; index++) {
+        if(!polls[index] || !present[index]) result = 1;
+    }
+    return result;
+}
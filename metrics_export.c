@@ -0,0 +1,513 @@
+/**
+ *  \file metrics_export.c
+ *  OpenMetrics exporter.
+ *  Monitoring systems which scrape Prometheus endpoints would otherwise need
+ *  an exporter of their own, with its own upsd session. Instead a collector
+ *  (gknutc -m) can serve the status of every UPS it polls, and the health of
+ *  its polling, in the OpenMetrics text format on a local HTTP port.
+ *
+ *  Every scrape is rendered from the statuses the client last published, so
+ *  however many scrapers there are and however often they call, upsd sees no
+ *  extra traffic. The exporter runs its own thread with a poll() loop over
+ *  the listening socket and the scraper connections, all non-blocking, and
+ *  only shares a short lived copy of each status with the client thread.
+ *
+ *  Only as much HTTP as scrapers need is spoken: GET (or HEAD) of /metrics
+ *  or /, one request per connection, which is closed once the reply is sent.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stddef.h>
+#include<stdarg.h>
+#include<errno.h>
+#include<time.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netdb.h>
+#include"metrics_export.h"
+
+/*! Content type of the OpenMetrics text format */
+static const gchar contentType[] = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+/*! Poll health counters, each a guint32 in PollHealth */
+static const struct
+{
+    const gchar *name;   /*!< Metric family name (samples get "_total"). */
+    const gchar *help;   /*!< Description of the metric.                 */
+    gint         offset; /*!< Offset of the value in PollHealth.         */
+} counters[] =
+{
+    { "nut_request_timeouts", "upsd requests which timed out, dropping the connection.",    offsetof(PollHealth, timeouts)    },
+    { "nut_reconnects",       "Connections to upsd made after the first one.",              offsetof(PollHealth, reconnects)  },
+    { "nut_parse_errors",     "upsd reply lines which could not be parsed.",                offsetof(PollHealth, parseErrors) },
+    { "nut_stale_replies",    "ERR DATA-STALE replies, the UPS driver has stopped updating.", offsetof(PollHealth, staleData) },
+    { NULL,                   NULL,                                                         0                                 }
+};
+
+/** Current value of the monotonic clock in milliseconds. */
+static gint64 monotonicMsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (gint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/** Append formatted text to a buffer, returning the new length.
+ *  The length never goes past size - 1, so once the buffer is full further
+ *  text is simply dropped.
+ */
+static gint append(gchar *buffer, gint size, gint len, const gchar *format, ...)
+{
+    va_list args;
+
+    if(len >= size - 1) return len;
+
+    va_start(args, format);
+    len += g_vsnprintf(buffer + len, size - len, format, args);
+    va_end(args);
+    return MIN(len, size - 1);
+}
+
+/** Escape a UPS name for use as an OpenMetrics label value. */
+static void escapeLabel(gchar *dest, gint size, const gchar *name)
+{
+    gint len = 0;
+
+    for(; *name && (len < size - 2); name++) {
+        if((*name == '\\') || (*name == '"')) {
+            dest[len++] = '\\';
+            dest[len++] = *name;
+        } else if(*name == '\n') {
+            dest[len++] = '\\';
+            dest[len++] = 'n';
+        } else {
+            dest[len++] = *name;
+        }
+    }
+    dest[len] = '\0';
+}
+
+/** Render the metrics of every UPS into the body buffer.
+ *  Samples are grouped by metric family, as OpenMetrics requires. Readings
+ *  are left out while a UPS is not present, rather than exporting the zeros
+ *  of a UPS which could not be polled. The poll health counters belong to a
+ *  connection, so UPSes on the same upsd server report the same values.
+ *
+ *  \return The length of the body.
+ */
+static gint renderMetrics(MetricsExporter *exporter)
+{
+    struct UPSData *status;
+    gchar *body  = exporter -> body;
+    gint   size  = exporter -> bodySize;
+    gint   count = exporter -> upsCount;
+    gint   len   = 0;
+    gint   index;
+    gint   item;
+    gchar  token[16];
+    guint  flag;
+    guint32 seen;
+
+    pthread_mutex_lock(&exporter -> lock);
+    memcpy(exporter -> copy, exporter -> status, count * sizeof(struct UPSData));
+    pthread_mutex_unlock(&exporter -> lock);
+
+    len = append(body, size, len, "# TYPE nut_ups_present gauge\n"
+                                  "# HELP nut_ups_present Whether upsd reported the UPS in the last poll.\n");
+    for(index = 0; index < count; index++) {
+        len = append(body, size, len, "nut_ups_present{ups=\"%s\"} %d\n", exporter -> labels[index],
+                     exporter -> copy[index].ups_Present ? 1 : 0);
+    }
+
+    len = append(body, size, len, "# TYPE nut_connection_state stateset\n"
+                                  "# HELP nut_connection_state State of the connection to the upsd server.\n");
+    for(index = 0; index < count; index++) {
+        for(item = CONN_RESOLVING; item <= CONN_FAILED; item++) {
+            len = append(body, size, len, "nut_connection_state{ups=\"%s\",nut_connection_state=\"%s\"} %d\n",
+                         exporter -> labels[index], connStateText(item), exporter -> copy[index].ups_ConnState == item);
+        }
+    }
+
+    len = append(body, size, len, "# TYPE nut_ups_status stateset\n"
+                                  "# HELP nut_ups_status Status flags reported by the UPS.\n");
+    for(index = 0; index < count; index++) {
+        for(flag = UPS_OFF; flag <= UPS_FSD; flag <<= 1) {
+            statusText(token, sizeof(token), flag, TRUE);
+            len = append(body, size, len, "nut_ups_status{ups=\"%s\",nut_ups_status=\"%s\"} %d\n",
+                         exporter -> labels[index], token, (exporter -> copy[index].ups_Status & flag) ? 1 : 0);
+        }
+    }
+
+    for(item = 0; item < VAR_COUNT; item++) {
+        len = append(body, size, len, "# TYPE %s gauge\n", upsVars[item].metric);
+        if(upsVars[item].unit) len = append(body, size, len, "# UNIT %s %s\n", upsVars[item].metric, upsVars[item].unit);
+        len = append(body, size, len, "# HELP %s %s.\n", upsVars[item].metric, upsVars[item].help);
+        for(index = 0; index < count; index++) {
+            status = &exporter -> copy[index];
+            if(!status -> ups_Present || !(status -> ups_Fetched & (1 << item))) continue;
+            len = append(body, size, len, "%s{ups=\"%s\"} %g\n", upsVars[item].metric, exporter -> labels[index],
+                         *(gfloat *)((gchar *)status + upsVars[item].offset));
+        }
+    }
+
+    len = append(body, size, len, "# TYPE nut_poll_duration_seconds gauge\n"
+                                  "# UNIT nut_poll_duration_seconds seconds\n"
+                                  "# HELP nut_poll_duration_seconds Time taken by the last poll of the UPS.\n");
+    for(index = 0; index < count; index++) {
+        status = &exporter -> copy[index];
+        if(!status -> ups_Present) continue;
+        len = append(body, size, len, "nut_poll_duration_seconds{ups=\"%s\"} %g\n", exporter -> labels[index],
+                     status -> ups_PollTime / 1000000.0);
+    }
+
+    len = append(body, size, len, "# TYPE nut_request_duration_seconds histogram\n"
+                                  "# UNIT nut_request_duration_seconds seconds\n"
+                                  "# HELP nut_request_duration_seconds Round trip time of upsd requests.\n");
+    for(index = 0; index < count; index++) {
+        status = &exporter -> copy[index];
+        seen   = 0;
+        for(item = 0; item < RTT_BUCKETS - 1; item++) {
+            seen += status -> ups_Health.rtt[item];
+            len = append(body, size, len, "nut_request_duration_seconds_bucket{ups=\"%s\",le=\"%g\"} %u\n",
+                         exporter -> labels[index], ((gint64)RTT_FIRST_BUCKET << item) / 1000000.0, seen);
+        }
+        len = append(body, size, len, "nut_request_duration_seconds_bucket{ups=\"%s\",le=\"+Inf\"} %u\n"
+                                      "nut_request_duration_seconds_count{ups=\"%s\"} %u\n",
+                     exporter -> labels[index], status -> ups_Health.replies,
+                     exporter -> labels[index], status -> ups_Health.replies);
+    }
+
+    for(item = 0; counters[item].name; item++) {
+        len = append(body, size, len, "# TYPE %s counter\n# HELP %s %s\n", counters[item].name, counters[item].name,
+                     counters[item].help);
+        for(index = 0; index < count; index++) {
+            len = append(body, size, len, "%s_total{ups=\"%s\"} %u\n", counters[item].name, exporter -> labels[index],
+                         *(guint32 *)((gchar *)&exporter -> copy[index].ups_Health + counters[item].offset));
+        }
+    }
+
+    len = append(body, size, len, "# TYPE nut_snapshots counter\n"
+                                  "# HELP nut_snapshots Statuses published by the client, a stalled value means a stalled client.\n");
+    for(index = 0; index < count; index++) {
+        len = append(body, size, len, "nut_snapshots_total{ups=\"%s\"} %u\n", exporter -> labels[index],
+                     exporter -> copy[index].ups_Sequence);
+    }
+
+    return append(body, size, len, "# EOF\n");
+}
+
+/** Build the reply to a complete request.
+ *  Anything other than a GET or HEAD of /metrics (or /) is refused.
+ */
+static void buildReply(MetricsExporter *exporter, Scrape *scrape)
+{
+    const gchar *status = "200 OK";
+    const gchar *type   = contentType;
+    const gchar *body;
+    gchar        header[256];
+    gint         headLen;
+    gint         bodyLen;
+    gboolean     head   = !strncmp(scrape -> request, "HEAD ", 5);
+    gchar       *path;
+    gint         pathLen;
+
+    /* The path runs from after the method to the query string or the protocol version */
+    if((path = strchr(scrape -> request, ' ')) != NULL) path++;
+    pathLen = path ? strcspn(path, " ?\r\n") : 0;
+
+    if(strncmp(scrape -> request, "GET ", 4) && !head) {
+        status  = "405 Method Not Allowed";
+        type    = "text/plain";
+        body    = "Only GET and HEAD are supported\n";
+        bodyLen = strlen(body);
+    } else if(((pathLen == 8) && !strncmp(path, "/metrics", 8)) || ((pathLen == 1) && (*path == '/'))) {
+        bodyLen = renderMetrics(exporter);
+        body    = exporter -> body;
+    } else {
+        status  = "404 Not Found";
+        type    = "text/plain";
+        body    = "Metrics are served on /metrics\n";
+        bodyLen = strlen(body);
+    }
+
+    headLen = g_snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n"
+                         "Connection: close\r\n\r\n", status, type, bodyLen);
+    headLen = MIN(headLen, (gint)sizeof(header) - 1);
+    if(head) bodyLen = 0;
+
+    scrape -> reply     = g_malloc(headLen + bodyLen);
+    scrape -> replyLen  = headLen + bodyLen;
+    scrape -> replySent = 0;
+    memcpy(scrape -> reply, header, headLen);
+    memcpy(scrape -> reply + headLen, body, bodyLen);
+}
+
+/** Close a scraper connection and free its slot. */
+static void closeScrape(Scrape *scrape)
+{
+    close(scrape -> socket);
+    g_free(scrape -> reply);
+    scrape -> socket     = -1;
+    scrape -> reply      = NULL;
+    scrape -> requestLen = 0;
+}
+
+/** Read what a scraper has sent, building the reply once the request is complete.
+ *  A request which does not fit in the buffer is answered from whatever
+ *  arrived, which is only ever a bad request.
+ */
+static void readRequest(MetricsExporter *exporter, Scrape *scrape)
+{
+    gint readlen;
+
+    readlen = recv(scrape -> socket, scrape -> request + scrape -> requestLen,
+                   MAX_SCRAPE_REQUEST - 1 - scrape -> requestLen, 0);
+    if((readlen < 0) && ((errno == EAGAIN) || (errno == EINTR))) return;
+    if(readlen <= 0) {
+        closeScrape(scrape);
+        return;
+    }
+    scrape -> requestLen += readlen;
+    scrape -> request[scrape -> requestLen] = '\0';
+
+    if(strstr(scrape -> request, "\r\n\r\n") || strstr(scrape -> request, "\n\n") ||
+       (scrape -> requestLen == MAX_SCRAPE_REQUEST - 1)) {
+        buildReply(exporter, scrape);
+    }
+}
+
+/** Send as much of a reply as the scraper will take, closing the connection once it is all sent. */
+static void sendReply(Scrape *scrape)
+{
+    gint sent;
+
+    sent = send(scrape -> socket, scrape -> reply + scrape -> replySent, scrape -> replyLen - scrape -> replySent,
+                MSG_NOSIGNAL);
+    if((sent < 0) && ((errno == EAGAIN) || (errno == EINTR))) return;
+    if(sent < 0) {
+        closeScrape(scrape);
+        return;
+    }
+    scrape -> replySent += sent;
+    if(scrape -> replySent == scrape -> replyLen) closeScrape(scrape);
+}
+
+/** Accept a scraper into a free slot, if there is one. */
+static void acceptScrape(MetricsExporter *exporter, gint64 now)
+{
+    Scrape *scrape = NULL;
+    gint    index;
+    int     sock;
+
+    for(index = 0; (index < MAX_SCRAPERS) && (scrape == NULL); index++) {
+        if(exporter -> scrapes[index].socket < 0) scrape = &exporter -> scrapes[index];
+    }
+    if(scrape == NULL) return;
+    if((sock = accept(exporter -> listener, NULL, NULL)) < 0) return;
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    scrape -> socket     = sock;
+    scrape -> requestLen = 0;
+    scrape -> reply      = NULL;
+    scrape -> deadline   = now + SCRAPE_TIMEOUT;
+}
+
+/** Exporter thread.
+ *  Waits in poll() for scrapers to connect, send their requests and take
+ *  their replies. New connections are only accepted while a slot is free,
+ *  and a scraper which takes longer than SCRAPE_TIMEOUT is dropped.
+ */
+static void *exporterThread(void *data)
+{
+    MetricsExporter *exporter = (MetricsExporter *)data;
+    struct pollfd    fds[MAX_SCRAPERS + 2];
+    Scrape          *scrape;
+    gchar            drain[16];
+    gint64           now;
+    gint64           wake;
+    gboolean         full;
+    gint             index;
+
+    for(;;) {
+        now  = monotonicMsec();
+        wake = -1;
+        full = TRUE;
+
+        for(index = 0; index < MAX_SCRAPERS; index++) {
+            scrape = &exporter -> scrapes[index];
+            fds[index + 2].fd      = scrape -> socket;
+            fds[index + 2].events  = scrape -> reply ? POLLOUT : POLLIN;
+            fds[index + 2].revents = 0;
+            if(scrape -> socket < 0) {
+                full = FALSE;
+            } else if((wake < 0) || (scrape -> deadline < wake)) {
+                wake = scrape -> deadline;
+            }
+        }
+        fds[0].fd      = exporter -> wakeFds[0];
+        fds[0].events  = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd      = full ? -1 : exporter -> listener;
+        fds[1].events  = POLLIN;
+        fds[1].revents = 0;
+
+        if((poll(fds, MAX_SCRAPERS + 2, (wake < 0) ? -1 : (gint)MAX(wake - now, 0)) < 0) && (errno != EINTR)) break;
+
+        if(fds[0].revents) {
+            while(read(exporter -> wakeFds[0], drain, sizeof(drain)) > 0);
+            if(__atomic_load_n(&exporter -> stop, __ATOMIC_ACQUIRE)) break;
+        }
+
+        now = monotonicMsec();
+        for(index = 0; index < MAX_SCRAPERS; index++) {
+            scrape = &exporter -> scrapes[index];
+            if(scrape -> socket < 0) continue;
+
+            if(fds[index + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if(scrape -> reply) {
+                    sendReply(scrape);
+                } else {
+                    readRequest(exporter, scrape);
+                }
+            } else if(fds[index + 2].revents & POLLOUT) {
+                sendReply(scrape);
+            }
+            if((scrape -> socket >= 0) && (now >= scrape -> deadline)) closeScrape(scrape);
+        }
+        if(fds[1].revents) acceptScrape(exporter, now);
+    }
+
+    for(index = 0; index < MAX_SCRAPERS; index++) {
+        if(exporter -> scrapes[index].socket >= 0) closeScrape(&exporter -> scrapes[index]);
+    }
+    return NULL;
+}
+
+/** Open the listening socket.
+ *  The address may be a host name or a numeric IPv4 or IPv6 address, each
+ *  address it resolves to is tried in turn. Returns -1 on failure.
+ */
+static int openListener(const gchar *address, gint port)
+{
+    struct addrinfo  hints;
+    struct addrinfo *result;
+    struct addrinfo *addr;
+    gchar            service[16];
+    int              sock = -1;
+    int              reuse = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    g_snprintf(service, sizeof(service), "%d", port);
+    if(getaddrinfo(address, service, &hints, &result) != 0) return -1;
+
+    for(addr = result; addr && (sock < 0); addr = addr -> ai_next) {
+        if((sock = socket(addr -> ai_family, addr -> ai_socktype, addr -> ai_protocol)) < 0) continue;
+
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if((bind(sock, addr -> ai_addr, addr -> ai_addrlen) < 0) || (listen(sock, MAX_SCRAPERS) < 0)) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(result);
+
+    if(sock >= 0) fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return sock;
+}
+
+/** Free an exporter which is not (or no longer) running. */
+static void freeExporter(MetricsExporter *exporter)
+{
+    if(exporter -> listener >= 0) close(exporter -> listener);
+    if(exporter -> wakeFds[0] >= 0) close(exporter -> wakeFds[0]);
+    if(exporter -> wakeFds[1] >= 0) close(exporter -> wakeFds[1]);
+    pthread_mutex_destroy(&exporter -> lock);
+    g_free(exporter -> body);
+    g_free(exporter);
+}
+
+/** Start serving metrics.
+ *  Until their first status is published the UPSes are exported as not
+ *  present, with their connection failed. Returns NULL if the address can
+ *  not be listened on or the thread can not be started.
+ *
+ *  \par Arguments:
+ *  \arg \c address - address to listen on, METRICS_DEFAULT_ADDRESS if NULL.
+ *  \arg \c port - port to listen on.
+ *  \arg \c names - name (UPS specification) of each UPS, the ups given to exporterPublish() indexes this.
+ *  \arg \c count - number of entries in names.
+ */
+MetricsExporter *startExporter(const gchar *address, gint port, const gchar **names, gint count)
+{
+    MetricsExporter *exporter;
+    gint             index;
+
+    if((count <= 0) || (count > MAX_UPS)) return NULL;
+
+    exporter = g_new0(MetricsExporter, 1);
+    exporter -> wakeFds[0] = exporter -> wakeFds[1] = -1;
+    exporter -> upsCount   = count;
+    exporter -> bodySize   = METRICS_HEAD_SPACE + count * METRICS_UPS_SPACE;
+    exporter -> body       = g_malloc(exporter -> bodySize);
+    pthread_mutex_init(&exporter -> lock, NULL);
+
+    for(index = 0; index < count; index++) {
+        strncpy(exporter -> status[index].ups_Name, names[index], MAX_UPSNAME - 1);
+        exporter -> status[index].ups_ConnState = CONN_FAILED;
+        escapeLabel(exporter -> labels[index], sizeof(exporter -> labels[index]), names[index]);
+    }
+    for(index = 0; index < MAX_SCRAPERS; index++) exporter -> scrapes[index].socket = -1;
+
+    if(((exporter -> listener = openListener(address ? address : METRICS_DEFAULT_ADDRESS, port)) < 0) ||
+       (pipe(exporter -> wakeFds) != 0)) {
+        freeExporter(exporter);
+        return NULL;
+    }
+    fcntl(exporter -> wakeFds[0], F_SETFL, fcntl(exporter -> wakeFds[0], F_GETFL) | O_NONBLOCK);
+
+    if(pthread_create(&exporter -> thread, NULL, exporterThread, exporter)) {
+        freeExporter(exporter);
+        return NULL;
+    }
+    return exporter;
+}
+
+/** Publish the status of a UPS.
+ *  Called from the client thread (through the snapshot callback) each time
+ *  it publishes a status, the exporter only copies it.
+ *
+ *  \par Arguments:
+ *  \arg \c exporter - exporter returned by startExporter().
+ *  \arg \c ups - index of the UPS in the names given to startExporter().
+ *  \arg \c status - status to publish.
+ */
+void exporterPublish(MetricsExporter *exporter, gint ups, const struct UPSData *status)
+{
+    if((ups < 0) || (ups >= exporter -> upsCount)) return;
+
+    pthread_mutex_lock(&exporter -> lock);
+    memcpy(&exporter -> status[ups], status, sizeof(struct UPSData));
+    pthread_mutex_unlock(&exporter -> lock);
+}
+
+/** Stop serving metrics and free the exporter.
+ *  Scrapers still connected are cut off.
+ */
+void stopExporter(MetricsExporter *exporter)
+{
+    if(exporter == NULL) return;
+
+    __atomic_store_n(&exporter -> stop, 1, __ATOMIC_RELEASE);
+    write(exporter -> wakeFds[1], "", 1);
+    pthread_join(exporter -> thread, NULL);
+    freeExporter(exporter);
+}
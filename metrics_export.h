@@ -0,0 +1,71 @@
+/**
+ *  \file metrics_export.h
+ *  OpenMetrics exporter header.
+ *  Serves the latest status of every UPS a collector polls, along with the
+ *  health of its polling, to Prometheus style scrapers over HTTP. See
+ *  metrics_export.c.
+ */
+
+#ifndef METRICS_EXPORT
+#define METRICS_EXPORT
+
+#include<glib.h>
+#include<pthread.h>
+#include"nut_connect.h"
+
+/*! Scrapes served at once, further scrapers wait in the listen queue */
+#define MAX_SCRAPERS 16
+
+/*! Time allowed for a scraper to send its request and take the reply, in milliseconds */
+#define SCRAPE_TIMEOUT 5000
+
+/*! Longest HTTP request (line and headers) accepted from a scraper */
+#define MAX_SCRAPE_REQUEST 2048
+
+/*! Space set aside in a reply for the metric descriptions, and for the metrics of each UPS */
+#define METRICS_HEAD_SPACE 8192
+#define METRICS_UPS_SPACE  16384
+
+/*! Default address the exporter listens on, scrapers on other machines need it given explicitly */
+#define METRICS_DEFAULT_ADDRESS "127.0.0.1"
+
+/*! One scraper connection. */
+typedef struct
+{
+    int     socket;                      /*!< Connection to the scraper, -1 if the slot is free.  */
+    gchar   request[MAX_SCRAPE_REQUEST]; /*!< Request received so far.                            */
+    gint    requestLen;                  /*!< Number of bytes in request.                         */
+    gchar  *reply;                       /*!< Reply being sent, NULL until the request is complete. */
+    gint    replyLen;                    /*!< Length of reply.                                    */
+    gint    replySent;                   /*!< Bytes of reply sent so far.                         */
+    gint64  deadline;                    /*!< Monotonic time (milliseconds) to give up on it.     */
+} Scrape;
+
+/*! A running exporter, see startExporter().
+ *  The collector hands every status it publishes to exporterPublish(), which
+ *  only holds lock long enough to copy it. The exporter thread copies all of
+ *  them out again when a scrape arrives and renders from its own copy, so
+ *  scrapers never cause any upsd traffic and never hold up the client.
+ */
+typedef struct
+{
+    int             listener;          /*!< Listening socket.                                     */
+    int             wakeFds[2];        /*!< Wakeup pipe, written by stopExporter().               */
+    pthread_t       thread;            /*!< Thread serving the scrapers.                          */
+    gint            stop;              /*!< Set by stopExporter(), read atomically.               */
+    pthread_mutex_t lock;              /*!< Guards status.                                        */
+    gint            upsCount;          /*!< Number of UPSes exported.                             */
+    gchar           labels[MAX_UPS][MAX_UPSNAME * 2]; /*!< Name of each UPS, escaped for a label value. */
+    struct UPSData  status[MAX_UPS];   /*!< Latest status published for each UPS.                 */
+    struct UPSData  copy[MAX_UPS];     /*!< Exporter thread: statuses being rendered.             */
+    gchar          *body;              /*!< Exporter thread: buffer the metrics are rendered into. */
+    gint            bodySize;          /*!< Size of body.                                         */
+    Scrape          scrapes[MAX_SCRAPERS]; /*!< Scraper connections.                              */
+} MetricsExporter;
+
+/* functions exported from metrics_export.c */
+extern MetricsExporter *startExporter(const gchar *address, gint port, const gchar **names, gint count); /*!< Start serving metrics. */
+extern void exporterPublish(MetricsExporter *exporter, gint ups, const struct UPSData *status); /*!< Publish the status of a UPS. */
+extern void stopExporter(MetricsExporter *exporter);                                           /*!< Stop serving and free.      */
+
+#endif
@@ -101,18 +101,169 @@
 
 #include<stdio.h>
 #include<stdlib.h>
+#include<stddef.h>
 #include<string.h>
 #include<sys/types.h>
 #include<unistd.h>
-#include<sys/select.h>
+#include<time.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<poll.h>
+#include<pthread.h>
 #include<sys/socket.h>
+#include<netinet/in.h>
 #include<netdb.h>
 #include"nut_connect.h"
 
-struct UPSData upsStatus; /*!< Global UPS data structure, must be synchronised across threads! */
-pthread_mutex_t upsStatus_lock = PTHREAD_MUTEX_INITIALIZER; /*!< Synchronisation mutex for upsStatus */
+/*! Maximum length of a upsd hostname (plus one for the terminator) */
+#define MAX_HOSTNAME 257
 
-gboolean haltThread = FALSE; /*!< Used to shut down the client thread from gkrellm, set to TRUE to halt then pthread_join */
+/*! Maximum number of addresses tried for a single upsd host */
+#define MAX_ADDRS 8
+
+/*! Space needed for a single request line, the longest is GET VAR <ups> <variable> */
+#define MAX_REQUESTSIZE (MAX_UPSNAME + 32)
+
+/*! Size of the receive buffer, this limits the length of a single upsd reply line */
+#define MAX_LINESIZE 1024
+
+/*! Line framed receive buffer.
+ *  Replies from upsd are read into data and handed out a line at a time, 
+ *  see fillBuffer() and nextLine() in nut_connect.c.
+ */
+typedef struct
+{
+    gchar data[MAX_LINESIZE]; /*!< Received bytes.                        */
+    gint  start;              /*!< Offset of the first unconsumed byte.   */
+    gint  end;                /*!< Offset one past the last received byte. */
+} LineBuffer;
+
+/*! Set in UPSSnapshot.middle when it holds a snapshot the reader has not yet taken */
+#define SNAPSHOT_FRESH 4
+
+/*! Triple buffer handing the status of one UPS from the client thread to the GUI.
+ *  Each of back, middle and front holds the index of one of the buffers. The client
+ *  fills its back buffer and exchanges it with middle, the GUI exchanges its front
+ *  buffer with middle when a fresh snapshot is waiting. Neither side ever waits 
+ *  for the other and the GUI never sees a half written snapshot.
+ */
+typedef struct
+{
+    struct UPSData buffer[3]; /*!< Snapshot storage.                                        */
+    gint           back;      /*!< Buffer being filled, only used by the client thread.     */
+    gint           middle;    /*!< Last published buffer, exchanged atomically.             */
+    gint           front;     /*!< Buffer being read, only used by the GUI thread.          */
+} UPSSnapshot;
+
+/*! Delay before racing a connection attempt to the next address of a host, in milliseconds */
+#define CONNECT_RACE_DELAY 250
+
+/*! Reconnect delays, doubled after each failure (and jittered) up to the maximum, in milliseconds */
+#define BACKOFF_MIN 1000
+#define BACKOFF_MAX 60000
+
+/*! A request which has been sent to upsd but not yet answered. */
+typedef struct
+{
+    gint   ups;      /*!< Index of the UPS the request is for.                   */
+    gint   reply;    /*!< Which reply this is (position within the poll cycle).  */
+    gint64 sent;     /*!< Monotonic time (microseconds) the request was queued.  */
+    gint64 deadline; /*!< Monotonic time (microseconds) by which it must arrive. */
+} PendingRequest;
+
+/*! States of a Resolver, see resolveThread() in nut_connect.c. */
+enum
+{
+    RESOLVE_BUSY,      /*!< getaddrinfo() still running.                         */
+    RESOLVE_DONE,      /*!< Finished, the result is waiting for the client.      */
+    RESOLVE_ABANDONED  /*!< The client no longer wants it, the resolver frees it. */
+};
+
+/*! A host address lookup, run by its own thread so the client never blocks in getaddrinfo(). */
+typedef struct
+{
+    gchar            hostname[MAX_HOSTNAME]; /*!< Host to look up.                                 */
+    gint             port;                   /*!< Port to look up.                                 */
+    struct addrinfo *result;                 /*!< Addresses found, owned by whoever frees this.    */
+    gint             error;                  /*!< getaddrinfo() return value.                      */
+    gint             state;                  /*!< One of RESOLVE_*, changed atomically.            */
+    int              wakeFd;                 /*!< Copy of the client wakeup pipe, closed when done. */
+} Resolver;
+
+/*! State of one connection to a upsd host, owned entirely by the client thread.
+ *  Every UPS on the same host and port shares the one connection.
+ */
+typedef struct
+{
+    UPSClient         *client;                 /*!< Client the connection belongs to.                */
+    gchar              hostname[MAX_HOSTNAME]; /*!< Host upsd is running on.                         */
+    gint               port;                   /*!< Port upsd is accepting connections on.           */
+    struct sockaddr_storage addrs[MAX_ADDRS];  /*!< Addresses found for hostname, families interleaved. */
+    socklen_t          addrLens[MAX_ADDRS];    /*!< Length of each entry in addrs.                   */
+    gint               addrCount;              /*!< Number of entries in addrs.                      */
+    gint               addrNext;               /*!< Next entry in addrs to try connecting to.        */
+    int                attempts[MAX_ADDRS];    /*!< Connect in progress to each address, or -1.      */
+    gint64             nextAttempt;            /*!< When to race the next address.                   */
+    Resolver          *resolver;               /*!< Lookup in progress, or NULL.                     */
+    gint               failures;               /*!< Failures since the last complete poll cycle.     */
+    gint               state;                  /*!< One of the CONN_* states.                        */
+    gint               protocol;               /*!< One of the PROTOCOL_* values.                    */
+    int                socket;                 /*!< Non-blocking socket connected to upsd, or -1.    */
+    gint64             deadline;               /*!< When a lookup or connect should be abandoned, or
+                                                    when to try again in CONN_BACKOFF.               */
+    LineBuffer         in;                     /*!< Replies received but not yet parsed.             */
+    gchar             *out;                    /*!< Requests queued but not yet written.             */
+    gint               outLen;                 /*!< Number of bytes waiting in out.                  */
+    gint               outSize;                /*!< Size of out.                                     */
+    PendingRequest    *pending;                /*!< Ring of requests awaiting replies, oldest first. */
+    gint               pendHead;               /*!< Index of the oldest entry in pending.            */
+    gint               pendCount;              /*!< Number of entries in pending.                    */
+    gint               pendSize;               /*!< Size of pending, enough for a full poll cycle.   */
+    gint64             cycleStart;             /*!< When the current poll cycle was queued.          */
+    gint64             nextPoll;               /*!< When the next poll cycle should be queued.       */
+    gint               ups[MAX_UPS];           /*!< Indices of the UPSes served by this connection.  */
+    gint               upsCount;               /*!< Number of entries in ups.                        */
+    PollHealth         health;                 /*!< Round trips and failures, see PollHealth.        */
+    gboolean           connectedBefore;        /*!< TRUE once the first connection has been made.    */
+} UPSConnection;
+
+/*! A single monitored UPS. */
+typedef struct
+{
+    gchar          name[MAX_UPSNAME]; /*!< Name of the UPS on its upsd server, empty for the default UPS (until 
+                                           LIST UPS has been used to find it when speaking the LIST protocol). */
+    UPSConnection *conn;              /*!< Connection to the server the UPS is attached to.               */
+    guint          lastStatus;        /*!< UPS_* flags last reported to the TransitionFunc, 0 for none.    */
+    guint32        wanted;            /*!< Readings to fetch (VAR_* bits), see setWantedVars().            */
+    gint64         due[VAR_COUNT];    /*!< Monotonic time each reading is next due, see UPSVar.refresh.    */
+    gboolean       infoKnown;         /*!< TRUE once the static information was asked for on this connection. */
+} UPSMonitor;
+
+/*! Everything belonging to one client, see launchClient().
+ *  Nothing in here is shared between clients, so any number of them can run
+ *  side by side. Apart from snapshots, stopClient and the write end of the
+ *  wakeup pipe it all belongs to the client thread while that is running.
+ */
+struct UPSClient
+{
+    struct UPSData upsStatus[MAX_UPS]; /*!< Working copy of each UPS status.                                 */
+    UPSSnapshot    snapshots[MAX_UPS]; /*!< Published copies of upsStatus, see readStatus().                 */
+    UPSMonitor     monitors[MAX_UPS];  /*!< The UPSes being monitored, parallel to upsStatus.                */
+    gint           upsCount;           /*!< Number of entries in upsStatus in use.                           */
+    UPSConnection *hosts[MAX_UPS];     /*!< One connection for each distinct upsd host and port.             */
+    gint           hostCount;          /*!< Number of entries in hosts in use.                               */
+    int            wakeFds[2];         /*!< Wakeup pipe, written by haltClient() and by finished host lookups */
+    PollPolicy     pollPolicy;         /*!< Poll intervals.                                                  */
+    gint           stopClient;         /*!< Set by haltClient() before waking the client thread.             */
+    guint          backoffSeed;        /*!< rand_r() state for the reconnect jitter.                         */
+    SnapshotFunc   notify;             /*!< Called for every published status, or NULL.                      */
+    TransitionFunc transition;         /*!< Called for every change of status flags, or NULL.                */
+    gpointer       notifyData;         /*!< Passed to notify and transition.                                 */
+    pthread_t      thread;             /*!< The client thread.                                               */
+};
+
+/*! Monotonic time which will never be reached, used for "no deadline". */
+#define NEVER ((gint64)1 << 62)
 
 static const gchar noUPS[]  = "UPS not connected";
 static const gchar gotUPS[] = "UPS monitoring active";
@@ -121,26 +272,108 @@ static const gchar noSock[] = "Socket error";
 static const gchar badHost[]= "Unable to find host";
 static const gchar badConn[]= "Connection refused";
 static const gchar disconHost[]= "Disconnecting from server";
+static const gchar noReply[]= "Server not responding";
+static const gchar lookupHost[] = "Looking up host";
+static const gchar connHost[]   = "Connecting to server";
+static const gchar connTimeout[]= "Connection timed out";
 
-static const gchar reqUtility[] = "REQ UTILITY\n";
-static const gchar reqAcfreq[]  = "REQ ACFREQ\n";
-static const gchar reqBattpct[] = "REQ BATTPCT\n";
-static const gchar reqLoadpct[] = "REQ LOADPCT\n";
-static const gchar reqStatus[]  = "REQ STATUS\n";
-
-static const gchar statusOFF[]   = "UPS: off";
-static const gchar statusOL[]    = "UPS: online";
-static const gchar statusOB[]    = "UPS: on battery";
-static const gchar statusLB[]    = "UPS: battery is low";
-static const gchar statusCAL[]   = "UPS: performing calibration";
-static const gchar statusTRIM[]  = "UPS: trimming incoming voltage";
-static const gchar statusBOOST[] = "UPS: boosting incoming voltage";
-static const gchar statusOVER[]  = "UPS: overloaded";
-static const gchar statusRB[]    = "UPS: battery needs to be replaced";
-static const gchar statusFSD[]   = "UPS: forced shutdown state";
-
-static gchar upsd_host[257];
-static gint  upsd_port;
+/*! Kinds of reply. The legacy protocol needs a request (and reply) for each reading
+ *  which has a legacy name, in the order of upsVars and numbered by VAR_*, followed 
+ *  by one for the status. The LIST protocol fetches every variable at once.
+ */
+enum
+{
+    REPLY_STATUS = VAR_COUNT,    /*!< REQ STATUS, the last request of a legacy poll cycle.           */
+    REPLY_COUNT,                 /*!< Most legacy requests in the poll cycle of one UPS.             */
+    REPLY_LISTVAR = REPLY_COUNT, /*!< LIST VAR <ups>, answered by a BEGIN ... END block of VAR lines. */
+    REPLY_LISTUPS,               /*!< LIST UPS, used to find the default UPS on a server.            */
+    REPLY_GETVAR,                /*!< GET VAR <ups> <reading>, when only some readings are wanted.   */
+    REPLY_GETSTATUS              /*!< GET VAR <ups> ups.status, the last request of such a cycle.    */
+};
+
+/*! Every reading, see UPSVar. ups.status is handled seperately by parseStatus(). */
+const UPSVar upsVars[VAR_COUNT] =
+{
+    { "input.voltage",    "UTILITY",  offsetof(struct UPSData, in_Voltage),  1.0, 0.0,    1000.0, "%3.1f",
+      "Input voltage",    "Utility input voltage, in volts",            "nut_input_voltage_volts",    "volts",   0            },
+    { "input.frequency",  "ACFREQ",   offsetof(struct UPSData, in_Freq),     1.0, 0.0,    1000.0, "%2.1f",
+      "Input frequency",  "Utility input frequency, in hertz",          "nut_input_frequency_hertz",  "hertz",   10000        },
+    { "output.voltage",   "OUTVOLT",  offsetof(struct UPSData, out_Voltage), 1.0, 0.0,    1000.0, "%3.1f",
+      "Output voltage",   "Voltage supplied by the UPS, in volts",      "nut_output_voltage_volts",   "volts",   0            },
+    { "output.frequency", NULL,       offsetof(struct UPSData, out_Freq),    1.0, 0.0,    1000.0, "%2.1f",
+      "Output frequency", "Frequency supplied by the UPS, in hertz",    "nut_output_frequency_hertz", "hertz",   10000        },
+    { "battery.charge",   "BATTPCT",  offsetof(struct UPSData, bat_Level),   1.0, 0.0,    100.0,  "%3.1f",
+      "Battery level",    "Battery charge, as a percentage of full",    "nut_battery_charge_percent", NULL,      0            },
+    { "battery.voltage",  "BATTVOLT", offsetof(struct UPSData, bat_Voltage), 1.0, 0.0,    1000.0, "%3.1f",
+      "Battery voltage",  "Battery voltage, in volts",                  "nut_battery_voltage_volts",  "volts",   5000         },
+    { "ups.load",         "LOADPCT",  offsetof(struct UPSData, ups_Load),    1.0, 0.0,    1000.0, "%3.1f",
+      "Load",             "Load, as a percentage of the UPS rating",    "nut_load_percent",           NULL,      0            },
+    { "ups.temperature",  "UPSTEMP",  offsetof(struct UPSData, ups_Temp),    1.0, -100.0, 200.0,  "%2.1f",
+      "Temperature",      "Internal temperature of the UPS, in celsius", "nut_temperature_celsius",   "celsius", 30000        },
+    { "input.voltage.nominal", NULL,  offsetof(struct UPSData, in_Nominal),  1.0, 0.0,    1000.0, "%3.0f",
+      "Nominal voltage",  "Nominal input voltage, in volts",            "nut_input_nominal_volts",    "volts",   REFRESH_ONCE }
+};
+
+/*! Static information strings, fetched once a connection along with the REFRESH_ONCE readings */
+enum
+{
+    INFO_MODEL, INFO_FIRMWARE, INFO_COUNT
+};
+
+/*! NUT variable names of the information strings and the UPSData fields (MAX_INFO long) they fill. */
+static const struct
+{
+    const gchar *name;   /*!< NUT variable name.                      */
+    gint         offset; /*!< Offset of the string in UPSData.        */
+} upsInfo[INFO_COUNT] =
+{
+    { "ups.model",    offsetof(struct UPSData, ups_Model)    },
+    { "ups.firmware", offsetof(struct UPSData, ups_Firmware) }
+};
+
+/*! Most requests in the poll cycle of one UPS: every reading, the status and the information strings */
+#define CYCLE_REQUESTS (REPLY_COUNT + INFO_COUNT)
+
+/*! Allowance for a poll cycle starting late, so a reading due just after it starts is not left for the next one */
+#define REFRESH_SLACK ((gint64)MIN_POLL_INTERVAL * 500)
+
+/*! Status tokens reported by upsd, the flag each one sets and its log text. */
+static const struct
+{
+    const gchar *token; /*!< Token as sent by upsd.          */
+    guint        flag;  /*!< UPS_* flag set by the token.    */
+    const gchar *text;  /*!< Description used in the log.    */
+} statusFlags[] =
+{
+    { "OFF",     UPS_OFF,     "off"                           },
+    { "OL",      UPS_OL,      "online"                        },
+    { "OB",      UPS_OB,      "on battery"                    },
+    { "LB",      UPS_LB,      "battery is low"                },
+    { "HB",      UPS_HB,      "battery is high"               },
+    { "RB",      UPS_RB,      "battery needs to be replaced"  },
+    { "CHRG",    UPS_CHRG,    "charging"                      },
+    { "DISCHRG", UPS_DISCHRG, "discharging"                   },
+    { "BYPASS",  UPS_BYPASS,  "on bypass"                     },
+    { "CAL",     UPS_CAL,     "performing calibration"        },
+    { "TRIM",    UPS_TRIM,    "trimming incoming voltage"     },
+    { "BOOST",   UPS_BOOST,   "boosting incoming voltage"     },
+    { "OVER",    UPS_OVER,    "overloaded"                    },
+    { "FSD",     UPS_FSD,     "forced shutdown state"         },
+    { NULL,      0,           NULL                            }
+};
+
+/** Zero the readings of a UPSData structure given by a mask of VAR_* bits.
+ *  They are no longer fetched, see ups_Fetched.
+ */
+static void clearReadings(struct UPSData *target, guint32 vars)
+{
+    gint index;
+
+    for(index = 0; index < VAR_COUNT; index++) {
+        if(vars & (1 << index)) *(gfloat *)((gchar *)target + upsVars[index].offset) = 0.0;
+    }
+    target -> ups_Fetched &= ~vars;
+}
 
 /** Clear the specified UPSData structure. 
  *  Use this to zero all the fields of a UPSData structure. Mainly intended to 
@@ -148,16 +381,14 @@ static gint  upsd_port;
  */
 static void resetStatus(struct UPSData *target)
 {
-    target -> bat_Voltage = 0.0;
-    target -> bat_Level   = 0.0;
-    target -> in_Freq     = 0.0;
-    target -> in_Voltage  = 0.0;
-    target -> out_Freq    = 0.0;
-    target -> out_Voltage = 0.0;
-    target -> ups_Load    = 0.0;
-    target -> ups_Temp    = 0.0;
+    clearReadings(target, VAR_ALL);
+    target -> ups_Model[0]    = '\0';
+    target -> ups_Firmware[0] = '\0';
     target -> ups_LastLog[0] = '\0';
     target -> ups_Present = FALSE;
+    target -> ups_PollTime = 0;
+    target -> ups_Sequence = 0;
+    target -> ups_Status   = 0;
 }
 
 /** Set the ups_LastLog field of a UPSData structure.
@@ -179,213 +410,1539 @@ static void setLastLog(struct UPSData *target, const gchar *log)
     target -> ups_LastLog[size] = 0;
 }
 
-/** Read data from the upsd server and parse it into upsStatus.
- *  The actual client work is done by this routine - it reads from the server into a temporary
- *  buffer, then the buffer is copied into an accumulator buffer until a new DeltaUPS is 
- *  encountered in the temp buffer. At this point, parseDeltaUPS() is called to parse the
- *  accumulator, then the accululator write position is reset to the start of the accumulator
- *  buffer and the copy from the temporary buffer continues.
+/** Set up the snapshot buffers of a UPS.
+ *  Every buffer starts out as a copy of the working status, so the GUI has 
+ *  something sensible to show before the first snapshot is published. Must 
+ *  only be called while no client thread is running.
+ */
+static void initSnapshot(UPSClient *client, gint ups)
+{
+    UPSSnapshot *snap = &client -> snapshots[ups];
+    gint         index;
+
+    for(index = 0; index < 3; index++) {
+        memcpy(&snap -> buffer[index], &client -> upsStatus[ups], sizeof(struct UPSData));
+    }
+    snap -> back   = 0;
+    snap -> middle = 1;
+    snap -> front  = 2;
+}
+
+/** Add the readings of a UPS to the window of the current second.
+ *  The window of the second before last is reused, see UPSWindow.
+ */
+static void addToWindow(struct UPSData *status, gint64 second)
+{
+    UPSWindow *window = &status -> ups_Window[second % 2];
+    gfloat     value;
+    gint       index;
+
+    if(window -> second != second) {
+        window -> second  = second;
+        window -> samples = 0;
+    }
+
+    for(index = 0; index < VAR_COUNT; index++) {
+        value = *(gfloat *)((gchar *)status + upsVars[index].offset);
+        if(window -> samples == 0) {
+            window -> low[index]  = value;
+            window -> high[index] = value;
+            window -> sum[index]  = value;
+        } else {
+            window -> low[index]   = MIN(window -> low[index], value);
+            window -> high[index]  = MAX(window -> high[index], value);
+            window -> sum[index]  += value;
+        }
+    }
+    window -> samples++;
+}
+
+/** Publish the working status of a UPS.
+ *  The status is copied into the back buffer which is then swapped with the
+ *  middle one, marking it fresh, along with the health of its connection. A
+ *  snapshot the reader has not picked up yet is simply overwritten next time
+ *  round. The readings of a complete poll are also added to the window of
+ *  the current second. The snapshot callback of the 
+ *  client, if any, is then given the status.
  *
  *  \par Arguments:
- *  \arg \c acc - buffer to use as an accumulator, must be at least MAX_LINESIZE characters in length.
- *  \arg \c temp - buffer to use as temporary store, again must be MAX_LINESIZE or greater.
+ *  \arg \c client - client the UPS belongs to.
+ *  \arg \c ups - index of the UPS.
+ *  \arg \c polled - TRUE at the end of a poll cycle, FALSE for a connection state change.
  */
-static void upsClient(gchar *acc, gchar *temp)
+static void publishStatus(UPSClient *client, gint ups, gboolean polled)
+{
+    UPSSnapshot *snap = &client -> snapshots[ups];
+
+    if(polled && client -> upsStatus[ups].ups_Present) addToWindow(&client -> upsStatus[ups], time(NULL));
+    client -> upsStatus[ups].ups_Sequence++;
+    client -> upsStatus[ups].ups_Health = client -> monitors[ups].conn -> health;
+    memcpy(&snap -> buffer[snap -> back], &client -> upsStatus[ups], sizeof(struct UPSData));
+    snap -> back = __atomic_exchange_n(&snap -> middle, snap -> back | SNAPSHOT_FRESH, __ATOMIC_ACQ_REL) & ~SNAPSHOT_FRESH;
+
+    if(client -> notify) client -> notify(ups, &client -> upsStatus[ups], polled, client -> notifyData);
+}
+
+/** Return the latest status published for a UPS.
+ *  Picks up a fresh snapshot if the client has published one since the last
+ *  call. The snapshot returned stays untouched by the client until the next 
+ *  call to readStatus() for the same UPS, so it can be used without any 
+ *  locking. Only to be called from a single thread (the GUI thread in the 
+ *  plugin) for each client.
+ *
+ *  \par Arguments:
+ *  \arg \c client - client monitoring the UPS.
+ *  \arg \c ups - index of the UPS, 0 to clientUPSCount() - 1.
+ */
+struct UPSData *readStatus(UPSClient *client, gint ups)
+{
+    UPSSnapshot *snap = &client -> snapshots[ups];
+
+    if(__atomic_load_n(&snap -> middle, __ATOMIC_RELAXED) & SNAPSHOT_FRESH) {
+        snap -> front = __atomic_exchange_n(&snap -> middle, snap -> front, __ATOMIC_ACQ_REL) & ~SNAPSHOT_FRESH;
+    }
+    return &snap -> buffer[snap -> front];
+}
+
+/** Return the window holding the readings of a UPS over one second.
+ *  second is a time() value, NULL is returned if no complete poll of the
+ *  UPS finished in it (or it is too long ago, only the last two seconds
+ *  polled are kept). See UPSWindow.
+ */
+const UPSWindow *statusWindow(const struct UPSData *status, gint64 second)
+{
+    const UPSWindow *window = &status -> ups_Window[second % 2];
+
+    if((window -> second != second) || (window -> samples == 0)) return NULL;
+    return window;
+}
+
+/** Refill a LineBuffer from a socket.
+ *  Received data is appended after any unconsumed bytes. Once the write 
+ *  position hits the end of the storage the buffer wraps: the unconsumed 
+ *  tail (which can only be a partial line, as every complete line is consumed
+ *  before the next read) is moved back to the start of the storage. Complete
+ *  lines therefore always sit in one contiguous run and can be parsed where 
+ *  they are, and the only bytes ever moved are those of a single partial line.
+ *
+ *  \par Arguments:
+ *  \arg \c buf - buffer to fill.
+ *  \arg \c fd - socket to read from.
+ *
+ *  \return the result of read(), or -1 with errno set to EMSGSIZE if a single 
+ *  line does not fit in the buffer.
+ */
+static gint fillBuffer(LineBuffer *buf, int fd)
 {
     gint readlen;
-    gint readpos;
+
+    if(buf -> end == MAX_LINESIZE) {
+        if(buf -> start == 0) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memmove(buf -> data, buf -> data + buf -> start, buf -> end - buf -> start);
+        buf -> end  -= buf -> start;
+        buf -> start = 0;
+    }
+
+    readlen = read(fd, buf -> data + buf -> end, MAX_LINESIZE - buf -> end);
+    if(readlen > 0) buf -> end += readlen;
+    return readlen;
+}
+
+/** Take the next complete line from a LineBuffer.
+ *  Returns a pointer to the start of the line within the buffer, or NULL if 
+ *  no complete line has been received yet. The line is not copied or 
+ *  terminated - it is always followed by its newline, which is enough to stop
+ *  strtod() and friends - and remains valid until the next fillBuffer().
+ *
+ *  \par Arguments:
+ *  \arg \c buf - buffer to take the line from.
+ *  \arg \c len - set to the length of the line, excluding the newline and any CR.
+ */
+static gchar *nextLine(LineBuffer *buf, gint *len)
+{
+    gchar *line = buf -> data + buf -> start;
+    gchar *eol;
+
+    if((eol = memchr(line, '\n', buf -> end - buf -> start)) == NULL) return NULL;
+
+    buf -> start = eol - buf -> data + 1;
+    if(buf -> start == buf -> end) buf -> start = buf -> end = 0;
+
+    *len = eol - line;
+    if((*len > 0) && (line[*len - 1] == '\r')) (*len)--;
+    return line;
+}
+
+/** Find the value in an "ANS <var>[@<ups>] <value>" reply.
+ *  Returns a pointer to the start of the value or NULL if line is not an
+ *  answer for the specified variable and UPS (upsd sends "ERR ..." lines for 
+ *  variables the UPS does not support).
+ *
+ *  \par Arguments:
+ *  \arg \c line - the reply, as returned by nextLine().
+ *  \arg \c lineLen - length of the reply.
+ *  \arg \c var - name of the variable which was requested.
+ *  \arg \c ups - name of the UPS the variable was requested for, empty for the default UPS.
+ */
+static gchar *replyValue(gchar *line, gint lineLen, const gchar *var, const gchar *ups)
+{
+    gint varLen = strlen(var);
+    gint upsLen = strlen(ups);
+    gint pos    = varLen + 4;
+
+    if((lineLen <= pos) || strncmp(line, "ANS ", 4) || strncmp(line + 4, var, varLen)) return NULL;
+
+    if(upsLen) {
+        if((lineLen <= pos + upsLen + 1) || (line[pos] != '@') || strncmp(line + pos + 1, ups, upsLen)) return NULL;
+        pos += upsLen + 1;
+    }
+
+    if(line[pos] != ' ') return NULL;
+    return line + pos + 1;
+}
+
+/** Count a reply line which did not answer its request.
+ *  upsd reports a UPS driver which has stopped updating with ERR DATA-STALE.
+ *  Other ERR replies are an answer of sorts (such as a variable the UPS does
+ *  not support), anything else could not be made sense of.
+ */
+static void badReply(UPSConnection *conn, const gchar *line, gint len)
+{
+    if((len >= 14) && !strncmp(line, "ERR DATA-STALE", 14)) {
+        conn -> health.staleData++;
+    } else if((len < 4) || strncmp(line, "ERR ", 4)) {
+        conn -> health.parseErrors++;
+    }
+}
+
+/** Find the histogram bucket a time falls in.
+ *  Histograms have RTT_BUCKETS log-scale buckets, see PollHealth.
+ *
+ *  \par Arguments:
+ *  \arg \c usec - the time in microseconds.
+ */
+gint latencyBucket(gint64 usec)
+{
+    gint bucket = 0;
+
+    while((bucket < RTT_BUCKETS - 1) && (usec >= ((gint64)RTT_FIRST_BUCKET << bucket))) bucket++;
+    return bucket;
+}
+
+/** Estimate a percentile of a latency histogram.
+ *  Returns the upper bound of the bucket the percentile falls in, so the
+ *  true value is at most that and more than half of it. Returns 0 for an
+ *  empty histogram. Times slower than the last bucket are reported as its
+ *  lower bound.
+ *
+ *  \par Arguments:
+ *  \arg \c buckets - RTT_BUCKETS counts, see latencyBucket().
+ *  \arg \c total - total of buckets.
+ *  \arg \c percent - percentile wanted, 1 to 100.
+ *
+ *  \return The time in microseconds.
+ */
+gint64 latencyPercentile(const guint32 *buckets, guint32 total, gint percent)
+{
+    guint64 wanted;
+    guint64 seen = 0;
+    gint    bucket;
+
+    if(total == 0) return 0;
+
+    wanted = ((guint64)total * CLAMP(percent, 1, 100) + 99) / 100;
+    for(bucket = 0; bucket < RTT_BUCKETS - 1; bucket++) {
+        seen += buckets[bucket];
+        if(seen >= wanted) return (gint64)RTT_FIRST_BUCKET << bucket;
+    }
+    return (gint64)RTT_FIRST_BUCKET << (RTT_BUCKETS - 2);
+}
+
+/** Add a reply round trip to the histogram of a connection. */
+static void recordRtt(PollHealth *health, gint64 rtt)
+{
+    health -> rtt[latencyBucket(rtt)]++;
+    health -> replies++;
+}
+
+/** Estimate a percentile of the reply round trip times of a connection.
+ *  See latencyPercentile(), health is as published in ups_Health.
+ */
+gint64 rttPercentile(const PollHealth *health, gint percent)
+{
+    return latencyPercentile(health -> rtt, health -> replies, percent);
+}
+
+/** Describe a set of UPS status flags.
+ *  Writes either the upsd tokens ("OB LB") or their descriptions ("on 
+ *  battery, battery is low") of every flag set into buffer, which is 
+ *  always null terminated.
+ *
+ *  \par Arguments:
+ *  \arg \c buffer - Destination buffer.
+ *  \arg \c size - size of buffer, including the terminator.
+ *  \arg \c flags - UPS_* flags to describe.
+ *  \arg \c brief - TRUE for the tokens, FALSE for the descriptions.
+ *
+ *  \return The number of characters written, not including the terminator.
+ */
+gint statusText(gchar *buffer, gint size, guint flags, gboolean brief)
+{
+    const gchar *word;
+    gint         len = 0;
+    gint         index;
+
+    if(size <= 0) return 0;
+    buffer[0] = '\0';
+
+    for(index = 0; statusFlags[index].token && (len < size - 1); index++) {
+        if(!(flags & statusFlags[index].flag)) continue;
+
+        word = brief ? statusFlags[index].token : statusFlags[index].text;
+        len += g_snprintf(buffer + len, size - len, "%s%s", len ? (brief ? " " : ", ") : "", word);
+        len  = MIN(len, size - 1);
+    }
+    return len;
+}
+
+/** Set the status flags and log message of a UPS.
+ *  upsd reports the status as a list of space seperated tokens such as "OL"
+ *  or "OB LB". Each token is looked up in statusFlags and every flag found 
+ *  is kept, the log message lists all of them. Unknown tokens are ignored.
+ *
+ *  \par Arguments:
+ *  \arg \c status - status structure to update.
+ *  \arg \c value - start of the tokens.
+ *  \arg \c len - length of the tokens, quotes are skipped like spaces.
+ */
+static void parseStatus(struct UPSData *status, gchar *value, gint len)
+{
+    gchar *end = value + len;
+    gchar *token;
+    gint   tokenLen;
+    gint   index;
+    guint  flags = 0;
+    gchar  log[MAX_LOGSIZE];
+
+    while(value < end) {
+        while((value < end) && ((*value == ' ') || (*value == '"'))) value++;
+        for(token = value; (value < end) && (*value != ' ') && (*value != '"'); value++);
+        if(value == token) break;
+        tokenLen = value - token;
+
+        for(index = 0; statusFlags[index].token; index++) {
+            if((strlen(statusFlags[index].token) == tokenLen) && !strncmp(statusFlags[index].token, token, tokenLen)) {
+                flags |= statusFlags[index].flag;
+                break;
+            }
+        }
+    }
+
+    status -> ups_Status = flags;
+    if(flags) {
+        strcpy(log, "UPS: ");
+        statusText(log + 5, sizeof(log) - 5, flags, FALSE);
+        setLastLog(status, log);
+    }
+}
+
+/** Current value of the monotonic clock in microseconds. 
+ *  All the client timing is done with this clock so that changes to the 
+ *  system time can not stall or hurry the polling.
+ */
+static gint64 monotonicUsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (gint64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/** Report a change in the status flags of a UPS to the transition callback.
+ *  Called straight after each status reply is parsed. An empty status is
+ *  not a transition, and the flags last reported survive a disconnection,
+ *  so reconnecting only reports anything if they changed in the meantime.
+ */
+static void checkTransition(UPSMonitor *monitor, const struct UPSData *status)
+{
+    UPSClient *client = monitor -> conn -> client;
+
+    if((status -> ups_Status == 0) || (status -> ups_Status == monitor -> lastStatus)) return;
+
+    if(client -> transition) {
+        client -> transition(monitor - client -> monitors, status -> ups_Name, monitor -> lastStatus,
+                             status -> ups_Status, monotonicUsec(), client -> notifyData);
+    }
+    monitor -> lastStatus = status -> ups_Status;
+}
+
+/** Store the value of a reading in a UPSData structure.
+ *  The value is scaled and clamped as its entry in upsVars says, and the
+ *  reading marked fetched. value points into the receive buffer, strtod()
+ *  stops at the end of the number.
+ */
+static void storeVar(struct UPSData *status, gint var, const gchar *value)
+{
+    const UPSVar *desc   = &upsVars[var];
+    gfloat        number = strtod(value, NULL) * desc -> scale;
+
+    *(gfloat *)((gchar *)status + desc -> offset) = CLAMP(number, desc -> min, desc -> max);
+    status -> ups_Fetched |= 1 << var;
+}
+
+/** Parse a single legacy reply line into a UPSData structure.
+ *  Replies arrive in the order the requests were sent, so the pending 
+ *  request at the head of the queue identifies the UPS and variable the 
+ *  line answers. Values are read straight out of the receive buffer.
+ *
+ *  \par Arguments:
+ *  \arg \c monitor - UPS the reply is for.
+ *  \arg \c status - status structure for that UPS.
+ *  \arg \c index - kind of reply, the VAR_* reading or REPLY_STATUS.
+ *  \arg \c line - the reply, as returned by nextLine().
+ *  \arg \c len - length of the reply.
+ */
+static void parseReply(UPSMonitor *monitor, struct UPSData *status, gint index, gchar *line, gint len)
+{
     gchar *value;
-    gfloat bLevel;
-
-    /* continue reading from the server unit we are told to stop or the server shuts down.
-     * (aside: This line was a bit of a problem - in testing the read() saturates the buffer
-     * for the first few calls, then the process settles down to returning 214 characters
-     * for each call to read() every second. This is fine, but if read() blocks until the 
-     * buffer is full on some machines then it could take MAX_LINELEN\214 seconds for the
-     * read to return - my temporary solution is to only use MAX_ENTRYSIZE bytes of temp
-     * with MAX_ENTRYSIZE set to 214. It's an ugly hack, but it seems to work.)
-     */
-    while(!haltThread) {
-        /* haltThread may have been set while blocked in the read, this is our Emergency Exit check.. */ 
-        if(haltThread) return;
-
-	write(upsStatus.ups_Socket, reqUtility, strlen(reqUtility));
-	readlen = read(upsStatus.ups_Socket, temp, MAX_ENTRYSIZE);
-	value = temp + strlen(reqUtility);
-	temp[readlen - 3] = temp[readlen - 2];
-	temp[readlen - 2] = 0;
-        upsStatus.in_Voltage = (float)strtol(value, NULL, 10) / 10.0;
-
-	write(upsStatus.ups_Socket, reqAcfreq, strlen(reqAcfreq));
-	readlen = read(upsStatus.ups_Socket, temp, MAX_ENTRYSIZE);
-	value = temp + strlen(reqAcfreq);
-	temp[readlen - 4] = temp[readlen - 3];
-	temp[readlen - 3] = temp[readlen - 2];
-	temp[readlen - 2] = 0;
-        upsStatus.out_Freq = (float)strtol(value, NULL, 10) / 100.0;
-
-	write(upsStatus.ups_Socket, reqBattpct, strlen(reqBattpct));
-	readlen = read(upsStatus.ups_Socket, temp, MAX_ENTRYSIZE);
-	value = temp + strlen(reqBattpct);
-	temp[readlen - 3] = temp[readlen - 2];
-	temp[readlen - 2] = 0;
-        bLevel = (float)strtol(value, NULL, 10) / 10.0;
-	if(bLevel > 100.0) bLevel = 100.0;
-	if(bLevel < 0.0)   bLevel = 0.0;
-	upsStatus.bat_Level = bLevel;
-
-	write(upsStatus.ups_Socket, reqLoadpct, strlen(reqLoadpct));
-	readlen = read(upsStatus.ups_Socket, temp, MAX_ENTRYSIZE);
-	value = temp + strlen(reqLoadpct);
-	temp[readlen - 3] = temp[readlen - 2];
-	temp[readlen - 2] = 0;
-        upsStatus.ups_Load = (float)strtol(value, NULL, 10) / 10.0;
-
-	write(upsStatus.ups_Socket, reqStatus, strlen(reqStatus));
-	readlen = read(upsStatus.ups_Socket, temp, MAX_ENTRYSIZE);
-	value = temp + strlen(reqStatus);
-
-	for(readpos = strlen(reqStatus); readpos < readlen; readpos++) {
-	    if(!strncmp(&temp[readpos], "OFF", 3))   setLastLog(&upsStatus, statusOFF);
-	    if(!strncmp(&temp[readpos], "OL", 2))    setLastLog(&upsStatus, statusOL);
-	    if(!strncmp(&temp[readpos], "OB", 2))    setLastLog(&upsStatus, statusOB);
-	    if(!strncmp(&temp[readpos], "LB", 2))    setLastLog(&upsStatus, statusLB);
-	    if(!strncmp(&temp[readpos], "CAL", 3))   setLastLog(&upsStatus, statusCAL);
-	    if(!strncmp(&temp[readpos], "TRIM", 4))  setLastLog(&upsStatus, statusTRIM);
-	    if(!strncmp(&temp[readpos], "BOOST", 5)) setLastLog(&upsStatus, statusBOOST);
-	    if(!strncmp(&temp[readpos], "OVER", 4))  setLastLog(&upsStatus, statusOVER);
-	    if(!strncmp(&temp[readpos], "RB", 2))    setLastLog(&upsStatus, statusRB);
-	    if(!strncmp(&temp[readpos], "FSD", 3))   setLastLog(&upsStatus, statusFSD);
-	}
-
-//	if(strlen(upsStatus.ups_LastLog) == 0) setLastLog(&upsStatus, gotUPS);
-	upsStatus.ups_Present = TRUE;
-	sleep(1);
-    }
-}
-
-/** Set up the connection to the upsd service and start the client routine.
- *  This obtains the address of the host running the upsd service (normally
- *  localhost, but in theory you could remotely monitor your ups from another
- *  machine with this..), attempts to conenct to it and if it manages it the
- *  upsClient() routine is used to read into the upsStatus structure.
- *
- *  \todo The host lookup, connection and other tcp/ip code is IPv4 dependant.
- *  While this is not a great problem now, it may be at some point in the 
- *  future (although right now IPv6 takeup seems to be painfully slow so it
- *  is likely to be quite some time!). Really the whole client should be
- *  protocol independant.
- */
-static int upsdConnect(gchar *hostname, guint port)
-{
-    struct sockaddr_in  servaddr; /* needed for connect */
-    struct hostent     *host;
-    struct in_addr    **addrPtr;
-    gchar *accumulator;  /* This contains the string in progress.. */
-    gchar *tempStore;    /* This is filled by read() */
-
-    resetStatus(&upsStatus);
-
-    /* Yeah, this will cause all manner of fun if it picks up an IPv6 record,
-     * but for now it'll do.. */
-    if((host = gethostbyname(hostname)) == NULL) {
-        strncpy(upsStatus.ups_LastLog, badHost, MIN(strlen(badHost), MAX_LOGSIZE));
-        return 0;
-    }
-
-    /* Allocate the main accumulator string, Bomb if this fails.. */
-    if((accumulator = (gchar *)malloc(MAX_LINESIZE)) == NULL) {
-        strncpy(upsStatus.ups_LastLog, noMem, MIN(strlen(noMem), MAX_LOGSIZE));
-        return 0;
-    }
-
-    /* Likewise for the temporary buffer */
-    if((tempStore = (gchar *)malloc(MAX_LINESIZE)) == NULL) {
-        strncpy(upsStatus.ups_LastLog, noMem, MIN(strlen(noMem), MAX_LOGSIZE));
-        free(accumulator);
-        return 0;
-    }
-
-    /* Attempt to connect to the service designated by port on the hosts obtained by the
-     * call to gethostbyname(). This breaks as soon as the first successful connection is
-     * established.
-     */
-    addrPtr = (struct in_addr **)host -> h_addr_list;
-    for(; *addrPtr != NULL; addrPtr ++) {
-        if((upsStatus.ups_Socket = socket(AF_INET, SOCK_STREAM, 0))) {
-            bzero(&servaddr, sizeof(servaddr));
-            servaddr.sin_family = AF_INET;
-            servaddr.sin_port = htons(port);
-            memcpy(&servaddr.sin_addr, *addrPtr, sizeof(struct in_addr));
-
-            if(connect(upsStatus.ups_Socket, (struct sockaddr *)&servaddr, sizeof(servaddr)) == 0)
-              break;
-
-            close(upsStatus.ups_Socket);
-            upsStatus.ups_Socket = 0;
+
+    if((value = replyValue(line, len, (index == REPLY_STATUS) ? "STATUS" : upsVars[index].legacy, monitor -> name)) == NULL) {
+        badReply(monitor -> conn, line, len);
+
+        /* Most likely an unknown UPS name if even the status request is refused */
+        if(index == REPLY_STATUS) {
+            status -> ups_Present = FALSE;
+            setLastLog(status, noUPS);
         }
+        return;
+    }
+
+    if(index == REPLY_STATUS) {
+        parseStatus(status, value, len - (value - line));
+        checkTransition(monitor, status);
+        status -> ups_Present = TRUE;
+    } else {
+        storeVar(status, index, value);
+    }
+}
+
+/** Split the next space seperated word off a reply line.
+ *  Returns a pointer to the word and sets wordLen to its length, or returns
+ *  NULL if there are no more words before end.
+ */
+static gchar *nextWord(gchar **pos, gchar *end, gint *wordLen)
+{
+    gchar *word;
+
+    while((*pos < end) && (**pos == ' ')) (*pos)++;
+    if(*pos == end) return NULL;
+
+    word = *pos;
+    while((*pos < end) && (**pos != ' ')) (*pos)++;
+    *wordLen = *pos - word;
+    return word;
+}
+
+/** Check whether a word from a reply line matches a string. */
+static gboolean wordIs(gchar *word, gint wordLen, const gchar *str)
+{
+    return (wordLen == strlen(str)) && !strncmp(word, str, wordLen);
+}
+
+/** Parse a VAR line into a UPSData structure.
+ *  Both GET VAR and LIST VAR answer with lines of the form
+ *  VAR <ups> <variable> "<value>". The value is read straight out of the 
+ *  receive buffer - the closing quote is enough to stop strtod().
+ *
+ *  \par Arguments:
+ *  \arg \c monitor - UPS the reply is for.
+ *  \arg \c status - status structure for that UPS.
+ *  \arg \c line - the reply, as returned by nextLine().
+ *  \arg \c len - length of the reply.
+ */
+static void parseVar(UPSMonitor *monitor, struct UPSData *status, gchar *line, gint len)
+{
+    gchar  *pos = line + 4; /* skip "VAR " */
+    gchar  *end = line + len;
+    gchar  *word;
+    gchar  *value;
+    gint    wordLen;
+    gint    index;
+
+    /* Check the UPS name then find the variable */
+    if(((word = nextWord(&pos, end, &wordLen)) == NULL) || !wordIs(word, wordLen, monitor -> name) ||
+       ((word = nextWord(&pos, end, &wordLen)) == NULL)) {
+        monitor -> conn -> health.parseErrors++;
+        return;
+    }
+
+    while((pos < end) && (*pos != '"')) pos++;
+    if(pos == end) {
+        monitor -> conn -> health.parseErrors++;
+        return;
+    }
+    value = pos + 1;
+
+    if(wordIs(word, wordLen, "ups.status")) {
+        parseStatus(status, value, end - value);
+        checkTransition(monitor, status);
+        return;
+    }
+
+    for(index = 0; index < VAR_COUNT; index++) {
+        if(wordIs(word, wordLen, upsVars[index].name)) {
+            storeVar(status, index, value);
+            return;
+        }
+    }
+
+    for(index = 0; index < INFO_COUNT; index++) {
+        if(wordIs(word, wordLen, upsInfo[index].name)) {
+            for(pos = value; (pos < end) && (*pos != '"'); pos++);
+            wordLen = MIN(pos - value, MAX_INFO - 1);
+            memcpy((gchar *)status + upsInfo[index].offset, value, wordLen);
+            ((gchar *)status + upsInfo[index].offset)[wordLen] = '\0';
+            return;
+        }
+    }
+}
+
+/** Handle one line of the reply to a LIST request.
+ *  LIST replies take the form BEGIN LIST ..., any number of data lines and 
+ *  then END LIST ..., or a single ERR line if the request failed.
+ *
+ *  \par Arguments:
+ *  \arg \c conn - connection the reply arrived on.
+ *  \arg \c req - the request being answered.
+ *  \arg \c line - the reply, as returned by nextLine().
+ *  \arg \c len - length of the reply.
+ *
+ *  \return TRUE once the reply is complete.
+ */
+static gboolean parseListLine(UPSConnection *conn, PendingRequest *req, gchar *line, gint len)
+{
+    UPSClient      *client = conn -> client;
+    struct UPSData *status = &client -> upsStatus[req -> ups];
+    gchar          *pos    = line + 4; /* skip "UPS " */
+    gchar          *word;
+    gint            wordLen;
+    gint            index;
+
+    if(!strncmp(line, "ERR ", 4)) {
+        badReply(conn, line, len);
+        status -> ups_Present = FALSE;
+        setLastLog(status, noUPS);
+        return TRUE;
+    }
+    if(!strncmp(line, "END ", 4)) {
+        if(req -> reply == REPLY_LISTVAR) status -> ups_Present = TRUE;
+        return TRUE;
+    }
+
+    if((req -> reply == REPLY_LISTVAR) && !strncmp(line, "VAR ", 4)) {
+        parseVar(&client -> monitors[req -> ups], status, line, len);
+    } else if((req -> reply == REPLY_LISTUPS) && !strncmp(line, "UPS ", 4)) {
+        /* The first UPS listed becomes the default for any UPS given without a name */
+        if((word = nextWord(&pos, line + len, &wordLen)) && (wordLen < MAX_UPSNAME)) {
+            for(index = 0; index < conn -> upsCount; index++) {
+                if(client -> monitors[conn -> ups[index]].name[0] == '\0') {
+                    strncpy(client -> monitors[conn -> ups[index]].name, word, wordLen);
+                    client -> monitors[conn -> ups[index]].name[wordLen] = '\0';
+                }
+            }
+        }
+    } else if(strncmp(line, "BEGIN ", 6)) {
+        conn -> health.parseErrors++;
+    }
+    return FALSE;
+}
+
+/** Handle the reply to a GET VAR request.
+ *  The reply is a single VAR line, or an ERR line if upsd does not know the
+ *  variable or the UPS. A UPS need not support every reading, so only the
+ *  reply to the ups.status request decides whether the UPS is there.
+ */
+static void parseGetReply(UPSConnection *conn, PendingRequest *req, gchar *line, gint len)
+{
+    UPSClient      *client = conn -> client;
+    struct UPSData *status = &client -> upsStatus[req -> ups];
+
+    if(!strncmp(line, "VAR ", 4)) {
+        parseVar(&client -> monitors[req -> ups], status, line, len);
+        if(req -> reply == REPLY_GETSTATUS) status -> ups_Present = TRUE;
+        return;
+    }
+
+    badReply(conn, line, len);
+    if(req -> reply == REPLY_GETSTATUS) {
+        status -> ups_Present = FALSE;
+        setLastLog(status, noUPS);
+    }
+}
+
+/** Convert an absolute monotonic time into a poll() timeout.
+ *  The result is rounded up so that poll() never returns before 'when'.
+ */
+static int waitMsec(gint64 now, gint64 when)
+{
+    if(when <= now) return 0;
+    return (int)((when - now + 999) / 1000);
+}
+
+/** Put a descriptor into non-blocking mode. */
+static int setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if(flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/** Return a short description of a connection state, for display. */
+const gchar *connStateText(gint state)
+{
+    switch(state) {
+        case CONN_RESOLVING:  return "looking up";
+        case CONN_CONNECTING: return "connecting";
+        case CONN_CONNECTED:  return "connected";
+        case CONN_BACKOFF:    return "retrying";
+    }
+    return "failed";
+}
+
+/** Move a connection to a new state.
+ *  The state (and log, if given) of every UPS served by the connection is
+ *  updated and published so the panel always shows what is going on.
+ */
+static void setConnState(UPSConnection *conn, gint state, const gchar *log)
+{
+    UPSClient *client = conn -> client;
+    gint       index;
+
+    conn -> state = state;
+    for(index = 0; index < conn -> upsCount; index++) {
+        client -> upsStatus[conn -> ups[index]].ups_ConnState = state;
+        if(log) setLastLog(&client -> upsStatus[conn -> ups[index]], log);
+        publishStatus(client, conn -> ups[index], FALSE);
     }
+}
+
+/** Look up the addresses of a host.
+ *  Runs in its own detached thread so that a slow DNS server can not hold up
+ *  the client. Once getaddrinfo() returns the client is woken through the
+ *  wakeup pipe, unless it has abandoned the lookup in the meantime in which 
+ *  case the lookup is simply thrown away. The lookup has its own copy of the
+ *  pipe, which keeps it open should the client be freed in the meantime.
+ */
+static void *resolveThread(void *arg)
+{
+    Resolver       *res    = (Resolver *)arg;
+    int             wakeFd = res -> wakeFd;
+    struct addrinfo hints;
+    gchar           port[8];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_ADDRCONFIG;
+    g_snprintf(port, sizeof(port), "%d", res -> port);
+
+    res -> error = getaddrinfo(res -> hostname, port, &hints, &res -> result);
+
+    if(__atomic_exchange_n(&res -> state, RESOLVE_DONE, __ATOMIC_ACQ_REL) == RESOLVE_ABANDONED) {
+        if(res -> result) freeaddrinfo(res -> result);
+        free(res);
+    } else {
+        write(wakeFd, "", 1);
+    }
+    close(wakeFd);
+    return NULL;
+}
+
+/** Forget about the lookup in progress on a connection, if any.
+ *  Whichever of the client and resolver thread finishes with the Resolver
+ *  last frees it.
+ */
+static void abandonResolve(UPSConnection *conn)
+{
+    Resolver *res = conn -> resolver;
+
+    if(res == NULL) return;
+    conn -> resolver = NULL;
+
+    if(__atomic_exchange_n(&res -> state, RESOLVE_ABANDONED, __ATOMIC_ACQ_REL) == RESOLVE_DONE) {
+        if(res -> result) freeaddrinfo(res -> result);
+        free(res);
+    }
+}
+
+/** Close every socket of a connection, connected or still connecting. */
+static void closeSockets(UPSConnection *conn)
+{
+    gint index;
+
+    if(conn -> socket >= 0) close(conn -> socket);
+    conn -> socket = -1;
 
-    /* Deligate the actual communication work to the client code if a connection has
-     * been established. 
+    for(index = 0; index < MAX_ADDRS; index++) {
+        if(conn -> attempts[index] >= 0) close(conn -> attempts[index]);
+        conn -> attempts[index] = -1;
+    }
+}
+
+/** Give up on a connection for now.
+ *  The sockets are closed and every UPS served by the connection is marked as
+ *  not present, with its readings cleared and the reason as its log message. 
+ *  The connection is retried after a jittered, exponentially growing delay
+ *  (unless it never got its buffers, in which case it is given up for good).
+ *  The other connections carry on regardless.
+ */
+static void dropConnection(UPSConnection *conn, const gchar *reason)
+{
+    UPSClient      *client = conn -> client;
+    struct UPSData *status;
+    gchar           log[MAX_LOGSIZE];
+    gint64          delay;
+    guint           sequence;
+    gint            index;
+
+    closeSockets(conn);
+    abandonResolve(conn);
+    conn -> outLen    = 0;
+    conn -> pendCount = 0;
+
+    for(index = 0; index < conn -> upsCount; index++) {
+        status   = &client -> upsStatus[conn -> ups[index]];
+        sequence = status -> ups_Sequence;
+        resetStatus(status);
+        status -> ups_Sequence = sequence;
+    }
+
+    if(conn -> pendSize == 0) {
+        setConnState(conn, CONN_FAILED, reason);
+        return;
+    }
+
+    /* Half the delay is fixed and half random, so that clients which all lost
+     * the same server don't all come back at the same moment.
      */
-    if(*addrPtr != NULL) {
-        upsClient(accumulator, tempStore);
+    delay = MIN((gint64)BACKOFF_MIN << MIN(conn -> failures, 16), BACKOFF_MAX);
+    delay = delay / 2 + rand_r(&client -> backoffSeed) % (delay / 2 + 1);
+    conn -> failures++;
+    conn -> deadline = monotonicUsec() + delay * 1000;
+
+    g_snprintf(log, sizeof(log), "%s, retrying in %d s", reason, (gint)((delay + 999) / 1000));
+    setConnState(conn, CONN_BACKOFF, log);
+}
+
+/** Start looking up the addresses of a host.
+ *  The lookup is done by resolveThread(), finishResolve() picks up the result.
+ */
+static void startResolve(UPSConnection *conn, gint64 now)
+{
+    pthread_attr_t attr;
+    pthread_t      tid;
+    Resolver      *res;
+    gint           error;
+
+    if((res = (Resolver *)calloc(1, sizeof(Resolver))) == NULL) {
+        dropConnection(conn, noMem);
+        return;
+    }
+    strcpy(res -> hostname, conn -> hostname);
+    res -> port   = conn -> port;
+    res -> state  = RESOLVE_BUSY;
+    if((res -> wakeFd = dup(conn -> client -> wakeFds[1])) < 0) {
+        free(res);
+        dropConnection(conn, noMem);
+        return;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    error = pthread_create(&tid, &attr, resolveThread, res);
+    pthread_attr_destroy(&attr);
+
+    if(error) {
+        close(res -> wakeFd);
+        free(res);
+        dropConnection(conn, noMem);
+        return;
+    }
+
+    conn -> resolver = res;
+    conn -> deadline = now + REQUEST_TIMEOUT * 1000;
+    setConnState(conn, CONN_RESOLVING, lookupHost);
+}
+
+/** Start a non-blocking connect to the next address of a host.
+ *  Addresses which fail straight away are skipped. Once a connect is in 
+ *  progress the next address is raced against it after CONNECT_RACE_DELAY,
+ *  so one dead address (typically IPv6 on a host without a route) does not
+ *  hold up the others. Returns TRUE if a connect completed immediately, in
+ *  which case the socket has been put in conn -> socket.
+ */
+static gboolean raceConnect(UPSConnection *conn, gint64 now)
+{
+    struct sockaddr *addr;
+    int              sock;
+    gint             slot;
+
+    while(conn -> addrNext < conn -> addrCount) {
+        slot = conn -> addrNext++;
+        addr = (struct sockaddr *)&conn -> addrs[slot];
+
+        if((sock = socket(addr -> sa_family, SOCK_STREAM, 0)) < 0) continue;
+
+        if(setNonBlocking(sock) == 0) {
+            if(connect(sock, addr, conn -> addrLens[slot]) == 0) {
+                conn -> socket = sock;
+                return TRUE;
+            }
+            if(errno == EINPROGRESS) {
+                conn -> attempts[slot] = sock;
+                conn -> nextAttempt    = now + CONNECT_RACE_DELAY * 1000;
+                return FALSE;
+            }
+        }
+        close(sock);
+    }
+    conn -> nextAttempt = NEVER;
+    return FALSE;
+}
+
+/** Check whether any connect of a connection is still in progress. */
+static gboolean connectPending(UPSConnection *conn)
+{
+    gint index;
+
+    for(index = 0; index < conn -> addrCount; index++) {
+        if(conn -> attempts[index] >= 0) return TRUE;
+    }
+    return conn -> addrNext < conn -> addrCount;
+}
+
+/** Start polling on a freshly connected socket.
+ *  Any connects still racing are abandoned.
+ */
+static void connected(UPSConnection *conn, gint64 now)
+{
+    gint index;
+
+    for(index = 0; index < MAX_ADDRS; index++) {
+        if((conn -> attempts[index] >= 0) && (conn -> attempts[index] != conn -> socket)) {
+            close(conn -> attempts[index]);
+        }
+        conn -> attempts[index] = -1;
+    }
+
+    conn -> in.start  = 0;
+    conn -> in.end    = 0;
+    conn -> pendHead  = 0;
+    conn -> pendCount = 0;
+    conn -> outLen    = 0;
+    conn -> nextPoll  = now;
+
+    /* Everything is fetched again on a new connection, the UPS may have changed */
+    for(index = 0; index < conn -> upsCount; index++) {
+        memset(conn -> client -> monitors[conn -> ups[index]].due, 0, sizeof(conn -> client -> monitors[0].due));
+        conn -> client -> monitors[conn -> ups[index]].infoKnown = FALSE;
+    }
+
+    if(conn -> connectedBefore) conn -> health.reconnects++;
+    conn -> connectedBefore = TRUE;
+    setConnState(conn, CONN_CONNECTED, gotUPS);
+}
+
+/** Start connecting to the addresses found by a lookup.
+ *  The addresses are interleaved by family, starting with the family of the
+ *  first one returned, so the connect race alternates between IPv6 and IPv4.
+ */
+static void startConnect(UPSConnection *conn, struct addrinfo *result, gint64 now)
+{
+    struct addrinfo *ai;
+    struct addrinfo *next[2];
+    gint             family;
+
+    next[0] = next[1] = NULL;
+    for(ai = result; ai; ai = ai -> ai_next) {
+        family = (ai -> ai_family == result -> ai_family) ? 0 : 1;
+        if(next[family] == NULL) next[family] = ai;
+    }
+
+    conn -> addrCount = 0;
+    conn -> addrNext  = 0;
+    for(family = 0; (next[0] || next[1]) && (conn -> addrCount < MAX_ADDRS); family ^= 1) {
+        if((ai = next[family]) == NULL) continue;
+
+        if(ai -> ai_addrlen <= sizeof(struct sockaddr_storage)) {
+            memcpy(&conn -> addrs[conn -> addrCount], ai -> ai_addr, ai -> ai_addrlen);
+            conn -> addrLens[conn -> addrCount++] = ai -> ai_addrlen;
+        }
+
+        /* Move on to the next address of the same family */
+        for(ai = ai -> ai_next; ai && ((ai -> ai_family == result -> ai_family) != (family == 0)); ai = ai -> ai_next);
+        next[family] = ai;
+    }
+
+    conn -> deadline = now + REQUEST_TIMEOUT * 1000;
+    setConnState(conn, CONN_CONNECTING, connHost);
+
+    if(raceConnect(conn, now)) {
+        connected(conn, now);
+    } else if(!connectPending(conn)) {
+        dropConnection(conn, badConn);
+    }
+}
+
+/** Pick up the result of a finished lookup. */
+static void finishResolve(UPSConnection *conn, gint64 now)
+{
+    Resolver *res = conn -> resolver;
+
+    conn -> resolver = NULL;
+    if(res -> error || (res -> result == NULL)) {
+        dropConnection(conn, badHost);
+    } else {
+        startConnect(conn, res -> result, now);
+    }
+
+    if(res -> result) freeaddrinfo(res -> result);
+    free(res);
+}
+
+/** Complete one of the connects started by raceConnect().
+ *  Called once its socket becomes writable. The first connect to succeed
+ *  wins, if one fails the next address is tried straight away.
+ */
+static void finishConnect(UPSConnection *conn, gint slot, gint64 now)
+{
+    int       error;
+    socklen_t errlen = sizeof(error);
+    int       sock   = conn -> attempts[slot];
+
+    if((getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errlen) == 0) && (error == 0)) {
+        conn -> socket = sock;
+        connected(conn, now);
+        return;
+    }
+    close(sock);
+    conn -> attempts[slot] = -1;
+
+    if(raceConnect(conn, now)) {
+        connected(conn, now);
+    } else if(!connectPending(conn)) {
+        dropConnection(conn, badConn);
+    }
+}
+
+/** Add a request to the pending queue of a connection.
+ *  The request line must already be in the output buffer.
+ */
+static void addPending(UPSConnection *conn, gint ups, gint reply, gint64 now)
+{
+    PendingRequest *req = &conn -> pending[(conn -> pendHead + conn -> pendCount) % conn -> pendSize];
+
+    req -> ups      = ups;
+    req -> reply    = reply;
+    req -> sent     = now;
+    req -> deadline = now + REQUEST_TIMEOUT * 1000;
+    conn -> pendCount++;
+}
+
+/** Pick the wanted readings of a UPS which are due, and schedule their next fetch.
+ *  Returns a mask of VAR_* bits. Readings with a refresh interval are due
+ *  again that long after this cycle, REFRESH_ONCE ones not until the next
+ *  connection, see connected(). Unwanted readings are zeroed by queueCycle(),
+ *  so they are due as soon as they are wanted again.
+ */
+static guint32 dueReadings(UPSMonitor *monitor, guint32 wanted, gint64 now)
+{
+    guint32 due = 0;
+    gint    index;
+
+    for(index = 0; index < VAR_COUNT; index++) {
+        if(!(wanted & (1 << index))) {
+            monitor -> due[index] = 0;
+            continue;
+        }
+        if(monitor -> due[index] > now) continue;
+
+        due |= 1 << index;
+        if(upsVars[index].refresh == REFRESH_ONCE) {
+            monitor -> due[index] = NEVER;
+        } else {
+            monitor -> due[index] = now + (gint64)upsVars[index].refresh * 1000 - REFRESH_SLACK;
+        }
+    }
+    return due;
+}
+
+/** Queue the requests for a poll cycle on a connection.
+ *  The requests for every UPS served by the connection are appended to the 
+ *  output buffer (they are actually sent by flushRequests() once the socket 
+ *  is writable) and each one is given a deadline by which its reply must 
+ *  have arrived. Only the readings wanted for each UPS (see setWantedVars())
+ *  and due (see dueReadings()) are asked for, the others wanted keep their
+ *  last values and the rest are cleared. The status is fetched every cycle.
+ *  The legacy protocol needs a request for each variable. The LIST protocol
+ *  needs a single LIST VAR for each UPS when every reading is due, otherwise
+ *  a GET VAR for each one (and the information strings, the first time) is
+ *  less for upsd to send and for us to parse.
+ */
+static void queueCycle(UPSConnection *conn, gint64 now)
+{
+    UPSClient  *client = conn -> client;
+    UPSMonitor *monitor;
+    gboolean    unnamed = FALSE;
+    guint32     wanted;
+    guint32     due;
+    gint        ups;
+    gint        index;
+
+    for(ups = 0; ups < conn -> upsCount; ups++) {
+        monitor = &client -> monitors[conn -> ups[ups]];
+        wanted  = __atomic_load_n(&monitor -> wanted, __ATOMIC_RELAXED);
+        clearReadings(&client -> upsStatus[conn -> ups[ups]], ~wanted);
+        due     = dueReadings(monitor, wanted, now);
+
+        if(conn -> protocol == PROTOCOL_LEGACY) {
+            for(index = 0; index < REPLY_COUNT; index++) {
+                if((index < VAR_COUNT) && ((upsVars[index].legacy == NULL) || !(due & (1 << index)))) continue;
+                if(conn -> pendCount == conn -> pendSize) return;
+
+                conn -> outLen += g_snprintf(conn -> out + conn -> outLen, conn -> outSize - conn -> outLen,
+                                             monitor -> name[0] ? "REQ %s@%s\n" : "REQ %s\n", 
+                                             (index == REPLY_STATUS) ? "STATUS" : upsVars[index].legacy, monitor -> name);
+                addPending(conn, conn -> ups[ups], index, now);
+            }
+        } else if(monitor -> name[0] == '\0') {
+            /* The LIST protocol needs a UPS name, ask for one first */
+            if(!unnamed && (conn -> pendCount < conn -> pendSize)) {
+                conn -> outLen += g_snprintf(conn -> out + conn -> outLen, conn -> outSize - conn -> outLen, "LIST UPS\n");
+                addPending(conn, conn -> ups[ups], REPLY_LISTUPS, now);
+            }
+            unnamed = TRUE;
+        } else if(due != VAR_ALL) {
+            for(index = 0; !monitor -> infoKnown && (index < INFO_COUNT); index++) {
+                if(conn -> pendCount == conn -> pendSize) return;
+
+                conn -> outLen += g_snprintf(conn -> out + conn -> outLen, conn -> outSize - conn -> outLen,
+                                             "GET VAR %s %s\n", monitor -> name, upsInfo[index].name);
+                addPending(conn, conn -> ups[ups], REPLY_GETVAR, now);
+            }
+            monitor -> infoKnown = TRUE;
+
+            for(index = 0; index < REPLY_COUNT; index++) {
+                if((index < VAR_COUNT) && !(due & (1 << index))) continue;
+                if(conn -> pendCount == conn -> pendSize) return;
+
+                conn -> outLen += g_snprintf(conn -> out + conn -> outLen, conn -> outSize - conn -> outLen,
+                                             "GET VAR %s %s\n", monitor -> name,
+                                             (index == REPLY_STATUS) ? "ups.status" : upsVars[index].name);
+                addPending(conn, conn -> ups[ups], (index == REPLY_STATUS) ? REPLY_GETSTATUS : REPLY_GETVAR, now);
+            }
+        } else if(conn -> pendCount < conn -> pendSize) {
+            conn -> outLen += g_snprintf(conn -> out + conn -> outLen, conn -> outSize - conn -> outLen,
+                                         "LIST VAR %s\n", monitor -> name);
+            addPending(conn, conn -> ups[ups], REPLY_LISTVAR, now);
+            monitor -> infoKnown = TRUE;
+        }
+    }
+    conn -> cycleStart = now;
+}
+
+/** Write as much of the queued request data as the socket will take.
+ *  Returns -1 if the connection has failed.
+ */
+static gint flushRequests(UPSConnection *conn)
+{
+    gint written = write(conn -> socket, conn -> out, conn -> outLen);
+
+    if(written < 0) {
+        return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+    }
+    conn -> outLen -= written;
+    memmove(conn -> out, conn -> out + written, conn -> outLen);
+    return 0;
+}
+
+/** Pick the poll interval of a connection from the status of its UPSes.
+ *  Returns the interval in microseconds, the shortest needed by any UPS 
+ *  served by the connection.
+ */
+static gint64 pollInterval(UPSConnection *conn)
+{
+    UPSClient *client = conn -> client;
+    guint      flags  = 0;
+    gint       interval;
+    gint       index;
+
+    for(index = 0; index < conn -> upsCount; index++) {
+        flags |= client -> upsStatus[conn -> ups[index]].ups_Status;
+    }
+
+    if(flags & (UPS_LB | UPS_OVER | UPS_FSD)) {
+        interval = client -> pollPolicy.alertInterval;
+    } else if(flags & (UPS_OB | UPS_DISCHRG)) {
+        interval = client -> pollPolicy.batteryInterval;
+    } else {
+        interval = client -> pollPolicy.lineInterval;
+    }
+    return (gint64)MAX(interval, MIN_POLL_INTERVAL) * 1000;
+}
+
+/** Read whatever upsd has sent and parse every complete reply.
+ *  Replies are matched against the oldest outstanding request, anything 
+ *  arriving when no request is outstanding is ignored (and counted as a
+ *  parse error). The round trip of each request is added to the histogram
+ *  of the connection once its reply is complete. A line too long for the
+ *  buffer can never be parsed, so it fails the connection straight away
+ *  (counted as a parse error) rather than waiting for the request to time
+ *  out. Returns -1 if the connection has been closed or has failed.
+ */
+static gint readReplies(UPSConnection *conn)
+{
+    UPSClient      *client = conn -> client;
+    PendingRequest *req;
+    gint64 now;
+    gint   readlen;
+    gint   len;
+    gint   index;
+    gchar *line;
+
+    readlen = fillBuffer(&conn -> in, conn -> socket);
+    if(readlen == 0) return -1;
+    if(readlen < 0) {
+        if(errno == EMSGSIZE) conn -> health.parseErrors++;
+        return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+    }
+    now = monotonicUsec();
+
+    while((line = nextLine(&conn -> in, &len)) != NULL) {
+        if(conn -> pendCount == 0) {
+            conn -> health.parseErrors++;
+            continue;
+        }
+
+        req = &conn -> pending[conn -> pendHead];
+        if(req -> reply < REPLY_COUNT) {
+            parseReply(&client -> monitors[req -> ups], &client -> upsStatus[req -> ups], req -> reply, line, len);
+        } else if(req -> reply >= REPLY_GETVAR) {
+            parseGetReply(conn, req, line, len);
+        } else if(!parseListLine(conn, req, line, len)) {
+            continue;
+        }
+        recordRtt(&conn -> health, now - req -> sent);
+        conn -> pendHead = (conn -> pendHead + 1) % conn -> pendSize;
+        conn -> pendCount--;
+
+        if(conn -> pendCount == 0) {
+            gint64 interval = pollInterval(conn);
+
+            for(index = 0; index < conn -> upsCount; index++) {
+                client -> upsStatus[conn -> ups[index]].ups_PollTime = now - conn -> cycleStart;
+                publishStatus(client, conn -> ups[index], TRUE);
+            }
+            conn -> failures = 0;
+
+            /* Schedule from when this cycle was due rather than from now, so
+             * the period does not drift. A cycle which overran its slot skips
+             * the missed ones instead of trying to catch up.
+             */
+            conn -> nextPoll += interval;
+            if(conn -> nextPoll <= now) {
+                conn -> nextPoll += ((now - conn -> nextPoll) / interval + 1) * interval;
+            }
+        }
+    }
+    return 0;
+}
+
+/** Run the timers of a connection.
+ *  Starts a new poll cycle when one is due, drops the connection if a lookup,
+ *  connect or reply is overdue and starts again once a backoff delay is over.
+ *
+ *  \return the monotonic time at which the connection next needs attention.
+ */
+static gint64 connectionTimers(UPSConnection *conn, gint64 now)
+{
+    switch(conn -> state) {
+        case CONN_RESOLVING:
+            if(__atomic_load_n(&conn -> resolver -> state, __ATOMIC_ACQUIRE) == RESOLVE_DONE) {
+                finishResolve(conn, now);
+                return now;
+            }
+            if(now < conn -> deadline) return conn -> deadline;
+            dropConnection(conn, badHost);
+            return now;
+
+        case CONN_CONNECTING:
+            if(now >= conn -> deadline) {
+                dropConnection(conn, connTimeout);
+                return now;
+            }
+            if((now >= conn -> nextAttempt) && raceConnect(conn, now)) {
+                connected(conn, now);
+                return now;
+            }
+            return MIN(conn -> deadline, conn -> nextAttempt);
+
+        case CONN_CONNECTED:
+            if((conn -> pendCount == 0) && (now >= conn -> nextPoll)) queueCycle(conn, now);
+            if(conn -> pendCount == 0) return conn -> nextPoll;
+            if(now < conn -> pending[conn -> pendHead].deadline) return conn -> pending[conn -> pendHead].deadline;
+            conn -> health.timeouts++;
+            dropConnection(conn, noReply);
+            return now;
+
+        case CONN_BACKOFF:
+            if(now < conn -> deadline) return conn -> deadline;
+            startResolve(conn, now);
+            return now;
+    }
+    return NEVER;
+}
+
+/** Poll every upsd server of a client and parse the replies into upsStatus.
+ *  The actual client work is done by this routine, a single thread looks 
+ *  after the connections to all the upsd servers. Rather than waiting for
+ *  each answer before sending the next request, every request for a poll 
+ *  cycle on a connection is sent with a single write (upsd answers them in
+ *  order) and the replies are then taken from the receive buffer as complete 
+ *  lines arrive, however the server or network happens to split or merge 
+ *  them. This means a poll cycle costs one network round trip instead of one
+ *  per variable, which matters a great deal when upsd is on the far side of 
+ *  a slow link. The time taken by each cycle is stored in ups_PollTime.
+ *
+ *  All the sockets are non-blocking and the only place the thread ever 
+ *  sleeps is the poll() at the top of the loop, which also watches the 
+ *  wakeup pipe. haltClient() can therefore stop the thread at once, however 
+ *  badly the servers are behaving. Host lookups run in throwaway threads
+ *  (see resolveThread()) which also use the pipe to wake the client. A 
+ *  connection which fails, or whose replies miss their deadlines, is dropped
+ *  and tried again later (see dropConnection()) without affecting the others.
+ *
+ *  Each connection has MAX_ADDRS entries in the poll set: the connected 
+ *  socket uses the first, while connecting there is one for each address 
+ *  being raced.
+ */
+static void upsClient(UPSClient *client)
+{
+    struct pollfd *fds;
+    struct pollfd *slots;
+    UPSConnection *conn;
+    gchar  drain[16];
+    gint64 now;
+    gint64 wake;
+    gint   index;
+    gint   slot;
+
+    if((fds = (struct pollfd *)calloc(client -> hostCount * MAX_ADDRS + 1, sizeof(struct pollfd))) == NULL) {
+        for(index = 0; index < client -> hostCount; index++) {
+            client -> hosts[index] -> pendSize = 0;
+            dropConnection(client -> hosts[index], noMem);
+        }
+        return;
+    }
+
+    for(;;) {
+        now  = monotonicUsec();
+        wake = NEVER;
+
+        fds[0].fd      = client -> wakeFds[0];
+        fds[0].events  = POLLIN;
+        fds[0].revents = 0;
+
+        for(index = 0; index < client -> hostCount; index++) {
+            conn  = client -> hosts[index];
+            slots = &fds[index * MAX_ADDRS + 1];
+            wake  = MIN(wake, connectionTimers(conn, now));
+
+            for(slot = 0; slot < MAX_ADDRS; slot++) {
+                slots[slot].fd      = -1;
+                slots[slot].events  = 0;
+                slots[slot].revents = 0;
+                if(conn -> state == CONN_CONNECTING) {
+                    slots[slot].fd     = conn -> attempts[slot];
+                    slots[slot].events = POLLOUT;
+                }
+            }
+            if(conn -> state == CONN_CONNECTED) {
+                slots[0].fd     = conn -> socket;
+                slots[0].events = POLLIN | (conn -> outLen ? POLLOUT : 0);
+            }
+        }
+
+        if((poll(fds, client -> hostCount * MAX_ADDRS + 1, (wake == NEVER) ? -1 : waitMsec(now, wake)) < 0) && (errno != EINTR)) break;
+
+        if(fds[0].revents) {
+            while(read(client -> wakeFds[0], drain, sizeof(drain)) > 0);
+            if(__atomic_load_n(&client -> stopClient, __ATOMIC_ACQUIRE)) break;
+        }
+
+        now = monotonicUsec();
+        for(index = 0; index < client -> hostCount; index++) {
+            conn  = client -> hosts[index];
+            slots = &fds[index * MAX_ADDRS + 1];
+
+            if(conn -> state == CONN_CONNECTING) {
+                for(slot = 0; (slot < MAX_ADDRS) && (conn -> state == CONN_CONNECTING); slot++) {
+                    if(slots[slot].revents && (conn -> attempts[slot] >= 0)) finishConnect(conn, slot, now);
+                }
+                continue;
+            }
+            if((conn -> state != CONN_CONNECTED) || !slots[0].revents) continue;
+
+            if((slots[0].revents & POLLOUT) && (flushRequests(conn) < 0)) {
+                dropConnection(conn, disconHost);
+                continue;
+            }
+            if((slots[0].revents & (POLLIN | POLLHUP | POLLERR)) && (readReplies(conn) < 0)) {
+                dropConnection(conn, disconHost);
+            }
+        }
+    }
+
+    free(fds);
+}
+
+/** Free a client along with its connections and wakeup pipe.
+ *  Must only be called when the client thread is not running.
+ */
+static void freeClient(UPSClient *client)
+{
+    gint index;
+
+    for(index = 0; index < client -> hostCount; index++) {
+        closeSockets(client -> hosts[index]);
+        abandonResolve(client -> hosts[index]);
+        free(client -> hosts[index] -> out);
+        free(client -> hosts[index] -> pending);
+        free(client -> hosts[index]);
+    }
+    if(client -> wakeFds[0] >= 0) close(client -> wakeFds[0]);
+    if(client -> wakeFds[1] >= 0) close(client -> wakeFds[1]);
+    free(client);
+}
+
+/** Split a UPS specification into its parts.
+ *  Specifications take the usual NUT form of [upsname@]hostname[:port], 
+ *  where an IPv6 address may be given in square brackets. The UPS name is
+ *  left empty if none is given, which asks upsd for its default UPS. A port
+ *  must be a number from 1 to 65535.
+ *
+ *  \return FALSE if the specification is unusable.
+ */
+static gboolean parseSpec(const gchar *spec, gchar *name, gchar *hostname, gint *port)
+{
+    const gchar *host = spec;
+    const gchar *at   = strchr(spec, '@');
+    const gchar *end;
+    const gchar *colon;
+    gchar       *stop;
+    glong        number;
+
+    name[0] = '\0';
+    if(at) {
+        if(at - spec >= MAX_UPSNAME) return FALSE;
+        strncpy(name, spec, at - spec);
+        name[at - spec] = '\0';
+        host = at + 1;
+    }
+
+    if(*host == '[') {
+        host++;
+        if((end = strchr(host, ']')) == NULL) return FALSE;
+        colon = (end[1] == ':') ? end + 1 : NULL;
     } else {
-        upsStatus.ups_Socket = 0;
-        pthread_mutex_lock(&upsStatus_lock);
-        strcpy(upsStatus.ups_LastLog, badConn);
-        pthread_mutex_unlock(&upsStatus_lock);
+        /* A lone colon separates the port, more than one means a bare IPv6 address */
+        colon = strchr(host, ':');
+        if(colon && strchr(colon + 1, ':')) colon = NULL;
+        end = colon ? colon : host + strlen(host);
     }
 
-    if(upsStatus.ups_Socket) {
-        close(upsStatus.ups_Socket);
-        upsStatus.ups_Socket = 0;
+    if((end == host) || (end - host >= MAX_HOSTNAME)) return FALSE;
+    strncpy(hostname, host, end - host);
+    hostname[end - host] = '\0';
+
+    if(colon) {
+        number = strtol(colon + 1, &stop, 10);
+        if((stop == colon + 1) || (*stop != '\0') || (number < 1) || (number > 65535)) return FALSE;
+        *port = number;
     }
+    return TRUE;
+}
 
-    free(accumulator);
-    free(tempStore);
+/** Add a UPS to the set being monitored by a client.
+ *  The UPS shares a connection with any others on the same upsd host and
+ *  port, a new connection is set up if it is the first on its host.
+ */
+static void addUPS(UPSClient *client, const gchar *spec, gint defaultPort)
+{
+    UPSMonitor    *monitor = &client -> monitors[client -> upsCount];
+    UPSConnection *conn    = NULL;
+    gchar          hostname[MAX_HOSTNAME];
+    gint           port    = defaultPort;
+    gint           index;
 
-    return(*addrPtr != NULL);
+    if((client -> upsCount == MAX_UPS) || !parseSpec(spec, monitor -> name, hostname, &port)) return;
+
+    for(index = 0; index < client -> hostCount; index++) {
+        if(!strcmp(client -> hosts[index] -> hostname, hostname) && (client -> hosts[index] -> port == port)) {
+            conn = client -> hosts[index];
+            break;
+        }
+    }
+
+    if(conn == NULL) {
+        if((conn = (UPSConnection *)calloc(1, sizeof(UPSConnection))) == NULL) return;
+        strcpy(conn -> hostname, hostname);
+        conn -> client = client;
+        conn -> port   = port;
+        conn -> socket = -1;
+        conn -> state  = CONN_FAILED;
+        for(index = 0; index < MAX_ADDRS; index++) conn -> attempts[index] = -1;
+        client -> hosts[client -> hostCount++] = conn;
+    }
+
+    conn -> ups[conn -> upsCount++] = client -> upsCount;
+    monitor -> conn   = conn;
+    monitor -> wanted = VAR_ALL;
+
+    resetStatus(&client -> upsStatus[client -> upsCount]);
+    strncpy(client -> upsStatus[client -> upsCount].ups_Name, spec, MAX_UPSNAME - 1);
+    client -> upsStatus[client -> upsCount].ups_Name[MAX_UPSNAME - 1] = '\0';
+    initSnapshot(client, client -> upsCount);
+    client -> upsCount++;
 }
 
 /** ups client thread entrypoint.
  *  The launchClient() function uses this as the start routine argument to a
- *  pthread_create() call. This is simply a wrapper for the upsdConnect()
- *  function which fills in the host and port from global variables.
+ *  pthread_create() call. This is simply a wrapper for the upsClient()
+ *  function which tidies up the connections once it returns.
  */
-void *upsStart(void *arg)
+static void *upsStart(void *arg)
 {
-    resetStatus(&upsStatus);
-    upsdConnect(upsd_host, upsd_port);
+    UPSClient *client = (UPSClient *)arg;
+    gint       index;
+
+    upsClient(client);
+
+    for(index = 0; index < client -> hostCount; index++) {
+        closeSockets(client -> hosts[index]);
+        abandonResolve(client -> hosts[index]);
+    }
     return NULL;
 }
 
-/** Create the client thread and return the thread id.
- *  This creates a new client which connects to hostname and port. Directly
- *  creating the thread using upsStart() is fine if the host and port are
- *  unchanged from the last call to launchClient(), but in general this 
- *  should always be used when creating clients.
+/** Start a client thread and return the client.
+ *  This creates a new client which monitors every UPS in upsList - a list 
+ *  of [upsname@]hostname[:port] specifications seperated by spaces or 
+ *  commas. Specifications without a port use the one given. The UPSes are
+ *  numbered in the order they appear in the list, which is the index to 
+ *  pass to readStatus(). Clients share nothing, so any number of them can
+ *  run at once. Returns NULL if the client could not be started.
+ *
+ *  protocol selects between the LIST VAR protocol of current upsd releases
+ *  (PROTOCOL_LIST) and the REQ protocol understood by older ones 
+ *  (PROTOCOL_LEGACY). policy gives the poll intervals to use, see PollPolicy.
+ *  notify, if not NULL, is called with data every time the client publishes
+ *  a status, see SnapshotFunc.
+ */
+UPSClient *launchClient(const gchar *upsList, gint port, gint protocol, const PollPolicy *policy,
+                        SnapshotFunc notify, TransitionFunc transition, gpointer data)
+{
+    static const gchar separators[] = " ,\t\n";
+    UPSClient *client;
+    gchar     *list;
+    gchar     *spec;
+    gint       index;
+
+    if((client = (UPSClient *)calloc(1, sizeof(UPSClient))) == NULL) return NULL;
+    client -> wakeFds[0]  = client -> wakeFds[1] = -1;
+    client -> pollPolicy  = *policy;
+    client -> notify      = notify;
+    client -> transition  = transition;
+    client -> notifyData  = data;
+    client -> backoffSeed = (guint)monotonicUsec() ^ (guint)getpid() ^ (guint)(gsize)client;
+
+    if(pipe(client -> wakeFds) != 0) {
+        client -> wakeFds[0] = client -> wakeFds[1] = -1;
+        freeClient(client);
+        return NULL;
+    }
+    setNonBlocking(client -> wakeFds[0]);
+    setNonBlocking(client -> wakeFds[1]);
+
+    list = g_strdup(upsList);
+    for(spec = strtok(list, separators); spec; spec = strtok(NULL, separators)) {
+        addUPS(client, spec, port);
+    }
+    g_free(list);
+
+    /* Size the request and pending queues to hold a full poll cycle */
+    for(index = 0; index < client -> hostCount; index++) {
+        UPSConnection *conn = client -> hosts[index];
+
+        conn -> protocol = protocol;
+        conn -> pendSize = conn -> upsCount * CYCLE_REQUESTS;
+        conn -> pending  = (PendingRequest *)calloc(conn -> pendSize, sizeof(PendingRequest));
+        conn -> outSize  = conn -> pendSize * MAX_REQUESTSIZE;
+        conn -> out      = (gchar *)malloc(conn -> outSize);
+
+        if((conn -> pending == NULL) || (conn -> out == NULL)) {
+            conn -> pendSize = 0;
+            dropConnection(conn, noMem);
+        } else {
+            /* A backoff which is already over, so the client starts the lookup straight away */
+            conn -> state    = CONN_BACKOFF;
+            conn -> deadline = 0;
+        }
+    }
+
+    if(pthread_create(&client -> thread, NULL, upsStart, client)) {
+        freeClient(client);
+        return NULL;
+    }
+    return client;
+}
+
+/** Stop a client thread and free the client.
+ *  This wakes the client thread through the wakeup pipe and waits for it to 
+ *  exit before continuting. As the client never blocks anywhere other than 
+ *  in poll() this returns within a few milliseconds, whatever the servers 
+ *  are doing. Snapshots returned by readStatus() for the client must not be
+ *  used afterwards.
  */
-pthread_t launchClient(gchar *hostname, gint port)
+void haltClient(UPSClient *client)
 {
-    pthread_t result;
+    if(client == NULL) return;
 
-    strcpy(upsd_host, hostname);
-    upsd_port = port;
+    __atomic_store_n(&client -> stopClient, 1, __ATOMIC_RELEASE);
+    write(client -> wakeFds[1], "", 1);
+    pthread_join(client -> thread, NULL);
+    freeClient(client);
+}
 
-    pthread_create(&result, NULL, upsStart, NULL);
-    return result;
+/** Return the number of UPSes monitored by a client, 0 for a NULL client. */
+gint clientUPSCount(UPSClient *client)
+{
+    return client ? client -> upsCount : 0;
 }
 
-/** Force the specified client thread to exit.
- *  This will tell the client thread(s) to halt and wait for thread 'tid' to  
- *  exit before continuting. Use sparingly or it may affect gkrellm updates!
+/** Choose the readings fetched for a UPS.
+ *  vars is a mask of (1 << VAR_*) bits, every reading (VAR_ALL) is fetched
+ *  until this is called. The status is always fetched. Can be called from 
+ *  any thread at any time, the next poll cycle picks the change up. Readings
+ *  no longer fetched read as zero and leave ups_Fetched.
  */
-void haltClient(pthread_t tid)
+void setWantedVars(UPSClient *client, gint ups, guint32 vars)
 {
-    haltThread = TRUE;
-    pthread_join(tid, NULL);
-    haltThread = FALSE;
+    if(client && (ups >= 0) && (ups < client -> upsCount)) {
+        __atomic_store_n(&client -> monitors[ups].wanted, vars & VAR_ALL, __ATOMIC_RELAXED);
+    }
 }
-    
@@ -40,16 +40,86 @@
 #define UPS_CONNECT
 
 #include<glib.h>
-#include<pthread.h>
 
 /*! Please keep logs under this size - I enforce it anyway... */
 #define MAX_LOGSIZE 256 
 
-/*! Maximum size of a single DeltaUPS line (the largest I've found is around 350 chars) */
-#define MAX_LINESIZE 1024
+/*! Maximum number of UPSes which can be monitored at once */
+#define MAX_UPS 64
 
-/*! Maximum size of a single entry (see the aside in upsClient() for more on this #define */
-#define MAX_ENTRYSIZE 213
+/*! Maximum length of a UPS specification ([upsname@]hostname[:port]) or name, plus the terminator */
+#define MAX_UPSNAME 128
+
+/*! Maximum length of a static information string such as the UPS model, plus the terminator */
+#define MAX_INFO 64
+
+/*! \name UPS status flags
+ *  One bit for each token upsd can report in the UPS status, see statusText().
+ */
+/*@{*/
+#define UPS_OFF     0x0001 /*!< OFF - off.                         */
+#define UPS_OL      0x0002 /*!< OL - online.                       */
+#define UPS_OB      0x0004 /*!< OB - on battery.                   */
+#define UPS_LB      0x0008 /*!< LB - battery low.                  */
+#define UPS_HB      0x0010 /*!< HB - battery high.                 */
+#define UPS_RB      0x0020 /*!< RB - battery needs replacing.      */
+#define UPS_CHRG    0x0040 /*!< CHRG - battery charging.           */
+#define UPS_DISCHRG 0x0080 /*!< DISCHRG - battery discharging.     */
+#define UPS_BYPASS  0x0100 /*!< BYPASS - on bypass.                */
+#define UPS_CAL     0x0200 /*!< CAL - calibrating.                 */
+#define UPS_TRIM    0x0400 /*!< TRIM - trimming incoming voltage.  */
+#define UPS_BOOST   0x0800 /*!< BOOST - boosting incoming voltage. */
+#define UPS_OVER    0x1000 /*!< OVER - overloaded.                 */
+#define UPS_FSD     0x2000 /*!< FSD - forced shutdown.             */
+/*@}*/
+
+/*! Number of buckets in the request round trip histogram */
+#define RTT_BUCKETS 24
+
+/*! Upper bound of the first histogram bucket in microseconds, each bucket after it is twice as wide */
+#define RTT_FIRST_BUCKET 64
+
+/*! Health of the connection to a upsd server.
+ *  Kept by the client for each connection and published with the status of
+ *  every UPS on it. Round trips are counted in a fixed histogram with
+ *  log-scale buckets: bucket 0 counts replies taking less than
+ *  RTT_FIRST_BUCKET microseconds, bucket n those taking less than
+ *  RTT_FIRST_BUCKET << n, and the last bucket everything slower. See
+ *  rttPercentile(). Counters only ever go up, for the life of the client.
+ */
+typedef struct
+{
+    guint32 rtt[RTT_BUCKETS]; /*!< Replies received, by round trip time.                 */
+    guint32 replies;          /*!< Total of rtt.                                         */
+    guint32 timeouts;         /*!< Connections dropped because a reply was overdue.     */
+    guint32 reconnects;       /*!< Connections made after the first one.                */
+    guint32 parseErrors;      /*!< Reply lines which could not be made sense of.        */
+    guint32 staleData;        /*!< ERR DATA-STALE replies, the UPS driver is not updating. */
+} PollHealth;
+
+/*! Readings of a UPS, the gfloats of struct UPSData which are read from upsd (see upsVars). */
+enum
+{
+    VAR_IN_VOLTAGE, VAR_IN_FREQ, VAR_OUT_VOLTAGE, VAR_OUT_FREQ, VAR_BAT_LEVEL, VAR_BAT_VOLTAGE, VAR_UPS_LOAD, VAR_UPS_TEMP,
+    VAR_IN_NOMINAL, VAR_COUNT
+};
+
+/*! Every reading sampled over one second of wall clock time.
+ *  The charts show a column a second, but the client may poll several times
+ *  a second to catch short sags and swells. Each complete poll adds its
+ *  readings to the window of the second it finished in, so a reader looking
+ *  once a second still gets the lowest, highest and mean value of each, see
+ *  statusWindow(). Readings which were not fetched keep their last value,
+ *  those missing from ups_Fetched mean nothing.
+ */
+typedef struct
+{
+    gint64  second;          /*!< time() of the samples, 0 if there are none. */
+    guint32 samples;         /*!< Polls added.                                */
+    gfloat  low[VAR_COUNT];  /*!< Lowest value of each reading, by VAR_*.     */
+    gfloat  high[VAR_COUNT]; /*!< Highest value.                              */
+    gfloat  sum[VAR_COUNT];  /*!< Sum of the values, for the mean.            */
+} UPSWindow;
 
 /** Structure to store UPS status values.
  *  This contains all the values I have been able to reverse engineer from the
@@ -66,17 +136,118 @@ struct UPSData
     gfloat   out_Voltage;              /*!< Voltage the UPS is supplying (usually 220v for me). */
     gfloat   ups_Load;                 /*!< Connected load value */
     gfloat   ups_Temp;                 /*!< Internal temperature. */
+    gfloat   in_Nominal;               /*!< Nominal input voltage, fetched once a connection. */
+    gchar    ups_Model[MAX_INFO];      /*!< UPS model, fetched once a connection (LIST protocol only). */
+    gchar    ups_Firmware[MAX_INFO];   /*!< UPS firmware version, likewise. */
     gchar    ups_LastLog[MAX_LOGSIZE]; /*!< Last log message (or error message from us...) */
     gboolean ups_Present;              /*!< TRUE if UPS connected, FALSE otherwise.  */
-    int      ups_Socket;               /*!< Socket which is connected to the upsd service. */
+    guint32  ups_Fetched;              /*!< VAR_* bits of the readings upsd has reported, the others are meaningless. */
+    glong    ups_PollTime;             /*!< Time taken by the last poll cycle in microseconds. */
+    guint    ups_Sequence;             /*!< Incremented each time the client publishes a snapshot. */
+    guint    ups_Status;               /*!< UPS_* flags from the last status reported by upsd. */
+    gint     ups_ConnState;            /*!< CONN_* state of the connection to the UPS server. */
+    gchar    ups_Name[MAX_UPSNAME];    /*!< The UPS specification as given to launchClient(). */
+    PollHealth ups_Health;             /*!< Health of the connection to the UPS server. */
+    UPSWindow  ups_Window[2];          /*!< Readings of the last two seconds polled, by second % 2. */
 };
 
-/* global variables exported from ups_connect.c */
-extern struct UPSData upsStatus;       /*!< Global UPS data structure, must be synchronised across threads! */
-extern pthread_mutex_t upsStatus_lock; /*!< Synchronisation mutex for upsStatus.                            */
+/*! Description of one reading, see upsVars.
+ *  The client requests and parses readings, and everything which shows them
+ *  (charts, format variables, help texts, metrics) finds them, through this
+ *  table - a new reading only needs an entry there and a field in UPSData.
+ *  Each reading is fetched only as often as it is likely to change (refresh),
+ *  so each poll spends its requests on the readings which move.
+ */
+typedef struct
+{
+    const gchar *name;   /*!< NUT variable name, as sent in VAR lines.                      */
+    const gchar *legacy; /*!< Name requested with REQ (upsd before 2.0), NULL if it has none. */
+    gint         offset; /*!< Offset of the gfloat in struct UPSData.                       */
+    gfloat       scale;  /*!< Factor applied to the value sent by upsd.                     */
+    gfloat       min;    /*!< Lowest value stored, lower values are clamped to it.          */
+    gfloat       max;    /*!< Highest value stored, higher values are clamped to it.        */
+    const gchar *print;  /*!< printf format used to show the value.                         */
+    const gchar *label;  /*!< Short name, also used for chartdata configuration.            */
+    const gchar *help;   /*!< Description, with the units.                                  */
+    const gchar *metric; /*!< OpenMetrics family name.                                      */
+    const gchar *unit;   /*!< OpenMetrics unit, NULL for none.                              */
+    gint         refresh;/*!< Milliseconds between fetches, 0 for every poll or REFRESH_ONCE. */
+} UPSVar;
+
+/*! UPSVar.refresh of a reading which never changes, fetched once a connection */
+#define REFRESH_ONCE -1
+
+extern const UPSVar upsVars[VAR_COUNT]; /*!< Every reading, indexed by VAR_*. */
+
+/*! Mask of every reading, one bit (1 << VAR_*) for each */
+#define VAR_ALL ((1 << VAR_COUNT) - 1)
+
+/*! Protocols understood by the client */
+enum
+{
+    PROTOCOL_LIST,   /*!< LIST VAR / GET VAR, spoken by current upsd releases.     */
+    PROTOCOL_LEGACY  /*!< REQ, one request for each variable (upsd before 2.0).    */
+};
+
+/*! Time allowed for upsd to accept a connection or answer a request, in milliseconds */
+#define REQUEST_TIMEOUT 5000
+
+/*! Shortest poll interval accepted in a PollPolicy, in milliseconds */
+#define MIN_POLL_INTERVAL 100
+
+/*! How often to poll a upsd server, depending on the state of its UPSes.
+ *  All intervals are in milliseconds, measured from the start of one poll 
+ *  cycle to the start of the next. A server with several UPSes is polled at 
+ *  the rate needed by the most urgent of them.
+ */
+typedef struct
+{
+    gint lineInterval;    /*!< Every UPS online and healthy.                    */
+    gint batteryInterval; /*!< A UPS on battery (OB or DISCHRG).                */
+    gint alertInterval;   /*!< A UPS low on battery, overloaded or shutting down. */
+} PollPolicy;
+
+/*! Connection states. */
+enum
+{
+    CONN_RESOLVING,  /*!< Waiting for the host address lookup.          */
+    CONN_CONNECTING, /*!< Non-blocking connects in progress.            */
+    CONN_CONNECTED,  /*!< Polling.                                      */
+    CONN_BACKOFF,    /*!< Waiting to try again after a failure.         */
+    CONN_FAILED      /*!< Given up for good, the socket is closed.      */
+};
+
+/*! A running client, see launchClient(). Only ever used through a pointer. */
+typedef struct UPSClient UPSClient;
+
+/*! Called by the client thread each time it publishes a new status for a UPS.
+ *  polled is TRUE when the status is the result of a complete poll cycle and
+ *  FALSE when it only reports a change of connection state. The callback runs
+ *  on the client thread and holds up polling for as long as it takes.
+ */
+typedef void (*SnapshotFunc)(gint ups, const struct UPSData *status, gboolean polled, gpointer data);
+
+/*! Called by the client thread as soon as a status reply changes the UPS_* flags of a UPS.
+ *  This happens while the reply is parsed, ahead of the rest of the poll
+ *  cycle and of the snapshot being published. previous is 0 for the first
+ *  status seen, detected is the monotonic time (microseconds) of the reply.
+ *  Like SnapshotFunc it holds up polling for as long as it takes.
+ */
+typedef void (*TransitionFunc)(gint ups, const gchar *name, guint previous, guint status, gint64 detected, gpointer data);
 
 /* functions exported from ups_connect.c */
-extern pthread_t launchClient(gchar *hostname, gint port); /*!< Create the client thread and return the thread id. */
-extern void haltClient(pthread_t tid);                     /*!< Force the specified client thread to exit.         */ 
+extern UPSClient *launchClient(const gchar *upsList, gint port, gint protocol, const PollPolicy *policy,
+                               SnapshotFunc notify, TransitionFunc transition,
+                               gpointer data);                           /*!< Start a client thread polling a list of UPSes.     */
+extern void haltClient(UPSClient *client);                               /*!< Stop a client thread and free the client.          */ 
+extern gint clientUPSCount(UPSClient *client);                           /*!< Number of UPSes monitored by a client.             */
+extern void setWantedVars(UPSClient *client, gint ups, guint32 vars);   /*!< Choose the readings fetched for a UPS.             */
+extern struct UPSData *readStatus(UPSClient *client, gint ups);          /*!< Latest published status of a UPS (one thread only). */
+extern const UPSWindow *statusWindow(const struct UPSData *status, gint64 second); /*!< Readings of a UPS over one second. */
+extern gint statusText(gchar *buffer, gint size, guint flags, gboolean brief); /*!< Describe a set of UPS_* status flags.     */
+extern const gchar *connStateText(gint state);                           /*!< Short description of a CONN_* state.               */
+extern gint latencyBucket(gint64 usec);                                  /*!< Histogram bucket of a time, see PollHealth.         */
+extern gint64 latencyPercentile(const guint32 *buckets, guint32 total, gint percent); /*!< Percentile of a histogram, in microseconds. */
+extern gint64 rttPercentile(const PollHealth *health, gint percent);     /*!< Round trip time percentile, in microseconds.        */
 
 #endif
@@ -0,0 +1,165 @@
+/**
+ *  \file rolling_stats.c
+ *  Rolling statistics.
+ *  The mean, lowest, highest and standard deviation of a reading over the
+ *  last minute, five minutes and hour, kept up to date a second at a time
+ *  for the "$" statistics of the chart text formats. The windows count
+ *  samples rather than time: the plugin adds one for each second the UPS
+ *  is connected, so after a gap a window reaches back over it. Until a
+ *  window has filled, its statistics cover the samples there are.
+ */
+
+#include<math.h>
+#include<string.h>
+#include"rolling_stats.h"
+
+/*! Samples in each window, by STATS_* */
+static const guint windowLength[STATS_WINDOWS] = { 60, 300, STATS_SAMPLES };
+
+/*! Start of the entries of each window in ReadingStats.lowEntry and highEntry */
+static const guint windowEntry[STATS_WINDOWS] = { 0, 60, 360 };
+
+/** Create empty statistics for one UPS. */
+RollingStats *newRollingStats(void)
+{
+    return g_new0(RollingStats, 1);
+}
+
+/** Free the statistics of a UPS, which may be NULL. */
+void freeRollingStats(RollingStats *stats)
+{
+    gint var;
+
+    if(stats == NULL) return;
+
+    for(var = 0; var < VAR_COUNT; var++) g_free(stats -> vars[var]);
+    g_free(stats);
+}
+
+/** Forget every sample of a reading.
+ *  Used when a reading stops being sampled, its memory is freed until it
+ *  is sampled again.
+ */
+void resetReadingStats(RollingStats *stats, gint var)
+{
+    g_free(stats -> vars[var]);
+    stats -> vars[var] = NULL;
+}
+
+/** Push a sample onto a monotonic deque.
+ *  The head leaves once its sample is out of the window, then entries at
+ *  the tail which the new sample beats (a value no better than its own, by
+ *  which it will outlast them) are dropped.
+ *
+ *  \par Arguments:
+ *  \arg \c queue - the deque of one window.
+ *  \arg \c entries - its entries, a ring of length sample numbers.
+ *  \arg \c length - samples in the window.
+ *  \arg \c values - ring of the values the deque is ordered by.
+ *  \arg \c sample - number of the new sample, its value already in values.
+ *  \arg \c lowest - TRUE to keep the lowest value at the head, FALSE the highest.
+ */
+static void pushQueue(StatsQueue *queue, guint *entries, guint length, const gfloat *values, guint sample,
+                      gboolean lowest)
+{
+    gfloat value = values[sample % STATS_SAMPLES];
+    gfloat last;
+
+    if((queue -> head != queue -> tail) && (sample - entries[queue -> head % length] >= length)) queue -> head++;
+
+    while(queue -> head != queue -> tail) {
+        last = values[entries[(queue -> tail - 1) % length] % STATS_SAMPLES];
+        if(lowest ? (last < value) : (last > value)) break;
+        queue -> tail--;
+    }
+    entries[queue -> tail++ % length] = sample;
+}
+
+/** Add one second to the statistics of a reading.
+ *  The sample leaving each window comes off its sums before the ring slot
+ *  of the hour window is reused, then the new one goes on and into the
+ *  deques. Nothing here depends on the number of samples kept.
+ *
+ *  \par Arguments:
+ *  \arg \c stats - statistics of the UPS.
+ *  \arg \c var - VAR_* of the reading.
+ *  \arg \c mean - mean of the reading over the second.
+ *  \arg \c low - its lowest value.
+ *  \arg \c high - its highest value.
+ */
+void addStatsSample(RollingStats *stats, gint var, gfloat mean, gfloat low, gfloat high)
+{
+    ReadingStats *reading = stats -> vars[var];
+    gfloat        old;
+    guint         sample;
+    gint          window;
+
+    if(reading == NULL) reading = stats -> vars[var] = g_new0(ReadingStats, 1);
+    sample = reading -> count;
+
+    for(window = 0; window < STATS_WINDOWS; window++) {
+        if(sample >= windowLength[window]) {
+            old = reading -> mean[(sample - windowLength[window]) % STATS_SAMPLES];
+            reading -> sum[window]     -= old;
+            reading -> squares[window] -= (gdouble)old * old;
+        }
+    }
+
+    reading -> mean[sample % STATS_SAMPLES] = mean;
+    reading -> low[sample % STATS_SAMPLES]  = low;
+    reading -> high[sample % STATS_SAMPLES] = high;
+
+    for(window = 0; window < STATS_WINDOWS; window++) {
+        reading -> sum[window]     += mean;
+        reading -> squares[window] += (gdouble)mean * mean;
+        pushQueue(&reading -> lowQueue[window], reading -> lowEntry + windowEntry[window], windowLength[window],
+                  reading -> low, sample, TRUE);
+        pushQueue(&reading -> highQueue[window], reading -> highEntry + windowEntry[window], windowLength[window],
+                  reading -> high, sample, FALSE);
+    }
+    reading -> count++;
+}
+
+/** Read one statistic of a reading.
+ *  Returns FALSE, leaving value alone, when the reading has no samples.
+ *
+ *  \par Arguments:
+ *  \arg \c stats - statistics of the UPS.
+ *  \arg \c var - VAR_* of the reading.
+ *  \arg \c window - one of the STATS_* windows.
+ *  \arg \c stat - one of the STAT_* statistics.
+ *  \arg \c value - destination for the statistic.
+ */
+gboolean readingStat(const RollingStats *stats, gint var, gint window, gint stat, gfloat *value)
+{
+    const ReadingStats *reading = stats -> vars[var];
+    gdouble             count;
+    gdouble             mean;
+    gdouble             variance;
+
+    if((reading == NULL) || (reading -> count == 0)) return FALSE;
+
+    count = MIN(reading -> count, windowLength[window]);
+    mean  = reading -> sum[window] / count;
+
+    switch(stat) {
+        case STAT_MEAN:
+            *value = mean;
+            break;
+        case STAT_LOW:
+            *value = reading -> low[reading -> lowEntry[windowEntry[window] +
+                                    reading -> lowQueue[window].head % windowLength[window]] % STATS_SAMPLES];
+            break;
+        case STAT_HIGH:
+            *value = reading -> high[reading -> highEntry[windowEntry[window] +
+                                     reading -> highQueue[window].head % windowLength[window]] % STATS_SAMPLES];
+            break;
+        case STAT_DEVIATION:
+            variance = reading -> squares[window] / count - mean * mean;
+            *value   = (variance > 0) ? sqrt(variance) : 0;
+            break;
+        default:
+            return FALSE;
+    }
+    return TRUE;
+}
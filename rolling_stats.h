@@ -0,0 +1,74 @@
+/**
+ *  \file rolling_stats.h
+ *  Rolling statistics header.
+ *  The plugin keeps the mean, lowest, highest and standard deviation of the
+ *  readings of each UPS over the last minute, five minutes and hour, for the
+ *  chart text formats. See rolling_stats.c.
+ */
+
+#ifndef ROLLING_STATS
+#define ROLLING_STATS
+
+#include<glib.h>
+#include"nut_connect.h"
+
+/*! Windows the statistics are kept over */
+enum { STATS_MINUTE, STATS_FIVE, STATS_HOUR, STATS_WINDOWS };
+
+/*! Statistics kept over each window */
+enum { STAT_MEAN, STAT_LOW, STAT_HIGH, STAT_DEVIATION };
+
+/*! Samples in the longest window, one a second for an hour */
+#define STATS_SAMPLES 3600
+
+/*! Entries in the deques of every window together (60 + 300 + 3600) */
+#define STATS_QUEUE 3960
+
+/*! Monotonic deque of sample numbers for the lowest or highest value of one window. */
+typedef struct
+{
+    guint head; /*!< Oldest entry, counting up (index modulo the window length). */
+    guint tail; /*!< One past the newest entry.                                  */
+} StatsQueue;
+
+/*! Statistics of one reading.
+ *  Each second adds a sample: the mean, lowest and highest value of the
+ *  reading over that second. The samples of the last hour are kept in rings,
+ *  so the one leaving each window is known without a search. Its mean comes
+ *  off the running sum and sum of squares of the window (in doubles, which
+ *  hold sums of gfloats far more exactly than anything shown), while the
+ *  lowest and highest values come from monotonic deques of sample numbers
+ *  like the chart ranges (see BUPSRange), so a sample costs O(1) amortised
+ *  for every window and nothing is ever rescanned.
+ */
+typedef struct
+{
+    guint      count;                      /*!< Samples added, the next goes in count % STATS_SAMPLES.  */
+    gfloat     mean[STATS_SAMPLES];        /*!< Mean of each sample.                                    */
+    gfloat     low[STATS_SAMPLES];         /*!< Lowest value of each sample.                            */
+    gfloat     high[STATS_SAMPLES];        /*!< Highest value of each sample.                           */
+    gdouble    sum[STATS_WINDOWS];         /*!< Sum of the means in each window.                        */
+    gdouble    squares[STATS_WINDOWS];     /*!< Sum of their squares.                                   */
+    StatsQueue lowQueue[STATS_WINDOWS];    /*!< Lows of each window, increasing from head to tail.      */
+    StatsQueue highQueue[STATS_WINDOWS];   /*!< Highs of each window, decreasing from head to tail.     */
+    guint      lowEntry[STATS_QUEUE];      /*!< Entries of lowQueue, a ring the window length of each.  */
+    guint      highEntry[STATS_QUEUE];     /*!< Entries of highQueue.                                   */
+} ReadingStats;
+
+/*! Rolling statistics of the readings of one UPS.
+ *  The statistics of a reading are only allocated while it is being sampled,
+ *  a UPS only costs memory for the readings the formats ask about.
+ */
+typedef struct
+{
+    ReadingStats *vars[VAR_COUNT]; /*!< Statistics of each reading by VAR_*, or NULL. */
+} RollingStats;
+
+/* functions exported from rolling_stats.c */
+extern RollingStats *newRollingStats(void);                                 /*!< Create empty statistics.             */
+extern void freeRollingStats(RollingStats *stats);                          /*!< Free statistics.                     */
+extern void addStatsSample(RollingStats *stats, gint var, gfloat mean, gfloat low, gfloat high); /*!< Add a second. */
+extern void resetReadingStats(RollingStats *stats, gint var);               /*!< Forget the samples of a reading.     */
+extern gboolean readingStat(const RollingStats *stats, gint var, gint window, gint stat, gfloat *value); /*!< Read one statistic. */
+
+#endif
@@ -0,0 +1,104 @@
+/** 
+ *  \file sample_ring.c
+ *  Chart history ring files.
+ *  Each ring file holds a RingHeader followed by a fixed number of RingSample
+ *  slots and is mapped straight into memory. Storing a sample is a structure
+ *  copy into the mapping and reading the history back is plain pointer 
+ *  arithmetic - there is no text to parse and no read() or write() calls, 
+ *  the kernel writes the dirty pages back in its own time. A file which is
+ *  missing, truncated or from an incompatible version is simply started 
+ *  afresh.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include"sample_ring.h"
+
+/** Check whether a mapped header describes a usable ring. */
+static gboolean validHeader(RingHeader *header)
+{
+    return (header -> magic == RING_MAGIC) && (header -> version == RING_VERSION) &&
+           (header -> capacity == RING_SAMPLES) && (header -> sampleSize == sizeof(RingSample)) &&
+           (header -> head < RING_SAMPLES) && (header -> count <= RING_SAMPLES);
+}
+
+/** Open a ring file, creating it if need be.
+ *  Returns NULL if the file can not be created or mapped, the charts then
+ *  simply start empty as they always used to.
+ *
+ *  \par Arguments:
+ *  \arg \c path - name of the ring file.
+ */
+SampleRing *openSampleRing(const gchar *path)
+{
+    SampleRing *ring;
+    struct stat info;
+    gsize       size = sizeof(RingHeader) + RING_SAMPLES * sizeof(RingSample);
+    void       *map;
+    int         fd;
+
+    if((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) return NULL;
+
+    if((fstat(fd, &info) < 0) || ((info.st_size != size) && (ftruncate(fd, size) < 0))) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return NULL;
+
+    ring = g_new0(SampleRing, 1);
+    ring -> header  = (RingHeader *)map;
+    ring -> samples = (RingSample *)((gchar *)map + sizeof(RingHeader));
+    ring -> size    = size;
+
+    if(!validHeader(ring -> header)) {
+        memset(ring -> header, 0, sizeof(RingHeader));
+        ring -> header -> magic      = RING_MAGIC;
+        ring -> header -> version    = RING_VERSION;
+        ring -> header -> capacity   = RING_SAMPLES;
+        ring -> header -> sampleSize = sizeof(RingSample);
+    }
+    return ring;
+}
+
+/** Unmap a ring file opened by openSampleRing(). */
+void closeSampleRing(SampleRing *ring)
+{
+    if(ring == NULL) return;
+
+    munmap(ring -> header, ring -> size);
+    g_free(ring);
+}
+
+/** Add a sample to a ring, replacing the oldest one once the ring is full.
+ *  The sample is written before the head moves on so a crash part way 
+ *  through can at worst lose the newest sample.
+ */
+void appendSample(SampleRing *ring, const RingSample *sample)
+{
+    RingHeader *header = ring -> header;
+
+    ring -> samples[header -> head] = *sample;
+    header -> head = (header -> head + 1) % RING_SAMPLES;
+    if(header -> count < RING_SAMPLES) header -> count++;
+}
+
+/** Fetch a sample from a ring.
+ *  Returns the sample stored 'age' samples before the newest one (so 0 is 
+ *  the newest), or NULL if the ring does not hold that many.
+ */
+const RingSample *ringSample(SampleRing *ring, gint age)
+{
+    RingHeader *header = ring -> header;
+
+    if((age < 0) || (age >= header -> count)) return NULL;
+    return &ring -> samples[(header -> head + RING_SAMPLES - 1 - age) % RING_SAMPLES];
+}
@@ -0,0 +1,66 @@
+/** 
+ *  \file sample_ring.h
+ *  Chart history ring file header.
+ *  The recent chart samples of each UPS are kept in a small fixed-size ring
+ *  file which is mapped into memory, so the charts can be refilled straight
+ *  away when GKrellM restarts. See sample_ring.c.
+ */
+
+#ifndef SAMPLE_RING
+#define SAMPLE_RING
+
+#include<glib.h>
+
+/*! Identifies a ring file, "GKNR" in little endian order */
+#define RING_MAGIC 0x524e4b47
+
+/*! Bump whenever the layout of RingHeader or RingSample changes */
+#define RING_VERSION 2
+
+/*! Number of samples kept, one is stored each second so comfortably more than any chart width */
+#define RING_SAMPLES 1024
+
+/*! Charts stored in each sample (voltage, frequency, stats) */
+#define RING_CHARTS 3
+
+/*! Values stored for each chart, matches MAX_DATA in gknut.h */
+#define RING_VALUES 3
+
+/*! A single sample, the raw values shown on each chart of a UPS for one second.
+ *  values holds the mean of the polls in that second, low and high the
+ *  envelope around it (all three are the same with a single poll).
+ */
+typedef struct
+{
+    gint64 time;                            /*!< Wall clock time of the sample (seconds). */
+    gfloat values[RING_CHARTS][RING_VALUES]; /*!< Chart values, unused entries are zero.   */
+    gfloat low[RING_CHARTS][RING_VALUES];    /*!< Lowest value of each over the second.    */
+    gfloat high[RING_CHARTS][RING_VALUES];   /*!< Highest value of each.                   */
+} RingSample;
+
+/*! Header at the start of a ring file, followed by RING_SAMPLES samples. */
+typedef struct
+{
+    guint32 magic;      /*!< RING_MAGIC.                         */
+    guint32 version;    /*!< RING_VERSION.                       */
+    guint32 capacity;   /*!< Number of samples, RING_SAMPLES.    */
+    guint32 sampleSize; /*!< sizeof(RingSample).                 */
+    guint32 head;       /*!< Slot the next sample goes in.       */
+    guint32 count;      /*!< Number of slots holding samples.    */
+} RingHeader;
+
+/*! An open ring file. */
+typedef struct
+{
+    RingHeader *header;  /*!< Start of the mapping.               */
+    RingSample *samples; /*!< The sample slots, after the header. */
+    gsize       size;    /*!< Size of the mapping.                */
+} SampleRing;
+
+/* functions exported from sample_ring.c */
+extern SampleRing *openSampleRing(const gchar *path);                      /*!< Open (or create) a ring file.          */
+extern void closeSampleRing(SampleRing *ring);                             /*!< Unmap a ring file.                     */
+extern void appendSample(SampleRing *ring, const RingSample *sample);      /*!< Add a sample, replacing the oldest.    */
+extern const RingSample *ringSample(SampleRing *ring, gint age);           /*!< Fetch a sample, 0 being the newest.    */
+
+#endif
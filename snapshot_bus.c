@@ -0,0 +1,326 @@
+/**
+ *  \file snapshot_bus.c
+ *  Shared memory snapshot bus.
+ *  On a machine where many people run GKrellM, each plugin would normally
+ *  open its own session to upsd and poll it. Instead one collector (gknutc
+ *  -s) can poll upsd and publish every status it gets into a shared memory
+ *  segment, which each plugin maps read-only and reads from in place of a
+ *  client of its own - however many displays there are, upsd only sees one.
+ *
+ *  The segment holds a BusSegment: a versioned header naming the UPSes
+ *  followed by a slot for each, guarded by a sequence lock. Besides the
+ *  latest status a slot keeps the last few changes of status the collector
+ *  saw, so a reader only looking once per GKrellM update can still run its
+ *  hooks for every one of them (see busNextTransition()). Readers never
+ *  write to the segment at all, so they can not disturb the writer or each
+ *  other. A reader only attaches if the writer is still running and
+ *  publishes every UPS the reader wants, and keeps an eye on the writer with
+ *  busAlive() so it can fall back to its own client if the collector stops.
+ *
+ *  Anyone can create a shared memory segment of that name, so a reader only
+ *  trusts one owned by itself or by root which nobody else can write to -
+ *  otherwise any local user could feed fake UPS status to everyone else's
+ *  displays. A collector serving several users therefore has to run as root.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<signal.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include"snapshot_bus.h"
+
+/** Check whether a process is still running.
+ *  The writer may belong to another user, in which case kill() is refused
+ *  with EPERM - which still means the process exists.
+ */
+static gboolean processAlive(pid_t pid)
+{
+    return (pid > 0) && ((kill(pid, 0) == 0) || (errno == EPERM));
+}
+
+/** Check whether a segment belongs to us or to root and only its owner can write to it. */
+static gboolean trustedSegment(int fd)
+{
+    struct stat info;
+
+    if(fstat(fd, &info) < 0) return FALSE;
+    return ((info.st_uid == geteuid()) || (info.st_uid == 0)) && !(info.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/** Check whether a mapped segment is a usable bus written by a running writer. */
+static gboolean validSegment(BusSegment *segment)
+{
+    return (__atomic_load_n(&segment -> magic, __ATOMIC_ACQUIRE) == BUS_MAGIC) &&
+           (segment -> version == BUS_VERSION) && (segment -> dataSize == sizeof(struct UPSData)) &&
+           (segment -> upsCount >= 0) && (segment -> upsCount <= MAX_UPS) && processAlive(segment -> writer);
+}
+
+/** Create the bus and become its writer.
+ *  The segment is (re)initialised with a slot for each of the named UPSes,
+ *  in order, and made readable by every user. Fails if another process is
+ *  already publishing on the bus, or if the segment belongs to another user
+ *  (readers would not trust it). Returns NULL on failure.
+ *
+ *  \par Arguments:
+ *  \arg \c names - UPS specification of each slot, as readers will ask for them.
+ *  \arg \c count - number of entries in names.
+ */
+SnapshotBus *createBus(const gchar **names, gint count)
+{
+    SnapshotBus *bus;
+    BusSegment  *segment;
+    struct stat  info;
+    gint         index;
+    int          fd;
+
+    if((count <= 0) || (count > MAX_UPS)) return NULL;
+    if((fd = shm_open(BUS_NAME, O_RDWR | O_CREAT, 0644)) < 0) return NULL;
+
+    if((fstat(fd, &info) < 0) || (info.st_uid != geteuid()) || (fchmod(fd, 0644) < 0) ||
+       (ftruncate(fd, sizeof(BusSegment)) < 0)) {
+        close(fd);
+        return NULL;
+    }
+    segment = (BusSegment *)mmap(NULL, sizeof(BusSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(segment == MAP_FAILED) return NULL;
+
+    if(validSegment(segment) && (segment -> writer != getpid())) {
+        munmap(segment, sizeof(BusSegment));
+        return NULL;
+    }
+
+    /* Readers ignore the segment until the magic number goes back in */
+    __atomic_store_n(&segment -> magic, 0, __ATOMIC_RELEASE);
+    memset((gchar *)segment + sizeof(segment -> magic), 0, sizeof(BusSegment) - sizeof(segment -> magic));
+    segment -> version  = BUS_VERSION;
+    segment -> dataSize = sizeof(struct UPSData);
+    segment -> upsCount = count;
+    segment -> writer   = getpid();
+    for(index = 0; index < count; index++) {
+        strncpy(segment -> names[index], names[index], MAX_UPSNAME - 1);
+        strncpy(segment -> slots[index].data.ups_Name, names[index], MAX_UPSNAME - 1);
+        segment -> slots[index].data.ups_ConnState = CONN_FAILED;
+    }
+    __atomic_store_n(&segment -> magic, BUS_MAGIC, __ATOMIC_RELEASE);
+
+    bus = g_new0(SnapshotBus, 1);
+    bus -> segment  = segment;
+    bus -> writable = TRUE;
+    return bus;
+}
+
+/** Publish the status of a UPS.
+ *  Only the writer may publish, and only from one thread.
+ *
+ *  \par Arguments:
+ *  \arg \c bus - bus returned by createBus().
+ *  \arg \c ups - slot of the UPS, its position in the names given to createBus().
+ *  \arg \c status - status to publish.
+ */
+void busPublish(SnapshotBus *bus, gint ups, const struct UPSData *status)
+{
+    BusSlot *slot;
+    guint    seq;
+
+    if(!bus -> writable || (ups < 0) || (ups >= bus -> segment -> upsCount)) return;
+
+    slot = &bus -> segment -> slots[ups];
+    seq  = slot -> seq;
+
+    __atomic_store_n(&slot -> seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot -> data, status, sizeof(struct UPSData));
+    __atomic_store_n(&slot -> seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/** Add a change in the status of a UPS to its slot.
+ *  Only the writer may add one, from the thread which publishes. Meant to
+ *  be called from the transition callback of the client (see launchClient()),
+ *  so readers get every change rather than only those still showing when
+ *  they look.
+ *
+ *  \par Arguments:
+ *  \arg \c bus - bus returned by createBus().
+ *  \arg \c ups - slot of the UPS.
+ *  \arg \c previous - UPS_* flags before the change.
+ *  \arg \c status - UPS_* flags after it.
+ *  \arg \c detected - CLOCK_MONOTONIC time of the change in microseconds.
+ */
+void busPublishTransition(SnapshotBus *bus, gint ups, guint previous, guint status, gint64 detected)
+{
+    BusSlot       *slot;
+    BusTransition *transition;
+    guint          seq;
+
+    if(!bus -> writable || (ups < 0) || (ups >= bus -> segment -> upsCount)) return;
+
+    slot       = &bus -> segment -> slots[ups];
+    seq        = slot -> seq;
+    transition = &slot -> transitions[slot -> transitionCount % BUS_TRANSITIONS];
+
+    __atomic_store_n(&slot -> seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    transition -> previous = previous;
+    transition -> status   = status;
+    transition -> detected = detected;
+    slot -> transitionCount++;
+    __atomic_store_n(&slot -> seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/** Attach to the bus as a reader.
+ *  upsList is a list of UPS specifications in the same form as given to
+ *  launchClient(). The bus is only used if its writer is running and
+ *  publishes every one of them (and the segment can be trusted, see
+ *  trustedSegment()), otherwise NULL is returned and the caller should poll
+ *  upsd itself. The UPSes are numbered in list order, as with
+ *  launchClient(). Only status changes from now on are replayed.
+ */
+SnapshotBus *attachBus(const gchar *upsList)
+{
+    static const gchar separators[] = " ,\t\n";
+    SnapshotBus *bus;
+    BusSegment  *segment;
+    struct stat  info;
+    gchar       *list;
+    gchar       *spec;
+    gint         index;
+    int          fd;
+
+    if((fd = shm_open(BUS_NAME, O_RDONLY, 0)) < 0) return NULL;
+    if(!trustedSegment(fd) || (fstat(fd, &info) < 0) || (info.st_size < sizeof(BusSegment))) {
+        close(fd);
+        return NULL;
+    }
+    segment = (BusSegment *)mmap(NULL, sizeof(BusSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(segment == MAP_FAILED) return NULL;
+
+    if(!validSegment(segment)) {
+        munmap(segment, sizeof(BusSegment));
+        return NULL;
+    }
+
+    bus = g_new0(SnapshotBus, 1);
+    bus -> segment = segment;
+
+    list = g_strdup(upsList);
+    for(spec = strtok(list, separators); spec && bus; spec = strtok(NULL, separators)) {
+        for(index = 0; index < segment -> upsCount; index++) {
+            if(!strncmp(segment -> names[index], spec, MAX_UPSNAME)) break;
+        }
+
+        if((index == segment -> upsCount) || (bus -> count == MAX_UPS)) {
+            closeBus(bus);
+            bus = NULL;
+        } else {
+            bus -> replayed[bus -> count] = __atomic_load_n(&segment -> slots[index].transitionCount, __ATOMIC_ACQUIRE);
+            bus -> transitionCount[bus -> count] = bus -> replayed[bus -> count];
+            bus -> slot[bus -> count++] = index;
+        }
+    }
+    g_free(list);
+
+    if(bus && (bus -> count == 0)) {
+        closeBus(bus);
+        bus = NULL;
+    }
+    return bus;
+}
+
+/** Return the latest status published for a UPS.
+ *  The status is copied out of the segment under the sequence lock, along
+ *  with its latest transitions for busNextTransition(), the copy stays
+ *  untouched until the next call for the same UPS. Should the writer be
+ *  updating the slot every time we look, the previous copy is returned
+ *  rather than a torn one.
+ *
+ *  \par Arguments:
+ *  \arg \c bus - bus returned by attachBus().
+ *  \arg \c ups - index of the UPS, 0 to busUPSCount() - 1.
+ */
+struct UPSData *busStatus(SnapshotBus *bus, gint ups)
+{
+    BusSlot       *slot = &bus -> segment -> slots[bus -> slot[ups]];
+    struct UPSData copy;
+    BusTransition  transitions[BUS_TRANSITIONS];
+    guint          count;
+    guint          seq;
+    gint           tries;
+
+    for(tries = 0; tries < BUS_READ_TRIES; tries++) {
+        seq = __atomic_load_n(&slot -> seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) continue;
+
+        memcpy(&copy, &slot -> data, sizeof(struct UPSData));
+        count = slot -> transitionCount;
+        if(count != bus -> transitionCount[ups]) memcpy(transitions, slot -> transitions, sizeof(transitions));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot -> seq, __ATOMIC_RELAXED) == seq) {
+            memcpy(&bus -> copy[ups], &copy, sizeof(struct UPSData));
+            if(count != bus -> transitionCount[ups]) memcpy(bus -> transitions[ups], transitions, sizeof(transitions));
+            bus -> transitionCount[ups] = count;
+            break;
+        }
+    }
+    return &bus -> copy[ups];
+}
+
+/** Hand out the next status change of a UPS not yet replayed.
+ *  Changes come from the copy taken by the last busStatus() call for the
+ *  UPS, oldest first. Returns FALSE once there are none left. Should more
+ *  than BUS_TRANSITIONS have been added since the last call, the oldest are
+ *  skipped.
+ *
+ *  \par Arguments:
+ *  \arg \c bus - bus returned by attachBus().
+ *  \arg \c ups - index of the UPS, 0 to busUPSCount() - 1.
+ *  \arg \c transition - destination for the change.
+ */
+gboolean busNextTransition(SnapshotBus *bus, gint ups, BusTransition *transition)
+{
+    if(bus -> replayed[ups] == bus -> transitionCount[ups]) return FALSE;
+
+    if(bus -> transitionCount[ups] - bus -> replayed[ups] > BUS_TRANSITIONS) {
+        bus -> replayed[ups] = bus -> transitionCount[ups] - BUS_TRANSITIONS;
+    }
+    *transition = bus -> transitions[ups][bus -> replayed[ups]++ % BUS_TRANSITIONS];
+    return TRUE;
+}
+
+/** Return the number of UPSes a reader attached for. */
+gint busUPSCount(SnapshotBus *bus)
+{
+    return bus ? bus -> count : 0;
+}
+
+/** Check that the writer of the bus is still running.
+ *  Readers should call this now and again and go back to polling upsd
+ *  themselves once it returns FALSE.
+ */
+gboolean busAlive(SnapshotBus *bus)
+{
+    return validSegment(bus -> segment);
+}
+
+/** Detach from the bus.
+ *  When the writer closes the bus the segment is removed, readers still
+ *  attached notice through busAlive().
+ */
+void closeBus(SnapshotBus *bus)
+{
+    if(bus == NULL) return;
+
+    if(bus -> writable) {
+        bus -> segment -> writer = 0;
+        shm_unlink(BUS_NAME);
+    }
+    munmap(bus -> segment, sizeof(BusSegment));
+    g_free(bus);
+}
@@ -0,0 +1,89 @@
+/**
+ *  \file snapshot_bus.h
+ *  Shared memory snapshot bus header.
+ *  One collector on a machine (gknutc -s) publishes the status of its UPSes
+ *  into a POSIX shared memory segment which any number of plugins can map
+ *  read-only, so they all share one upsd session. See snapshot_bus.c.
+ */
+
+#ifndef SNAPSHOT_BUS
+#define SNAPSHOT_BUS
+
+#include<glib.h>
+#include<sys/types.h>
+#include"nut_connect.h"
+
+/*! Name of the shared memory segment */
+#define BUS_NAME "/gknut"
+
+/*! Identifies a bus segment, "GKNB" in little endian order */
+#define BUS_MAGIC 0x424e4b47
+
+/*! Bump whenever the layout of BusSegment changes (struct UPSData is checked by size) */
+#define BUS_VERSION 2
+
+/*! Attempts a reader makes to get a consistent copy of a slot before settling for the last one */
+#define BUS_READ_TRIES 100
+
+/*! Status changes kept in each slot for readers to replay, a reader falling further behind loses the oldest */
+#define BUS_TRANSITIONS 16
+
+/*! A change in the status flags of a UPS, as the client of the collector saw it. */
+typedef struct
+{
+    guint  previous; /*!< UPS_* flags before the change.                               */
+    guint  status;   /*!< UPS_* flags after it.                                        */
+    gint64 detected; /*!< CLOCK_MONOTONIC time the reply was parsed, in microseconds.  */
+} BusTransition;
+
+/*! One UPS on the bus, guarded by a sequence lock.
+ *  The writer makes seq odd, updates data (or adds a transition) and makes
+ *  seq even again. A reader copies the slot between two reads of seq and
+ *  keeps the copy only if both reads gave the same even value, so it never
+ *  sees a half written status and never holds up the writer.
+ */
+typedef struct
+{
+    guint          seq;                          /*!< Sequence lock, odd while the slot is being written. */
+    struct UPSData data;                         /*!< Latest status of the UPS.                           */
+    guint          transitionCount;              /*!< Transitions added, each goes in count % BUS_TRANSITIONS. */
+    BusTransition  transitions[BUS_TRANSITIONS]; /*!< The latest transitions of the UPS.                  */
+} BusSlot;
+
+/*! Layout of the shared memory segment. */
+typedef struct
+{
+    guint32 magic;                     /*!< BUS_MAGIC.                                            */
+    guint32 version;                   /*!< BUS_VERSION.                                          */
+    guint32 dataSize;                  /*!< sizeof(struct UPSData) of the writer.                 */
+    gint32  upsCount;                  /*!< Number of slots in use.                               */
+    pid_t   writer;                    /*!< Process publishing to the bus, 0 once it has closed.  */
+    gchar   names[MAX_UPS][MAX_UPSNAME]; /*!< UPS specification of each slot, set before publishing. */
+    BusSlot slots[MAX_UPS];            /*!< Status of each UPS.                                   */
+} BusSegment;
+
+/*! A process's view of the bus, either as the writer or as a reader. */
+typedef struct
+{
+    BusSegment    *segment;        /*!< The mapped segment.                                      */
+    gboolean       writable;       /*!< TRUE for the writer, readers map the segment read-only.  */
+    gint           count;          /*!< Readers: number of entries in slot.                      */
+    gint           slot[MAX_UPS];  /*!< Readers: slot of each UPS, in the order they asked for.  */
+    struct UPSData copy[MAX_UPS];  /*!< Readers: last status read for each UPS.                  */
+    guint          transitionCount[MAX_UPS];     /*!< Readers: transitions added as of the copy.  */
+    BusTransition  transitions[MAX_UPS][BUS_TRANSITIONS]; /*!< Readers: the latest as of the copy. */
+    guint          replayed[MAX_UPS];            /*!< Readers: transitions handed out so far.     */
+} SnapshotBus;
+
+/* functions exported from snapshot_bus.c */
+extern SnapshotBus *createBus(const gchar **names, gint count);        /*!< Create the bus, as its writer.              */
+extern void busPublish(SnapshotBus *bus, gint ups, const struct UPSData *status); /*!< Publish the status of a UPS. */
+extern void busPublishTransition(SnapshotBus *bus, gint ups, guint previous, guint status, gint64 detected); /*!< Add a status change. */
+extern SnapshotBus *attachBus(const gchar *upsList);                   /*!< Attach to the bus, if it has every UPS.     */
+extern struct UPSData *busStatus(SnapshotBus *bus, gint ups);          /*!< Latest status of a UPS (readers).           */
+extern gboolean busNextTransition(SnapshotBus *bus, gint ups, BusTransition *transition); /*!< Replay a status change. */
+extern gint busUPSCount(SnapshotBus *bus);                             /*!< Number of UPSes a reader attached for.      */
+extern gboolean busAlive(SnapshotBus *bus);                            /*!< TRUE while the writer is still running.     */
+extern void closeBus(SnapshotBus *bus);                                /*!< Detach, removing the bus if the writer.     */
+
+#endif
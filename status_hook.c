@@ -0,0 +1,301 @@
+/**
+ *  \file status_hook.c
+ *  Status transition hooks.
+ *  Shutdown scripts and the like need to hear about a UPS going on battery
+ *  or running low as soon as possible, not on the next tick of the GUI. The
+ *  client reports every change in the status flags of a UPS the moment the
+ *  status reply is parsed (see TransitionFunc), and hookTransition() copies
+ *  it into a single producer, single consumer queue and wakes the worker
+ *  thread through a pipe. The client thread never waits for anything, if
+ *  the worker falls behind the queue fills and transitions are dropped.
+ *
+ *  The worker runs the hook command with /bin/sh for each transition in
+ *  turn, waiting for one to finish before starting the next so that a
+ *  script always sees them in order. The command inherits the environment
+ *  along with:
+ *  <PRE>
+ *  GKNUT_UPS         UPS specification, as given in the UPS list
+ *  GKNUT_STATUS      status flags now, such as "OB DISCHRG"
+ *  GKNUT_PREVIOUS    status flags before, empty for the first status seen
+ *  GKNUT_SET         flags which have just been set
+ *  GKNUT_CLEARED     flags which have just been cleared
+ *  GKNUT_LATENCY_MS  milliseconds from the status reply to the hook starting
+ *  </PRE>
+ *  The dispatch latency of every hook is also kept in a histogram, see
+ *  hookStats().
+ *
+ *  The command can be changed while the worker runs (setHookCommand()),
+ *  which never waits for a hook in progress - a shutdown script may take
+ *  minutes, and the plugin changes the command from the GUI thread.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<errno.h>
+#include<signal.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<pthread.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+#include"status_hook.h"
+
+/*! Highest descriptor closed in a hook before it starts, so it does not hold our sockets open */
+#define HOOK_MAX_FD 4096
+
+extern char **environ;
+
+static HookEvent    queue[HOOK_QUEUE];      /*!< Transitions waiting for the worker thread.       */
+static guint        queueHead = 0;          /*!< Next slot to fill, only changed by the producer. */
+static guint        queueTail = 0;          /*!< Next slot to run, only changed by the worker.    */
+static guint32      queueDropped = 0;       /*!< Transitions lost because the queue was full.     */
+
+static gint         running = 0;            /*!< TRUE while the worker thread should keep going.  */
+static pthread_t    worker;                 /*!< The worker thread.                               */
+static int          wakeFds[2] = { -1, -1 };/*!< Wakeup pipe, written for each queued transition. */
+static gint         enabled = 0;            /*!< TRUE while hookCommand is not empty.             */
+static gchar       *hookCommand = NULL;     /*!< Command run for each transition.                 */
+
+static pthread_mutex_t commandLock = PTHREAD_MUTEX_INITIALIZER; /*!< Protects hookCommand.        */
+
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER; /*!< Protects stats.               */
+static HookStats       stats;                                 /*!< Everything but dropped.       */
+
+/** Current value of the monotonic clock in microseconds, as used by the client. */
+static gint64 monotonicUsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (gint64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/** Build one environment variable holding a set of status flags. */
+static gchar *flagsVar(const gchar *name, guint flags)
+{
+    gchar text[128];
+
+    statusText(text, sizeof(text), flags, TRUE);
+    return g_strdup_printf("%s=%s", name, text);
+}
+
+/** Run the hook command for a transition and wait for it to finish.
+ *  Everything the child needs is built before the fork, after it the child
+ *  only restores the signal mask (collectors block the signals that stop
+ *  them), closes our descriptors and execs the shell. The command is copied
+ *  first, so it can be changed while the hook runs; an empty one (hooks
+ *  switched off after the transition was queued) runs nothing.
+ */
+static void runHook(const HookEvent *event)
+{
+    gchar  *vars[6];
+    gchar **envp;
+    gchar  *argv[4];
+    gchar  *command;
+    gint64  latency;
+    gint    count;
+    gint    index;
+    gint    used = 0;
+    int     result;
+    int     fd;
+    pid_t   pid;
+    sigset_t none;
+
+    pthread_mutex_lock(&commandLock);
+    command = g_strdup(hookCommand ? hookCommand : "");
+    pthread_mutex_unlock(&commandLock);
+    if(command[0] == '\0') {
+        g_free(command);
+        return;
+    }
+
+    latency = monotonicUsec() - event -> detected;
+
+    vars[0] = g_strdup_printf("GKNUT_UPS=%s", event -> name);
+    vars[1] = flagsVar("GKNUT_STATUS",   event -> status);
+    vars[2] = flagsVar("GKNUT_PREVIOUS", event -> previous);
+    vars[3] = flagsVar("GKNUT_SET",      event -> status & ~event -> previous);
+    vars[4] = flagsVar("GKNUT_CLEARED",  event -> previous & ~event -> status);
+    vars[5] = g_strdup_printf("GKNUT_LATENCY_MS=%.3f", latency / 1000.0);
+
+    /* Our variables replace any of the same name which were inherited */
+    for(count = 0; environ[count]; count++);
+    envp = g_new(gchar *, count + 7);
+    for(index = 0; index < count; index++) {
+        if(strncmp(environ[index], "GKNUT_", 6)) envp[used++] = environ[index];
+    }
+    for(index = 0; index < 6; index++) envp[used++] = vars[index];
+    envp[used] = NULL;
+
+    argv[0] = "sh";
+    argv[1] = "-c";
+    argv[2] = command;
+    argv[3] = NULL;
+    sigemptyset(&none);
+
+    pid = fork();
+    if(pid == 0) {
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        for(fd = 3; fd < HOOK_MAX_FD; fd++) close(fd);
+        execve("/bin/sh", argv, envp);
+        _exit(127);
+    }
+
+    result = -1;
+    if(pid > 0) {
+        while((waitpid(pid, &result, 0) < 0) && (errno == EINTR));
+    }
+
+    pthread_mutex_lock(&statsLock);
+    if(pid > 0) {
+        stats.latency[latencyBucket(latency)]++;
+        stats.run++;
+        stats.lastLatency = latency;
+    }
+    if((pid < 0) || !WIFEXITED(result) || (WEXITSTATUS(result) != 0)) stats.failed++;
+    pthread_mutex_unlock(&statsLock);
+
+    for(index = 0; index < 6; index++) g_free(vars[index]);
+    g_free(envp);
+    g_free(command);
+}
+
+/** Hook worker thread.
+ *  Sleeps in poll() on the wakeup pipe until a transition is queued (or
+ *  stopHooks() asks it to finish), then runs the hooks for everything in
+ *  the queue.
+ */
+static void *hookWorker(void *arg)
+{
+    struct pollfd wake;
+    gchar         drain[16];
+
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if(queueTail == __atomic_load_n(&queueHead, __ATOMIC_ACQUIRE)) {
+            wake.fd      = wakeFds[0];
+            wake.events  = POLLIN;
+            wake.revents = 0;
+            poll(&wake, 1, -1);
+            while(read(wakeFds[0], drain, sizeof(drain)) > 0);
+            continue;
+        }
+
+        runHook(&queue[queueTail % HOOK_QUEUE]);
+        __atomic_store_n(&queueTail, queueTail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/** Start the hook worker thread.
+ *  Transitions passed to hookTransition() run command from now on, the
+ *  statistics start again from nothing. Returns FALSE if the thread could
+ *  not be started.
+ */
+gboolean startHooks(const gchar *command)
+{
+    if(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return TRUE;
+
+    if((wakeFds[0] < 0) && (pipe(wakeFds) != 0)) {
+        wakeFds[0] = wakeFds[1] = -1;
+        return FALSE;
+    }
+    fcntl(wakeFds[0], F_SETFL, fcntl(wakeFds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wakeFds[1], F_SETFL, fcntl(wakeFds[1], F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_lock(&commandLock);
+    g_free(hookCommand);
+    hookCommand = g_strdup(command);
+    pthread_mutex_unlock(&commandLock);
+    __atomic_store_n(&enabled, command[0] != '\0', __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&statsLock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&statsLock);
+    __atomic_store_n(&queueDropped, 0, __ATOMIC_RELAXED);
+    queueTail = __atomic_load_n(&queueHead, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if(pthread_create(&worker, NULL, hookWorker, NULL)) {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/** Change the command run for each transition.
+ *  Unlike stopping the worker and starting it again, this never waits for
+ *  a hook in progress: it finishes with the old command, and transitions
+ *  still queued or yet to come run the new one. An empty command runs
+ *  nothing until another is set. Starts the worker if it is not running,
+ *  returns FALSE if it could not be started.
+ */
+gboolean setHookCommand(const gchar *command)
+{
+    gchar *previous;
+
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return (command[0] == '\0') || startHooks(command);
+
+    pthread_mutex_lock(&commandLock);
+    previous    = hookCommand;
+    hookCommand = g_strdup(command);
+    pthread_mutex_unlock(&commandLock);
+    g_free(previous);
+
+    __atomic_store_n(&enabled, command[0] != '\0', __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+/** Stop the hook worker thread.
+ *  A hook which is running is waited for, anything still queued is
+ *  dropped. Use setHookCommand() to change the command from a thread
+ *  which must not wait.
+ */
+void stopHooks(void)
+{
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    write(wakeFds[1], "", 1);
+    pthread_join(worker, NULL);
+}
+
+/** Queue a transition for the hook worker.
+ *  Called by the client thread (through its TransitionFunc) as soon as the
+ *  status flags of a UPS change. This only copies the transition into the
+ *  queue and writes a byte to the non-blocking wakeup pipe, so it never
+ *  blocks, and does nothing at all when no hook is running or the command
+ *  is empty.
+ */
+void hookTransition(const gchar *name, guint previous, guint status, gint64 detected)
+{
+    HookEvent *event;
+
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || !__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return;
+
+    if(queueHead - __atomic_load_n(&queueTail, __ATOMIC_ACQUIRE) >= HOOK_QUEUE) {
+        __atomic_add_fetch(&queueDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    event = &queue[queueHead % HOOK_QUEUE];
+    strncpy(event -> name, name, MAX_UPSNAME - 1);
+    event -> name[MAX_UPSNAME - 1] = '\0';
+    event -> previous = previous;
+    event -> status   = status;
+    event -> detected = detected;
+    __atomic_store_n(&queueHead, queueHead + 1, __ATOMIC_RELEASE);
+
+    write(wakeFds[1], "", 1);
+}
+
+/** Copy the statistics of the hook worker, see HookStats. */
+void hookStats(HookStats *copy)
+{
+    pthread_mutex_lock(&statsLock);
+    *copy = stats;
+    pthread_mutex_unlock(&statsLock);
+    copy -> dropped = __atomic_load_n(&queueDropped, __ATOMIC_RELAXED);
+}
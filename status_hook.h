@@ -0,0 +1,50 @@
+/**
+ *  \file status_hook.h
+ *  Status transition hook header.
+ *  The client thread hands every change in the status flags of a UPS to the
+ *  hook worker, whose thread runs a user command for each one. See
+ *  status_hook.c for what the command is told.
+ */
+
+#ifndef STATUS_HOOK
+#define STATUS_HOOK
+
+#include<glib.h>
+#include"nut_connect.h"
+
+/*! Number of transitions which can wait for the hook worker, further ones are dropped */
+#define HOOK_QUEUE 64
+
+/*! Longest hook command accepted (plus one for the terminator) */
+#define MAX_HOOKCMD 256
+
+/*! A transition waiting in the queue for the hook worker. */
+typedef struct
+{
+    gchar  name[MAX_UPSNAME]; /*!< UPS specification.                                  */
+    guint  previous;          /*!< UPS_* flags before the transition, 0 if none seen.  */
+    guint  status;            /*!< UPS_* flags after it.                               */
+    gint64 detected;          /*!< Monotonic time (microseconds) the reply was parsed. */
+} HookEvent;
+
+/*! What the hook worker has done since it was started.
+ *  Dispatch latency runs from the client parsing the status reply to the
+ *  hook command being started, in the same log-scale buckets as PollHealth.
+ */
+typedef struct
+{
+    guint32 latency[RTT_BUCKETS]; /*!< Hooks started, by dispatch latency.               */
+    guint32 run;                  /*!< Total of latency.                                 */
+    guint32 failed;               /*!< Hooks which could not be started or exited non-zero. */
+    guint32 dropped;              /*!< Transitions lost because the queue was full.      */
+    gint64  lastLatency;          /*!< Dispatch latency of the last hook, microseconds.  */
+} HookStats;
+
+/* functions exported from status_hook.c */
+extern gboolean startHooks(const gchar *command);                        /*!< Start the hook worker thread.         */
+extern gboolean setHookCommand(const gchar *command);                    /*!< Change the command, never waits.      */
+extern void stopHooks(void);                                             /*!< Stop the worker thread.               */
+extern void hookTransition(const gchar *name, guint previous, guint status, gint64 detected); /*!< Queue a transition, never blocks. */
+extern void hookStats(HookStats *stats);                                 /*!< Copy the worker statistics.           */
+
+#endif
@@ -0,0 +1,620 @@
+/**
+ *  \file fakeupsd.c
+ *  Scriptable stand-in for upsd.
+ *  Speaks enough of both upsd dialects for the client - REQ for upsd before
+ *  2.0, and LIST UPS / LIST VAR / GET VAR for current releases - and plays
+ *  a scenario script which changes the UPS variables and the behaviour of
+ *  the server over time, so the client can be tested (and timed) against
+ *  mains failures, flapping status, slow or broken servers and so on
+ *  without a real UPS.
+ *
+ *  Usage: fakeupsd [-d] [-p port] scenario
+ *
+ *  A scenario is a list of steps, one per line, blank lines and lines
+ *  starting with # are ignored:
+ *  <PRE>
+ *  ups <name>          declare a UPS (the first is the default), later sets apply to it
+ *  set <var> <value>   set a variable of the current UPS, e.g. set ups.status OB DISCHRG
+ *  unset <var>         remove a variable, so it is reported as not supported
+ *  wait <ms>           pause the script
+ *  delay <ms>          hold back each reply for this long from now on (0 to stop)
+ *  split <bytes>       send replies this many bytes at a time, 10 ms apart (0 to stop)
+ *  truncate            send only the first half of the next reply line, then disconnect
+ *  long <bytes>        send a line of this many bytes (without a newline) ahead of the next reply
+ *  hang                stop answering (connections are kept open)
+ *  resume              start answering again
+ *  drop                disconnect every client
+ *  refuse              close the listening socket, so connections are refused
+ *  accept              listen again
+ *  </PRE>
+ *  Steps up to the first wait run at once, the clock for the rest starts
+ *  when the first client connects so a scenario plays out the same way
+ *  however long the client takes to start. The server keeps running with
+ *  the final state once the script ends. With -d the server goes into the
+ *  background once it is listening and prints its process id.
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdarg.h>
+#include<string.h>
+#include<errno.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<time.h>
+#include<signal.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+
+#define MAX_FAKEUPS   8     /*!< UPSes a scenario can declare.                  */
+#define MAX_FAKEVARS  32    /*!< Variables each UPS can have.                   */
+#define MAX_STEPS     512   /*!< Steps in a scenario.                           */
+#define MAX_CLIENTS   16    /*!< Clients connected at once.                     */
+#define MAX_NAME      64    /*!< Longest UPS or variable name.                  */
+#define MAX_VALUE     128   /*!< Longest variable value.                        */
+#define MAX_LINE      1024  /*!< Longest request line.                          */
+#define MAX_QUEUED    64    /*!< Replies waiting to be released to a client.    */
+#define SPLIT_PAUSE   10    /*!< Milliseconds between pieces of a split reply.  */
+#define DEFAULT_PORT  3493  /*!< Port to listen on.                             */
+
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+/*! A UPS variable. */
+typedef struct
+{
+    char name[MAX_NAME];   /*!< NUT variable name, e.g. input.voltage. */
+    char value[MAX_VALUE]; /*!< Current value.                         */
+} FakeVar;
+
+/*! A UPS served by the fake server. */
+typedef struct
+{
+    char    name[MAX_NAME];        /*!< UPS name.                      */
+    FakeVar vars[MAX_FAKEVARS];    /*!< Variables, in the order set.   */
+    int     varCount;              /*!< Number of entries in vars.     */
+} FakeUPS;
+
+/*! Kinds of scenario step. */
+enum
+{
+    STEP_UPS, STEP_SET, STEP_UNSET, STEP_WAIT, STEP_DELAY, STEP_SPLIT, STEP_TRUNCATE, STEP_LONG,
+    STEP_HANG, STEP_RESUME, STEP_DROP, STEP_REFUSE, STEP_ACCEPT
+};
+
+/*! A single scenario step. */
+typedef struct
+{
+    int  kind;             /*!< One of STEP_*.                               */
+    int  number;           /*!< Milliseconds or bytes, for the steps needing one. */
+    char name[MAX_NAME];   /*!< UPS or variable name.                        */
+    char value[MAX_VALUE]; /*!< Value for STEP_SET.                          */
+} Step;
+
+/*! Scenario keywords, indexed by step kind. */
+static const char *stepNames[] =
+{
+    "ups", "set", "unset", "wait", "delay", "split", "truncate", "long", "hang", "resume", "drop", "refuse", "accept", NULL
+};
+
+/*! A reply which is held back until its release time. */
+typedef struct
+{
+    long long at;  /*!< Monotonic time (ms) when the reply may be sent. */
+    int       end; /*!< Offset in Client.out just past the reply.       */
+} Queued;
+
+/*! A connected client. */
+typedef struct
+{
+    int       fd;                 /*!< Socket, or -1 if the slot is free.             */
+    char      in[MAX_LINE];       /*!< Request data received but not yet handled.     */
+    int       inLen;              /*!< Number of bytes in in.                         */
+    char     *out;                /*!< Reply data waiting to be sent.                 */
+    int       outLen;             /*!< Number of bytes in out.                        */
+    int       outSize;            /*!< Size of out.                                   */
+    Queued    queue[MAX_QUEUED];  /*!< Release times of the replies in out.           */
+    int       queueLen;           /*!< Number of entries in queue.                    */
+    long long nextWrite;          /*!< Earliest time for the next write (split mode). */
+    int       closing;            /*!< Disconnect once out has been sent.             */
+} Client;
+
+static FakeUPS   upses[MAX_FAKEUPS];     /*!< The UPSes being served.                        */
+static int       upsCount = 0;           /*!< Number of entries in upses.                    */
+static Step      steps[MAX_STEPS];       /*!< The scenario.                                  */
+static int       stepCount = 0;          /*!< Number of entries in steps.                    */
+static int       stepNext = 0;           /*!< Next step to run.                              */
+static long long stepAt = 0;             /*!< Time the next step is due, once started.       */
+static long long started = 0;            /*!< When the first client connected, 0 until then. */
+static Client    clients[MAX_CLIENTS];   /*!< Connected clients.                             */
+static int       listenFd = -1;          /*!< Listening socket, or -1 while refusing.        */
+static int       port = DEFAULT_PORT;    /*!< Port to listen on.                             */
+static int       replyDelay = 0;         /*!< Milliseconds to hold back each reply.          */
+static int       splitBytes = 0;         /*!< Bytes per write, 0 to send replies whole.      */
+static int       truncateNext = 0;       /*!< Truncate the next reply line and disconnect.   */
+static int       longNext = 0;           /*!< Bytes of overlong line ahead of the next reply. */
+static int       hanging = 0;            /*!< Ignore requests.                               */
+static int       current = -1;           /*!< UPS the set and unset steps apply to.          */
+
+/*! Legacy REQ variable names and the NUT variables they report. */
+static const struct
+{
+    const char *legacy; /*!< REQ name.          */
+    const char *name;   /*!< NUT variable name. */
+} legacyVars[] =
+{
+    { "UTILITY",  "input.voltage"    },
+    { "ACFREQ",   "input.frequency"  },
+    { "OUTVOLT",  "output.voltage"   },
+    { "BATTPCT",  "battery.charge"   },
+    { "BATTVOLT", "battery.voltage"  },
+    { "LOADPCT",  "ups.load"         },
+    { "UPSTEMP",  "ups.temperature"  },
+    { "STATUS",   "ups.status"       },
+    { NULL,       NULL               }
+};
+
+/** Current value of the monotonic clock in milliseconds. */
+static long long monotonicMsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/** Find a UPS by name, an empty name means the default (first) UPS.
+ *  Returns NULL if there is no such UPS.
+ */
+static FakeUPS *findUPS(const char *name)
+{
+    int index;
+
+    if(upsCount && (name[0] == '\0')) return &upses[0];
+    for(index = 0; index < upsCount; index++) {
+        if(!strcmp(upses[index].name, name)) return &upses[index];
+    }
+    return NULL;
+}
+
+/** Find a variable of a UPS, returns NULL if it has not been set. */
+static FakeVar *findVar(FakeUPS *ups, const char *name)
+{
+    int index;
+
+    for(index = 0; index < ups -> varCount; index++) {
+        if(!strcmp(ups -> vars[index].name, name)) return &ups -> vars[index];
+    }
+    return NULL;
+}
+
+/** Read a scenario file into steps.
+ *  Returns 0 on success, or prints the problem and returns -1.
+ */
+static int loadScenario(const char *path)
+{
+    FILE *file;
+    char  line[MAX_LINE];
+    char  word[MAX_NAME];
+    char *pos;
+    int   lineNo = 0;
+    int   kind;
+    int   used;
+    Step *step;
+
+    if((file = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), file)) {
+        lineNo++;
+        line[strcspn(line, "\r\n")] = '\0';
+        for(pos = line; (*pos == ' ') || (*pos == '\t'); pos++);
+        if((*pos == '\0') || (*pos == '#')) continue;
+
+        if((sscanf(pos, "%63s%n", word, &used) != 1) || (stepCount == MAX_STEPS)) goto bad;
+        for(kind = 0; stepNames[kind] && strcmp(stepNames[kind], word); kind++);
+        if(stepNames[kind] == NULL) goto bad;
+
+        step = &steps[stepCount++];
+        memset(step, 0, sizeof(Step));
+        step -> kind = kind;
+        for(pos += used; (*pos == ' ') || (*pos == '\t'); pos++);
+
+        switch(kind) {
+            case STEP_UPS:
+            case STEP_UNSET:
+                if(sscanf(pos, "%63s", step -> name) != 1) goto bad;
+                break;
+            case STEP_SET:
+                if(sscanf(pos, "%63s%n", step -> name, &used) != 1) goto bad;
+                for(pos += used; (*pos == ' ') || (*pos == '\t'); pos++);
+                strncpy(step -> value, pos, MAX_VALUE - 1);
+                break;
+            case STEP_WAIT:
+            case STEP_DELAY:
+            case STEP_SPLIT:
+            case STEP_LONG:
+                if(sscanf(pos, "%d", &step -> number) != 1) goto bad;
+                break;
+        }
+    }
+    fclose(file);
+    return 0;
+
+bad:
+    fprintf(stderr, "%s:%d: bad step \"%s\"\n", path, lineNo, line);
+    fclose(file);
+    return -1;
+}
+
+/** Close a client connection and free its slot. */
+static void closeClient(Client *client)
+{
+    close(client -> fd);
+    free(client -> out);
+    memset(client, 0, sizeof(Client));
+    client -> fd = -1;
+}
+
+/** Open the listening socket on the loopback address. Returns -1 on failure. */
+static int openListener(void)
+{
+    struct sockaddr_in addr;
+    int                one = 1;
+    int                fd;
+
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 16) < 0)) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+/** Run one scenario step. */
+static void runStep(Step *step)
+{
+    FakeUPS *ups;
+    FakeVar *var;
+    int      index;
+
+    switch(step -> kind) {
+        case STEP_UPS:
+            if((ups = findUPS(step -> name)) != NULL) {
+                current = ups - upses;
+            } else if(upsCount < MAX_FAKEUPS) {
+                current = upsCount++;
+                strcpy(upses[current].name, step -> name);
+            }
+            break;
+        case STEP_SET:
+            if(current < 0) break;
+            if((var = findVar(&upses[current], step -> name)) == NULL) {
+                if(upses[current].varCount == MAX_FAKEVARS) break;
+                var = &upses[current].vars[upses[current].varCount++];
+                strcpy(var -> name, step -> name);
+            }
+            strcpy(var -> value, step -> value);
+            break;
+        case STEP_UNSET:
+            if((current >= 0) && ((var = findVar(&upses[current], step -> name)) != NULL)) {
+                *var = upses[current].vars[--upses[current].varCount];
+            }
+            break;
+        case STEP_WAIT:
+            stepAt += step -> number;
+            break;
+        case STEP_DELAY:
+            replyDelay = step -> number;
+            break;
+        case STEP_SPLIT:
+            splitBytes = step -> number;
+            break;
+        case STEP_TRUNCATE:
+            truncateNext = 1;
+            break;
+        case STEP_LONG:
+            longNext = step -> number;
+            break;
+        case STEP_HANG:
+            hanging = 1;
+            break;
+        case STEP_RESUME:
+            hanging = 0;
+            break;
+        case STEP_DROP:
+            for(index = 0; index < MAX_CLIENTS; index++) {
+                if(clients[index].fd >= 0) closeClient(&clients[index]);
+            }
+            break;
+        case STEP_REFUSE:
+            if(listenFd >= 0) close(listenFd);
+            listenFd = -1;
+            break;
+        case STEP_ACCEPT:
+            if(listenFd < 0) listenFd = openListener();
+            break;
+    }
+}
+
+/** Run every step which is due.
+ *  Before the first client connects only the steps up to the first wait run.
+ */
+static void runSteps(long long now)
+{
+    while(stepNext < stepCount) {
+        if(started ? (now < started + stepAt) : (steps[stepNext].kind == STEP_WAIT)) return;
+        runStep(&steps[stepNext++]);
+    }
+}
+
+/** Queue a reply line for a client.
+ *  The line is held back by the current reply delay. If a truncated line was
+ *  asked for, only its first half is sent and the client is disconnected.
+ *  An overlong line asked for goes in front of it, running into the line.
+ */
+static void reply(Client *client, long long now, const char *format, ...)
+{
+    char    line[MAX_LINE];
+    va_list args;
+    int     len;
+
+    if(client -> closing) return;
+
+    va_start(args, format);
+    len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if(len >= (int)sizeof(line)) len = sizeof(line) - 1;
+
+    if(truncateNext) {
+        truncateNext      = 0;
+        len               = len / 2;
+        client -> closing = 1;
+    }
+
+    if(client -> outLen + longNext + len > client -> outSize) {
+        client -> outSize = (client -> outLen + longNext + len) * 2;
+        client -> out     = realloc(client -> out, client -> outSize);
+    }
+    memset(client -> out + client -> outLen, 'x', longNext);
+    client -> outLen += longNext;
+    longNext          = 0;
+    memcpy(client -> out + client -> outLen, line, len);
+    client -> outLen += len;
+
+    /* Replies are released in order, so none may be due before the one ahead of it */
+    if(client -> queueLen && ((client -> queue[client -> queueLen - 1].at >= now + replyDelay) || (client -> queueLen == MAX_QUEUED))) {
+        client -> queue[client -> queueLen - 1].end = client -> outLen;
+    } else {
+        client -> queue[client -> queueLen].at  = now + replyDelay;
+        client -> queue[client -> queueLen].end = client -> outLen;
+        client -> queueLen++;
+    }
+}
+
+/** Answer a single request line. */
+static void handleRequest(Client *client, char *line, long long now)
+{
+    FakeUPS *ups;
+    FakeVar *var;
+    char     arg1[MAX_LINE];
+    char     arg2[MAX_LINE];
+    char    *at;
+    int      index;
+
+    arg1[0] = arg2[0] = '\0';
+
+    if(!strcmp(line, "LIST UPS")) {
+        reply(client, now, "BEGIN LIST UPS\n");
+        for(index = 0; index < upsCount; index++) {
+            reply(client, now, "UPS %s \"Fake UPS\"\n", upses[index].name);
+        }
+        reply(client, now, "END LIST UPS\n");
+    } else if(sscanf(line, "LIST VAR %1023s", arg1) == 1) {
+        if((ups = findUPS(arg1)) == NULL) {
+            reply(client, now, "ERR UNKNOWN-UPS\n");
+            return;
+        }
+        reply(client, now, "BEGIN LIST VAR %s\n", ups -> name);
+        for(index = 0; index < ups -> varCount; index++) {
+            reply(client, now, "VAR %s %s \"%s\"\n", ups -> name, ups -> vars[index].name, ups -> vars[index].value);
+        }
+        reply(client, now, "END LIST VAR %s\n", ups -> name);
+    } else if(sscanf(line, "GET VAR %1023s %1023s", arg1, arg2) == 2) {
+        if((ups = findUPS(arg1)) == NULL) {
+            reply(client, now, "ERR UNKNOWN-UPS\n");
+        } else if((var = findVar(ups, arg2)) == NULL) {
+            reply(client, now, "ERR VAR-NOT-SUPPORTED\n");
+        } else {
+            reply(client, now, "VAR %s %s \"%s\"\n", ups -> name, var -> name, var -> value);
+        }
+    } else if(sscanf(line, "REQ %1023s", arg1) == 1) {
+        /* REQ <VAR>[@<ups>], answered by ANS <VAR>[@<ups>] <value> */
+        if((at = strchr(arg1, '@')) != NULL) *at++ = '\0';
+        for(index = 0; legacyVars[index].legacy && strcmp(legacyVars[index].legacy, arg1); index++);
+
+        if((ups = findUPS(at ? at : "")) == NULL) {
+            reply(client, now, "ERR UNKNOWN-UPS\n");
+        } else if(!legacyVars[index].legacy || ((var = findVar(ups, legacyVars[index].name)) == NULL)) {
+            reply(client, now, "ERR VAR-NOT-SUPPORTED\n");
+        } else {
+            reply(client, now, at ? "ANS %s@%s %s\n" : "ANS %s%s %s\n", arg1, at ? at : "", var -> value);
+        }
+    } else if(!strcmp(line, "LOGOUT")) {
+        reply(client, now, "OK Goodbye\n");
+        client -> closing = 1;
+    } else {
+        reply(client, now, "ERR UNKNOWN-COMMAND\n");
+    }
+}
+
+/** Read requests from a client and answer every complete line. */
+static void readRequests(Client *client, long long now)
+{
+    char *line;
+    char *eol;
+    int   len;
+
+    len = read(client -> fd, client -> in + client -> inLen, sizeof(client -> in) - client -> inLen);
+    if((len <= 0) && ((len == 0) || (errno != EAGAIN))) {
+        closeClient(client);
+        return;
+    }
+    client -> inLen += len;
+
+    for(line = client -> in; (eol = memchr(line, '\n', client -> inLen - (line - client -> in))) != NULL; line = eol + 1) {
+        *eol = '\0';
+        if((eol > line) && (eol[-1] == '\r')) eol[-1] = '\0';
+        if(!hanging) handleRequest(client, line, now);
+    }
+
+    client -> inLen -= line - client -> in;
+    memmove(client -> in, line, client -> inLen);
+    if(client -> inLen == sizeof(client -> in)) closeClient(client);
+}
+
+/** Send whatever replies to a client are due.
+ *  Returns the time at which more will be due, or 0 if nothing is waiting.
+ */
+static long long sendReplies(Client *client, long long now)
+{
+    int ready = 0;
+    int sent;
+    int index;
+
+    while((ready < client -> queueLen) && (client -> queue[ready].at <= now)) ready++;
+    if(ready == 0) return client -> queueLen ? client -> queue[0].at : 0;
+    if(now < client -> nextWrite) return client -> nextWrite;
+
+    sent = client -> queue[ready - 1].end;
+    if(splitBytes && (sent > splitBytes)) sent = splitBytes;
+
+    if((sent = write(client -> fd, client -> out, sent)) < 0) {
+        if(errno != EAGAIN) closeClient(client);
+        return now + 1;
+    }
+
+    memmove(client -> out, client -> out + sent, client -> outLen - sent);
+    client -> outLen -= sent;
+    for(index = 0; index < client -> queueLen; index++) client -> queue[index].end -= sent;
+    while(client -> queueLen && (client -> queue[0].end <= 0)) {
+        memmove(client -> queue, client -> queue + 1, --client -> queueLen * sizeof(Queued));
+    }
+
+    if((client -> outLen == 0) && client -> closing) {
+        closeClient(client);
+        return 0;
+    }
+    if(splitBytes) client -> nextWrite = now + SPLIT_PAUSE;
+    return client -> queueLen ? MAX(now + 1, client -> nextWrite) : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd fds[MAX_CLIENTS + 1];
+    Client       *slot[MAX_CLIENTS + 1];
+    long long     now;
+    long long     wake;
+    long long     due;
+    int           daemonize = 0;
+    int           count;
+    int           index;
+    int           fd;
+    int           opt;
+    pid_t         pid;
+
+    while((opt = getopt(argc, argv, "dp:")) != -1) {
+        switch(opt) {
+            case 'd': daemonize = 1;                  break;
+            case 'p': port      = atoi(optarg);       break;
+            default:
+                fprintf(stderr, "Usage: fakeupsd [-d] [-p port] scenario\n");
+                return 2;
+        }
+    }
+    if((optind != argc - 1) || (loadScenario(argv[optind]) < 0)) {
+        fprintf(stderr, "Usage: fakeupsd [-d] [-p port] scenario\n");
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for(index = 0; index < MAX_CLIENTS; index++) clients[index].fd = -1;
+
+    if((listenFd = openListener()) < 0) {
+        perror("fakeupsd: listen");
+        return 1;
+    }
+    runSteps(monotonicMsec());
+
+    /* Only go into the background once connections can be accepted */
+    if(daemonize) {
+        if((pid = fork()) < 0) return 1;
+        if(pid) {
+            printf("%d\n", (int)pid);
+            return 0;
+        }
+        setsid();
+        fclose(stdout);
+    }
+
+    for(;;) {
+        now  = monotonicMsec();
+        runSteps(now);
+        wake = (started && (stepNext < stepCount)) ? started + stepAt : 0;
+
+        count = 0;
+        if(listenFd >= 0) {
+            fds[count].fd     = listenFd;
+            fds[count].events = POLLIN;
+            slot[count++]     = NULL;
+        }
+        for(index = 0; index < MAX_CLIENTS; index++) {
+            if(clients[index].fd < 0) continue;
+
+            due = sendReplies(&clients[index], now);
+            if(clients[index].fd < 0) continue;
+            if(due && (!wake || (due < wake))) wake = due;
+
+            fds[count].fd     = clients[index].fd;
+            fds[count].events = POLLIN;
+            slot[count++]     = &clients[index];
+        }
+
+        if(poll(fds, count, wake ? (int)MAX(wake - now, 0) : -1) < 0) {
+            if(errno == EINTR) continue;
+            perror("fakeupsd: poll");
+            return 1;
+        }
+
+        now = monotonicMsec();
+        for(index = 0; index < count; index++) {
+            if(!fds[index].revents) continue;
+
+            if(slot[index] == NULL) {
+                if((fd = accept(listenFd, NULL, NULL)) < 0) continue;
+                for(opt = 0; (opt < MAX_CLIENTS) && (clients[opt].fd >= 0); opt++);
+                if(opt == MAX_CLIENTS) {
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+                clients[opt].fd = fd;
+                if(!started) started = now;
+            } else if(slot[index] -> fd >= 0) {
+                readRequests(slot[index], now);
+            }
+        }
+    }
+}
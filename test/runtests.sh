@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Runs gknutc against fakeupsd for every scenario in test/scenarios.
+#
+# Besides the steps for fakeupsd, each scenario carries the test in
+# comment lines:
+#   #! args: <gknutc arguments>   @PORT@ is replaced by the port of the server,
+#                                 shell quoting may be used
+#   #! expect: <regex>            each must match a line of output after the
+#                                 line the previous one matched
+#   #! reject: <regex>            must not match any line of output
+#
+# Usage: test/runtests.sh [scenario...]
+
+cd "`dirname "$0"`/.." || exit 1
+
+GKNUTC=./gknutc
+FAKEUPSD=test/fakeupsd
+PORT=${FAKEUPSD_PORT:-34930}
+OUTPUT=${TMPDIR:-/tmp}/gknut-test.$$
+
+if [ $# -eq 0 ]; then
+    set -- test/scenarios/*.scn
+fi
+
+passed=0
+failed=0
+
+for scenario in "$@"; do
+    name=`basename "$scenario" .scn`
+    PORT=`expr $PORT + 1`
+    args=`sed -n "s/^#! args: //p" "$scenario" | sed "s/@PORT@/$PORT/g"`
+
+    if ! pid=`$FAKEUPSD -d -p $PORT "$scenario"`; then
+        echo "FAIL $name: fakeupsd did not start"
+        failed=`expr $failed + 1`
+        continue
+    fi
+    eval "$GKNUTC $args" > "$OUTPUT" 2>&1
+    kill $pid 2> /dev/null
+
+    problem=`sed -n "s/^#! expect: //p" "$scenario" | awk '
+        BEGIN { count = 0; matched = 0 }
+        FILENAME == "-" { pattern[count++] = $0; next }
+        matched < count && $0 ~ pattern[matched] { matched++ }
+        END { if(matched < count) print "expected " pattern[matched] }' - "$OUTPUT"`
+
+    if [ -z "$problem" ]; then
+        problem=`sed -n "s/^#! reject: //p" "$scenario" | while read pattern; do
+            if grep -E -q -e "$pattern" "$OUTPUT"; then
+                echo "unexpected $pattern"
+                break
+            fi
+        done`
+    fi
+
+    if [ -z "$problem" ]; then
+        echo "PASS $name"
+        passed=`expr $passed + 1`
+    else
+        echo "FAIL $name: $problem"
+        sed "s/^/    /" "$OUTPUT"
+        failed=`expr $failed + 1`
+    fi
+done
+
+rm -f "$OUTPUT"
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]